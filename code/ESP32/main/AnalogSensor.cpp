@@ -1,3 +1,4 @@
+#define LOG_MODULE PLC
 #include <Arduino.h>
 #include <Adafruit_ADS1X15.h>
 #include "Log.h"
@@ -11,6 +12,7 @@ namespace EDGEBOX
 	AnalogSensor::AnalogSensor(int channel)
 	{
 		_channel = channel;
+		snprintf(_name, sizeof(_name), "AI%d", _channel);
 		_count = 0;
 		_numberOfSummations = 0;
 		_rollingSum = 0;
@@ -20,14 +22,6 @@ namespace EDGEBOX
 	{
 	}
 
-	std::string AnalogSensor::Channel()
-	{
-		std::stringstream ss;
-		ss << "AI" << _channel;
-		std::string formattedString = ss.str();
-		return formattedString;
-	}
-
 	void AnalogSensor::Run()
 	{
 		AddReading(ads.readADC_SingleEnded(_channel));
@@ -1,3 +1,4 @@
+#define LOG_MODULE PLC
 #include <Arduino.h>
 #include "Log.h"
 #include "Coil.h"
@@ -7,6 +8,7 @@ namespace EDGEBOX
 	Coil::Coil(int sensorPin)
 	{
 		_sensorPin = sensorPin;
+		snprintf(_name, sizeof(_name), "GPIO_%d", _sensorPin);
 		pinMode(sensorPin, OUTPUT);
 	}
 
@@ -14,14 +16,6 @@ namespace EDGEBOX
 	{
 	}
 
-	std::string Coil::Pin()
-	{
-		std::stringstream ss;
-		ss << "GPIO_" << _sensorPin;
-		std::string formattedString = ss.str();
-		return formattedString;
-	}
-
 	// level in 0 -> 100% range
 	bool Coil::Level()
 	{
@@ -0,0 +1,147 @@
+#define LOG_MODULE MQTT
+#include <Arduino.h>
+#include "Log.h"
+#include "HelperFunctions.h"
+#include "CommandRouter.h"
+
+namespace EDGEBOX
+{
+	bool CommandRouter::on(const char *command, CommandHandler handler, std::initializer_list<const char *> fields)
+	{
+		uint32_t hash = fnv1a(FNV_OFFSET_BASIS, command, strlen(command));
+		for (uint32_t i = 0; i < COMMAND_ROUTES; i++)
+		{
+			Route &r = _routes[(hash + i) & (COMMAND_ROUTES - 1)];
+			if (r.name == nullptr || strcmp(r.name, command) == 0)
+			{
+				r.name = command;
+				r.hash = hash;
+				r.handler = handler;
+				r.filter.clear();
+				for (const char *field : fields)
+				{
+					r.filter[field] = true;
+				}
+				r.filtered = fields.size() > 0;
+				return true;
+			}
+		}
+		loge("No room for the %s command route", command);
+		return false;
+	}
+
+	CommandRouter::Route *CommandRouter::find(const char *command)
+	{
+		uint32_t hash = fnv1a(FNV_OFFSET_BASIS, command, strlen(command));
+		for (uint32_t i = 0; i < COMMAND_ROUTES; i++)
+		{
+			Route &r = _routes[(hash + i) & (COMMAND_ROUTES - 1)];
+			if (r.name == nullptr)
+			{
+				return nullptr;
+			}
+			if (r.hash == hash && strcmp(r.name, command) == 0)
+			{
+				return &r;
+			}
+		}
+		return nullptr;
+	}
+
+	bool CommandRouter::Assemble(esp_mqtt_event_handle_t event, const char *&topic, const uint8_t *&data, size_t &len)
+	{
+		if (event->current_data_offset == 0)
+		{
+			// only the first fragment carries the topic, which isn't NUL terminated
+			_arrived = micros();
+			snprintf(_topic, sizeof(_topic), "%.*s", event->topic_len, event->topic);
+			_expected = 0;
+			if (event->data_len == event->total_data_len)
+			{
+				topic = _topic;
+				data = (const uint8_t *)event->data;
+				len = event->data_len;
+				return true;
+			}
+			_fragmented++;
+			if (event->total_data_len > MQTT_COMMAND_MAX)
+			{
+				_oversize++;
+				logw("MQTT message on %s dropped, %d bytes exceeds %d", _topic, event->total_data_len, MQTT_COMMAND_MAX);
+				return false;
+			}
+			_expected = event->total_data_len;
+			_received = 0;
+		}
+		if (_expected == 0 || event->current_data_offset != (int)_received || _received + event->data_len > _expected)
+		{
+			_expected = 0; // not the message being reassembled
+			return false;
+		}
+		memcpy(_payload + _received, event->data, event->data_len);
+		_received += event->data_len;
+		if (_received < _expected)
+		{
+			return false;
+		}
+		_expected = 0;
+		topic = _topic;
+		data = _payload;
+		len = _received;
+		return true;
+	}
+
+	void CommandRouter::Dispatch(const char *prefix, const char *topic, const uint8_t *data, size_t len, PayloadCodec &codec)
+	{
+		JsonDocument doc;
+		size_t prefixLen = strlen(prefix);
+		Route *route = nullptr;
+		if (strncmp(topic, prefix, prefixLen) == 0 && strncmp(topic + prefixLen, "/cmnd/", 6) == 0)
+		{
+			route = find(topic + prefixLen + 6);
+		}
+		if (route == nullptr)
+		{
+			_unrouted++;
+			if (_other && codec.Decode(data, len, doc))
+			{
+				_other(topic, doc);
+			}
+			else
+			{
+				_invalid++;
+				logd("MQTT payload on %s is not valid %s!", topic, PayloadCodec::Name(codec.encoding()));
+			}
+			return;
+		}
+		if (len > 0 && !codec.Decode(data, len, doc, route->filtered ? &route->filter : nullptr))
+		{
+			_invalid++;
+			logd("MQTT payload on %s is not valid %s!", topic, PayloadCodec::Name(codec.encoding()));
+			return;
+		}
+		route->handler(topic, doc);
+		route->count++;
+		route->lastLatency = micros() - _arrived;
+		route->maxLatency = max(route->maxLatency, route->lastLatency);
+	}
+
+	void CommandRouter::getStatistics(JsonObject &stats)
+	{
+		JsonObject routes = stats["routes"].to<JsonObject>();
+		for (auto &r : _routes)
+		{
+			if (r.name != nullptr)
+			{
+				JsonObject route = routes[r.name].to<JsonObject>();
+				route["count"] = r.count;
+				route["latency_us"] = r.lastLatency;
+				route["max_latency_us"] = r.maxLatency;
+			}
+		}
+		stats["unrouted"] = _unrouted;
+		stats["invalid"] = _invalid;
+		stats["fragmented"] = _fragmented;
+		stats["oversize"] = _oversize;
+	}
+}
@@ -1,3 +1,4 @@
+#define LOG_MODULE PLC
 #include <Arduino.h>
 #include "Log.h"
 #include "DigitalSensor.h"
@@ -7,6 +8,7 @@ namespace EDGEBOX
 	DigitalSensor::DigitalSensor(int sensorPin)
 	{
 		_sensorPin = sensorPin;
+		snprintf(_name, sizeof(_name), "GPIO_%d", _sensorPin);
 		pinMode(sensorPin, INPUT_PULLUP);
 	}
 
@@ -14,14 +16,6 @@ namespace EDGEBOX
 	{
 	}
 
-	std::string DigitalSensor::Pin()
-	{
-		std::stringstream ss;
-		ss << "GPIO_" << _sensorPin;
-		std::string formattedString = ss.str();
-		return formattedString;
-	}
-
 	// level in 0 -> 100% range
 	bool DigitalSensor::Level()
 	{
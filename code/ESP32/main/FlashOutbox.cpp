@@ -0,0 +1,290 @@
+#define LOG_MODULE MQTT
+#include <Arduino.h>
+#include <stddef.h>
+#include "esp_rom_crc.h"
+#include "Log.h"
+#include "FlashOutbox.h"
+
+namespace EDGEBOX
+{
+	static const uint32_t OUTBOX_MAGIC = 0x584F424F; // "OBOX"
+	// the state word only ever clears bits, no erase needed between steps
+	static const uint32_t OUTBOX_WRITING = 0xFFFFFFFF;
+	static const uint32_t OUTBOX_COMMITTED = 0x0000FFFF;
+	static const uint32_t OUTBOX_SENT = 0x00000000;
+
+	bool FlashOutbox::begin(uint32_t capacity)
+	{
+		_partition = nullptr;
+		if (capacity == 0)
+		{
+			logi("Outbox disabled");
+			return false;
+		}
+		const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+		if (partition == nullptr)
+		{
+			loge("Outbox needs a spiffs data partition");
+			return false;
+		}
+		_capacity = min(capacity, (uint32_t)partition->size) / OUTBOX_SECTOR * OUTBOX_SECTOR;
+		if (_capacity < 2 * OUTBOX_SECTOR)
+		{
+			loge("Outbox capacity too small: %d", capacity);
+			return false;
+		}
+		_partition = partition;
+		// recover the ring, head follows the newest record, tail is the oldest committed one
+		bool found = false;
+		bool pendingFound = false;
+		uint32_t newest = 0;
+		uint32_t oldest = 0;
+		_head = 0;
+		_tail = 0;
+		_pending = 0;
+		_peekedCount = 0;
+		Header header;
+		for (uint32_t sector = 0; sector < _capacity; sector += OUTBOX_SECTOR)
+		{
+			for (uint32_t offset = sector; offset + sizeof(Header) <= sector + OUTBOX_SECTOR; offset += recordSize(header.len))
+			{
+				if (!readHeader(offset, header))
+				{
+					break; // blank or foreign data, nothing more in this sector
+				}
+				if (!found || (int32_t)(header.seq - newest) > 0)
+				{
+					newest = header.seq;
+					_head = (offset + recordSize(header.len)) % _capacity;
+					found = true;
+				}
+				if (header.state == OUTBOX_COMMITTED)
+				{
+					_pending++;
+					if (!pendingFound || (int32_t)(header.seq - oldest) < 0)
+					{
+						oldest = header.seq;
+						_tail = offset;
+						pendingFound = true;
+					}
+				}
+			}
+		}
+		_seq = found ? newest + 1 : 0;
+		if (_head % OUTBOX_SECTOR != 0)
+		{
+			// a torn header at the head moves writing on to the next sector
+			uint32_t blank[sizeof(Header) / sizeof(uint32_t)];
+			esp_partition_read(_partition, _head, blank, sizeof(blank));
+			for (uint32_t word : blank)
+			{
+				if (word != 0xFFFFFFFF)
+				{
+					_head = nextSector(_head);
+					break;
+				}
+			}
+		}
+		if (!pendingFound)
+		{
+			_tail = _head;
+		}
+		logi("Outbox %dKB, %d readings pending", _capacity / 1024, _pending);
+		return true;
+	}
+
+	uint32_t FlashOutbox::nextSector(uint32_t offset)
+	{
+		return (offset / OUTBOX_SECTOR + 1) * OUTBOX_SECTOR % _capacity;
+	}
+
+	uint32_t FlashOutbox::checksum(const Header &header, const char *payload)
+	{
+		uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)&header, offsetof(Header, crc));
+		return esp_rom_crc32_le(crc, (const uint8_t *)payload, header.len);
+	}
+
+	bool FlashOutbox::readHeader(uint32_t offset, Header &header)
+	{
+		if (esp_partition_read(_partition, offset, &header, sizeof(Header)) != ESP_OK)
+		{
+			return false;
+		}
+		return header.magic == OUTBOX_MAGIC && header.len <= OUTBOX_RECORD_MAX && (offset % OUTBOX_SECTOR) + recordSize(header.len) <= OUTBOX_SECTOR;
+	}
+
+	bool FlashOutbox::nextRecord(uint32_t &offset, Header &header)
+	{
+		while (offset != _head)
+		{
+			if ((offset % OUTBOX_SECTOR) + sizeof(Header) <= OUTBOX_SECTOR && readHeader(offset, header))
+			{
+				return true;
+			}
+			// rest of the sector is unused, don't skip past the head if it is in this sector
+			uint32_t next = nextSector(offset);
+			offset = (_head / OUTBOX_SECTOR == offset / OUTBOX_SECTOR && _head > offset) ? _head : next;
+		}
+		return false;
+	}
+
+	void FlashOutbox::markState(uint32_t offset, uint32_t state)
+	{
+		if (esp_partition_write(_partition, offset + offsetof(Header, state), &state, sizeof(state)) != ESP_OK)
+		{
+			loge("Outbox failed to mark record at %d", offset);
+		}
+	}
+
+	void FlashOutbox::dropSector(uint32_t sector)
+	{
+		if (_pending > 0 && _tail / OUTBOX_SECTOR == sector / OUTBOX_SECTOR)
+		{
+			// ring is full, the oldest unsent readings go
+			Header header;
+			uint32_t dropped = 0;
+			for (uint32_t offset = _tail; offset + sizeof(Header) <= sector + OUTBOX_SECTOR && readHeader(offset, header); offset += recordSize(header.len))
+			{
+				if (header.state == OUTBOX_COMMITTED)
+				{
+					dropped++;
+				}
+			}
+			dropped = min(dropped, _pending);
+			_pending -= dropped;
+			_dropped += dropped;
+			_tail = nextSector(sector);
+			_peekedCount = 0; // a batch peeked from the erased sector is not marked sent
+			_peekedRecords = 0;
+			_peekEnd = _tail;
+			logw("Outbox full, dropped %d readings", dropped);
+		}
+		if (esp_partition_erase_range(_partition, sector, OUTBOX_SECTOR) != ESP_OK)
+		{
+			loge("Outbox failed to erase sector at %d", sector);
+		}
+	}
+
+	bool FlashOutbox::Append(const char *payload, size_t len, uint32_t timeStamp)
+	{
+		if (_partition == nullptr || len > OUTBOX_RECORD_MAX)
+		{
+			return false;
+		}
+		uint32_t size = recordSize(len);
+		if ((_head % OUTBOX_SECTOR) + size > OUTBOX_SECTOR)
+		{
+			_head = nextSector(_head);
+		}
+		if (_head % OUTBOX_SECTOR == 0)
+		{
+			dropSector(_head);
+		}
+		Header header;
+		header.magic = OUTBOX_MAGIC;
+		header.len = len;
+		header.reserved = 0xFFFF;
+		header.seq = _seq++;
+		header.timeStamp = timeStamp;
+		header.crc = checksum(header, payload);
+		header.state = OUTBOX_WRITING;
+		uint32_t offset = _head;
+		_head = (_head + size) % _capacity; // a failed write still uses the slot
+		if (esp_partition_write(_partition, offset, &header, sizeof(Header)) != ESP_OK || esp_partition_write(_partition, offset + sizeof(Header), payload, len) != ESP_OK)
+		{
+			loge("Outbox write failed at %d", offset);
+			return false;
+		}
+		markState(offset, OUTBOX_COMMITTED);
+		if (_pending == 0)
+		{
+			_tail = offset;
+		}
+		_pending++;
+		_appended++;
+		return true;
+	}
+
+	size_t FlashOutbox::Peek(uint16_t &records)
+	{
+		records = 0;
+		_peekedCount = 0;
+		_peekedRecords = 0;
+		_peekEnd = _tail;
+		if (_partition == nullptr || _pending == 0)
+		{
+			return 0;
+		}
+		size_t len = 0;
+		_batch[len++] = '[';
+		uint32_t offset = _tail;
+		Header header;
+		while (records < OUTBOX_BATCH_RECORDS && _peekedCount < OUTBOX_BATCH_RECORDS * 2 && nextRecord(offset, header))
+		{
+			if (header.state == OUTBOX_COMMITTED)
+			{
+				if (esp_partition_read(_partition, offset + sizeof(Header), _payload, header.len) != ESP_OK || checksum(header, _payload) != header.crc)
+				{
+					_corrupt++; // skipped, marked sent with the batch
+					_peeked[_peekedCount++] = offset;
+				}
+				else
+				{
+					if (len + header.len + 32 > sizeof(_batch))
+					{
+						break; // next batch
+					}
+					len += sprintf(_batch + len, "%s{\"t\":%u,\"v\":", records > 0 ? "," : "", header.timeStamp);
+					memcpy(_batch + len, _payload, header.len);
+					len += header.len;
+					_batch[len++] = '}';
+					_peeked[_peekedCount++] = offset;
+					records++;
+				}
+			}
+			offset = (offset + recordSize(header.len)) % _capacity;
+		}
+		_batch[len++] = ']';
+		_batch[len] = 0;
+		_peekEnd = offset;
+		_peekedRecords = records;
+		return records > 0 ? len : 0;
+	}
+
+	void FlashOutbox::Commit()
+	{
+		if (_partition == nullptr)
+		{
+			return;
+		}
+		for (uint16_t i = 0; i < _peekedCount; i++)
+		{
+			markState(_peeked[i], OUTBOX_SENT);
+		}
+		_pending -= min((uint32_t)_peekedCount, _pending);
+		_tail = _peekEnd;
+		if (_tail == _head)
+		{
+			_pending = 0;
+		}
+		if (_peekedRecords > 0)
+		{
+			_drained += _peekedRecords;
+			_batches++;
+		}
+		_peekedCount = 0;
+		_peekedRecords = 0;
+	}
+
+	void FlashOutbox::getStatistics(JsonObject &stats)
+	{
+		stats["capacity_kb"] = _capacity / 1024;
+		stats["enabled"] = _partition != nullptr;
+		stats["pending"] = _pending;
+		stats["appended"] = _appended;
+		stats["drained"] = _drained;
+		stats["batches"] = _batches;
+		stats["dropped"] = _dropped;
+		stats["corrupt"] = _corrupt;
+	}
+}
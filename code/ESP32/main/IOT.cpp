@@ -1,6 +1,8 @@
+#define LOG_MODULE IOT
 #include <sys/time.h>
 #include <thread>
 #include <chrono>
+#include <vector>
 #include <ESPmDNS.h>
 #include <SPI.h>
 #include <Ethernet.h>
@@ -8,6 +10,7 @@
 #include <esp_eth.h>
 #include <esp_event.h>
 #include "esp_mac.h"
+#include "esp_idf_version.h"
 #include "esp_eth_mac.h"
 #include "esp_netif_ppp.h"
 #include "driver/spi_master.h"
@@ -15,16 +18,36 @@
 #include "Log.h"
 #include "WebLog.h"
 #include "IOT.h"
+#include "ModbusGateway.h"
+#include "ModbusPoller.h"
+#include "FlashOutbox.h"
+#include "MqttOutbox.h"
+#include "ReconnectBackoff.h"
+#include "Sparkplug.h"
 #include "IOT.html"
+#include "WebAssets.h"
+#include "WebSocketHub.h"
+#include "MetricsWriter.h"
 #include "HelperFunctions.h"
+#include "esp_heap_caps.h"
 
+WEB_ASSET(config_css_gz)
+WEB_ASSET(config_js_gz)
 
 namespace EDGEBOX
 {
 	TimerHandle_t mqttReconnectTimer;
 	static DNSServer _dnsServer;
 	static WebLog _webLog;
-	static ModbusServerTCPasync _MBserver;
+	static ModbusTCPServer _MBserver;
+	static ModbusGateway _MBgateway;
+	static ModbusPoller _MBpoller;
+	static MqttPublisher _publisher;
+	static PayloadCodec _codec;
+	static FlashOutbox _outbox;
+	static MqttOutbox _mqttOutbox;
+	static CommandRouter _router;
+	static ReconnectBackoff _mqttBackoff(MQTT_RECONNECT_MIN, MQTT_RECONNECT_MAX);
 	static AsyncAuthenticationMiddleware basicAuth;
 
 	void IOT::Init(IOTCallbackInterface *iotCB, AsyncWebServer *pwebServer)
@@ -47,7 +70,33 @@ namespace EDGEBOX
 			logi("Loading configuration from EEPROM");
 			loadSettings();
 		}
-		mqttReconnectTimer = xTimerCreate("mqttTimer", pdMS_TO_TICKS(8000), pdFALSE, this, mqttReconnectTimerCF);
+		_publisher.setSender([this](const char *subtopic, const char *payload, size_t len)
+							 { return Publish(subtopic, payload, len, false); });
+		_publisher.configure(_publishWindow, _publishInterval, _publishEdges);
+		_codec.setEncoding(_payloadEncoding, _positional);
+		_outbox.begin(_outboxKB * 1024);
+		_mqttOutbox.configure(_mqttOutboxKB * 1024, _outboxPolicy);
+		WebLog::setSink([this](const char *text, size_t len)
+						{
+			// on the log drain task, queued in the capped outbox, the main loop hands it to ESP-MQTT
+			if (_mqttConnected) {
+				char topic[STR_LEN * 2];
+				snprintf(topic, sizeof(topic), "%s/stat/logs", _rootTopicPrefix);
+				_mqttOutbox.Push(topic, text, len, 0, false, false);
+			} });
+		_router.on("status", [this](const char *topic, JsonDocument &doc)
+				   { PublishStatus(); });
+		_router.on("log", [this](const char *topic, JsonDocument &doc)
+				   {
+			// {"MB": 4} sets the runtime log threshold of a module
+			WebLog::setLevels(doc.as<JsonObject>());
+			doc.clear();
+			JsonObject levels = doc.to<JsonObject>();
+			WebLog::getLevels(levels);
+			Publish("log", doc, false); });
+		_router.onOther([this](const char *topic, JsonDocument &doc)
+						{ HandleCommand(topic, doc); });
+		mqttReconnectTimer = xTimerCreate("mqttTimer", pdMS_TO_TICKS(MQTT_CONNECT_DELAY), pdFALSE, this, mqttReconnectTimerCF);
 
 		WiFi.onEvent([this](WiFiEvent_t event, WiFiEventInfo_t info)
 					 {
@@ -56,17 +105,17 @@ namespace EDGEBOX
 			switch (event)
 			{
 			case ARDUINO_EVENT_WIFI_AP_STADISCONNECTED:
-				logd("AP_STADISCONNECTED");
+				mlogd(NET, "AP_STADISCONNECTED");
 				_AP_Connected = false;
 				GoOffline();
 			break;
 			case ARDUINO_EVENT_WIFI_AP_STAIPASSIGNED:
-				logd("AP_STAIPASSIGNED");
+				mlogd(NET, "AP_STAIPASSIGNED");
 				_AP_Connected = true;
 				GoOnline();
 			break;
 			case ARDUINO_EVENT_WIFI_STA_GOT_IP:
-				logd("STA_GOT_IP");
+				mlogd(NET, "STA_GOT_IP");
 				doc["IP"] = WiFi.localIP().toString().c_str();
 				doc["ApPassword"] = DEFAULT_AP_PASSWORD;
 				serializeJson(doc, s);
@@ -77,11 +126,11 @@ namespace EDGEBOX
 				GoOnline();
 				break;
 			case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
-				logw("STA_DISCONNECTED");
+				mlogw(NET, "STA_DISCONNECTED");
 				GoOffline();
 				break;
 			default:
-				logd("[WiFi-event] event: %d", event);
+				mlogd(NET, "[WiFi-event] event: %d", event);
 				break;
 			} });
 		// generate unique id from mac address NIC segment
@@ -94,21 +143,30 @@ namespace EDGEBOX
 		_pwebServer->on("/reboot", [this](AsyncWebServerRequest *request)
 						{ 
 			logd("resetModule");
-			String page = reboot_html;
-			request->send(200, "text/html", page.c_str());
+			request->send(200, "text/html", reboot_html);
 			delay(3000);
 			esp_restart(); });
 
 		_pwebServer->onNotFound([this](AsyncWebServerRequest *request)
 								{
 			logd("Redirecting from: %s", request->url().c_str());
-			String page = redirect_html;
-			page.replace("{n}", _SSID);
-			IPAddress IP = WiFi.softAPIP();
-			String home = IP.toString();
-			home += "/settings";
-			page.replace("{ip}", home.c_str()); // go directly to settings
-			request->send(200, "text/html", page); });
+			auto page = std::make_shared<TemplateResponse>();
+			page->add(redirect_html, [this](const char *key, TemplateValue &value)
+					  {
+				if (strcmp(key, "n") == 0)
+				{
+					value.set(_SSID);
+				}
+				else if (strcmp(key, "ip") == 0)
+				{
+					value.set(WiFi.softAPIP().toString() + "/settings"); // go directly to settings
+				}
+				else
+				{
+					return false;
+				}
+				return true; });
+			TemplateResponse::send(request, page); });
 
 		basicAuth.setUsername("admin");
 		basicAuth.setPassword(_AP_Password.c_str());
@@ -118,50 +176,15 @@ namespace EDGEBOX
 		_pwebServer->on("/network_config", HTTP_GET, [this](AsyncWebServerRequest *request)
 		{
 			logd("config");
-			String fields = network_config_fields;
-			fields.replace("{n}", _AP_SSID);
-			fields.replace("{v}", CONFIG_VERSION);
-			fields.replace("{AP_SSID}", _AP_SSID);
-			fields.replace("{AP_Pw}", _AP_Password);
-
-			fields.replace("{WIFI}", _NetworkSelection == WiFiMode ? "selected" : "");
-			fields.replace("{ETH}", _NetworkSelection == EthernetMode ? "selected" : "");
-			fields.replace("{4G}", _NetworkSelection == ModemMode ? "selected" : "");
-
-			fields.replace("{SSID}", _SSID);
-			fields.replace("{WiFi_Pw}", _WiFi_Password);
-			fields.replace("{dhcpChecked}", _useDHCP ? "checked" : "unchecked");
-
-			fields.replace("{ETH_SIP}", _Static_IP);
-			fields.replace("{ETH_SM}", _Subnet_Mask);
-			fields.replace("{ETH_GW}", _Gateway_IP);
-
-			fields.replace("{APN}", _APN);
-			fields.replace("{SIM_USERNAME}", _SIM_Username);
-			fields.replace("{SIM_PASSWORD}", _SIM_Password);
-			fields.replace("{SIM_PIN}", _SIM_PIN);
-
-			fields.replace("{mqttchecked}", _useMQTT ? "checked" : "unchecked");
-			fields.replace("{mqttServer}", _mqttServer);
-			fields.replace("{mqttPort}", String(_mqttPort));
-			fields.replace("{mqttUser}", _mqttUserName);
-			fields.replace("{mqttPw}", _mqttUserPassword);
-			fields.replace("{modbuschecked}", _useModbus ? "checked" : "unchecked");
-			fields.replace("{modbusPort}", String(_modbusPort));
-			fields.replace("{modbusID}", String(_modbusID));
-			fields.replace("{inputRegBase}", String(_input_register_base_addr));
-			fields.replace("{coilBase}", String(_coil_base_addr));
-			fields.replace("{discreteBase}", String(_discrete_input_base_addr));
-			Serial.println(fields.c_str());
-			String page = network_config_top;
-			page.replace("{n}", _AP_SSID);
-			page.replace("{v}", CONFIG_VERSION);
-			page += fields;
-			_iotCB->addApplicationConfigs(page);
-			String apply_button = network_config_apply_button;
-			page += apply_button;
-			page += network_config_links;
-			request->send(200, "text/html", page); 
+			auto page = std::make_shared<TemplateResponse>();
+			page->add(network_config_top, [this](const char *key, TemplateValue &value)
+					  { return ResolveConfig(key, value); });
+			page->add(network_config_fields, [this](const char *key, TemplateValue &value)
+					  { return ResolveConfig(key, value); });
+			_iotCB->addApplicationConfigs(*page);
+			page->add(network_config_apply_button);
+			page->add(network_config_links);
+			TemplateResponse::send(request, page);
 		}).addMiddleware(&basicAuth);
 
 		_pwebServer->on("/submit", HTTP_POST, [this](AsyncWebServerRequest *request)
@@ -220,6 +243,43 @@ namespace EDGEBOX
 			if (request->hasParam("mqttPw", true)) {
 				_mqttUserPassword = request->getParam("mqttPw", true)->value().c_str();
 			}
+			if (request->hasParam("publishWindow", true)) {
+				_publishWindow = request->getParam("publishWindow", true)->value().toInt();
+			}
+			if (request->hasParam("publishInterval", true)) {
+				_publishInterval = request->getParam("publishInterval", true)->value().toInt();
+			}
+			_publishEdges = request->hasParam("edgesCheckbox", true);
+			_pointTopics = request->hasParam("pointTopicsCheckbox", true);
+			if (request->hasParam("payloadEncoding", true)) {
+				String enc = request->getParam("payloadEncoding", true)->value();
+				_payloadEncoding = enc == "msgpack" ? EncodingMsgPack : enc == "cbor" ? EncodingCBOR : EncodingJson;
+			}
+			_positional = request->hasParam("positionalCheckbox", true);
+			if (request->hasParam("outboxKB", true)) {
+				uint16_t kb = request->getParam("outboxKB", true)->value().toInt();
+				if (kb != _outboxKB) {
+					_outboxKB = kb;
+					_outboxResized = true; // the outbox is used from the main loop only
+				}
+			}
+			_sparkplug = request->hasParam("sparkplugCheckbox", true);
+			if (request->hasParam("spGroup", true)) {
+				_spGroup = request->getParam("spGroup", true)->value();
+			}
+			if (request->hasParam("mqttOutboxKB", true)) {
+				_mqttOutboxKB = constrain(request->getParam("mqttOutboxKB", true)->value().toInt(), 1, 256);
+			}
+			if (request->hasParam("outboxPolicy", true)) {
+				_outboxPolicy = request->getParam("outboxPolicy", true)->value() == "latest" ? OutboxLatestValue : OutboxOldestFirst;
+			}
+			if (request->hasParam("telemetryQos", true)) {
+				_telemetryQos = constrain(request->getParam("telemetryQos", true)->value().toInt(), 0, 1);
+			}
+			_mqtt5 = request->hasParam("mqtt5Checkbox", true);
+			_mqttOutbox.configure(_mqttOutboxKB * 1024, _outboxPolicy);
+			_publisherChanged = true; // the publisher runs on the main loop, it is reconfigured there
+			_encodingChanged = true;
 			_useModbus = request->hasParam("modbusCheckbox", true);
 			if (request->hasParam("modbusPort", true)) {
 				_modbusPort = request->getParam("modbusPort", true)->value().toInt();
@@ -227,6 +287,15 @@ namespace EDGEBOX
 			if (request->hasParam("modbusID", true)) {
 				_modbusID = request->getParam("modbusID", true)->value().toInt();
 			}
+			if (request->hasParam("modbusMaxClients", true)) {
+				_modbusMaxClients = constrain(request->getParam("modbusMaxClients", true)->value().toInt(), 1, 16);
+			}
+			if (request->hasParam("modbusIdleTimeout", true)) {
+				_modbusIdleTimeout = request->getParam("modbusIdleTimeout", true)->value().toInt();
+			}
+			if (request->hasParam("modbusRateLimit", true)) {
+				_modbusRateLimit = request->getParam("modbusRateLimit", true)->value().toInt();
+			}
 			if (request->hasParam("inputRegBase", true)) {
 				_input_register_base_addr = request->getParam("inputRegBase", true)->value().toInt();
 			}
@@ -236,86 +305,722 @@ namespace EDGEBOX
 			if (request->hasParam("discreteBase", true)) {
 				_discrete_input_base_addr = request->getParam("discreteBase", true)->value().toInt();
 			}
+			_useGateway = request->hasParam("gatewayCheckbox", true);
+			if (request->hasParam("gatewayBaud", true)) {
+				_gatewayBaud = request->getParam("gatewayBaud", true)->value().toInt();
+			}
+			if (request->hasParam("gatewayTimeout", true)) {
+				_gatewayTimeout = request->getParam("gatewayTimeout", true)->value().toInt();
+			}
+			if (request->hasParam("gatewayCacheTTL", true)) {
+				_gatewayCacheTTL = request->getParam("gatewayCacheTTL", true)->value().toInt();
+			}
+			String previousPoller = PollerConfig();
+			bool pollerChanged = false;
+			if (request->hasParam("pollerConfig", true)) {
+				String cfg = request->getParam("pollerConfig", true)->value();
+				JsonDocument check;
+				DeserializationError err = deserializeJson(check, cfg);
+				if (cfg.length() == 0 || !err) {
+					pollerChanged = cfg != previousPoller;
+					std::lock_guard<std::mutex> guard(_pollerLock);
+					_pollerConfig = cfg;
+				}
+				else {
+					logw("Poller tag list is not valid JSON: %s", err.c_str());
+				}
+			}
 			_iotCB->onSubmitForm(request);
-			saveSettings();
+			if (!saveSettings()) {
+				// the tag list is the only setting of unbounded length, keep the one that fit
+				{
+					std::lock_guard<std::mutex> guard(_pollerLock);
+					_pollerConfig = previousPoller;
+				}
+				saveSettings();
+				request->send(413, "text/plain", "The poller tag list doesn't fit in the settings EEPROM, it was not saved");
+				return;
+			}
+			_pollerChanged = pollerChanged; // last, the main loop reads the tag list once it's set
 			SendNetworkSettings(request); });
 		_pwebServer->on("/settings", HTTP_GET, [this](AsyncWebServerRequest *request)
 						{ SendNetworkSettings(request); });
+		WebAssets::serve(_pwebServer, "/config.css", "text/css", config_css_gz_start, config_css_gz_end);
+		WebAssets::serve(_pwebServer, "/config.js", "application/javascript", config_js_gz_start, config_js_gz_end);
+		AddMetrics();
+		_pwebServer->on("/metrics", HTTP_GET, [this](AsyncWebServerRequest *request)
+						{ MetricsResponse::send(request, std::make_shared<MetricsResponse>(_metrics)); });
+		_pwebServer->on("/web_stats", HTTP_GET, [this](AsyncWebServerRequest *request)
+						{
+			JsonDocument doc;
+			JsonObject assets = doc["assets"].to<JsonObject>();
+			WebAssets::getStatistics(assets);
+			JsonObject websockets = doc["websockets"].to<JsonObject>();
+			WebSocketHub::getStatistics(websockets);
+			JsonObject log = doc["log"].to<JsonObject>();
+			WebLog::getStatistics(log);
+			String s;
+			serializeJson(doc, s);
+			request->send(200, "application/json", s); });
+		_pwebServer->on("/modbus_stats", HTTP_GET, [this](AsyncWebServerRequest *request)
+						{
+			JsonDocument doc;
+			JsonObject server = doc["server"].to<JsonObject>();
+			_MBserver.getStatistics(server);
+			if (_useGateway)
+			{
+				JsonObject gateway = doc["gateway"].to<JsonObject>();
+				_MBgateway.getStatistics(gateway);
+			}
+			String s;
+			serializeJson(doc, s);
+			request->send(200, "application/json", s); });
+		_pwebServer->on("/mqtt_stats", HTTP_GET, [this](AsyncWebServerRequest *request)
+						{
+			JsonDocument doc;
+			JsonObject stats = doc.to<JsonObject>();
+			_publisher.getStatistics(stats);
+			JsonObject payload = stats["payload"].to<JsonObject>();
+			_codec.getStatistics(payload);
+			JsonObject outbox = stats["outbox"].to<JsonObject>();
+			_outbox.getStatistics(outbox);
+			JsonObject mqttOutbox = stats["mqtt_outbox"].to<JsonObject>();
+			_mqttOutbox.getStatistics(mqttOutbox, _mqtt_client_handle);
+			JsonObject commands = stats["commands"].to<JsonObject>();
+			_router.getStatistics(commands);
+			JsonObject reconnect = stats["reconnect"].to<JsonObject>();
+			_mqttBackoff.getStatistics(reconnect);
+			String s;
+			serializeJson(doc, s);
+			request->send(200, "application/json", s); });
+		_pwebServer->on("/poller", HTTP_GET, [this](AsyncWebServerRequest *request)
+						{
+			JsonDocument doc;
+			JsonObject values = doc["values"].to<JsonObject>();
+			_MBpoller.getValues(values);
+			JsonObject stats = doc["stats"].to<JsonObject>();
+			_MBpoller.getStatistics(stats);
+			String s;
+			serializeJson(doc, s);
+			request->send(200, "application/json", s); });
+	}
+
+	void IOT::AddMetrics()
+	{
+		_metrics.push_back({"system", [this](MetricsWriter &metrics)
+							{
+			metrics.family("uptime_seconds", "Time since boot", "counter");
+			metrics.add("uptime_seconds", (int64_t)((millis() - _lastBootTimeStamp) / 1000));
+			metrics.family("reset_reason", "esp_reset_reason() of the last boot");
+			metrics.add("reset_reason", (int64_t)esp_reset_reason());
+			static const struct
+			{
+				const char *name;
+				uint32_t caps;
+			} heaps[] = {{"default", MALLOC_CAP_DEFAULT}, {"internal", MALLOC_CAP_INTERNAL}, {"dma", MALLOC_CAP_DMA}, {"spiram", MALLOC_CAP_SPIRAM}};
+			metrics.family("heap_size_bytes", "Heap size by capability");
+			for (auto &h : heaps)
+			{
+				metrics.add("heap_size_bytes", (int64_t)heap_caps_get_total_size(h.caps), "caps", h.name);
+			}
+			metrics.family("heap_free_bytes", "Free heap by capability");
+			for (auto &h : heaps)
+			{
+				metrics.add("heap_free_bytes", (int64_t)heap_caps_get_free_size(h.caps), "caps", h.name);
+			}
+			metrics.family("heap_min_free_bytes", "Lowest free heap since boot by capability");
+			for (auto &h : heaps)
+			{
+				metrics.add("heap_min_free_bytes", (int64_t)heap_caps_get_minimum_free_size(h.caps), "caps", h.name);
+			}
+			metrics.family("heap_largest_free_block_bytes", "Largest allocation that can succeed by capability");
+			for (auto &h : heaps)
+			{
+				metrics.add("heap_largest_free_block_bytes", (int64_t)heap_caps_get_largest_free_block(h.caps), "caps", h.name);
+			} }});
+		_metrics.push_back({"tasks", [](MetricsWriter &metrics)
+							{
+#if configUSE_TRACE_FACILITY
+			// needs CONFIG_FREERTOS_USE_TRACE_FACILITY, run time counters CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+			UBaseType_t count = uxTaskGetNumberOfTasks() + 2; // room for tasks created meanwhile
+			std::unique_ptr<TaskStatus_t[]> tasks(new TaskStatus_t[count]);
+#ifdef configRUN_TIME_COUNTER_TYPE
+			configRUN_TIME_COUNTER_TYPE total = 0;
+#else
+			uint32_t total = 0;
+#endif
+			count = uxTaskGetSystemState(tasks.get(), count, &total);
+			metrics.family("task_stack_free_min_bytes", "Stack high water mark, the least free stack seen");
+			for (UBaseType_t i = 0; i < count; i++)
+			{
+				metrics.add("task_stack_free_min_bytes", (int64_t)tasks[i].usStackHighWaterMark, "task", tasks[i].pcTaskName);
+			}
+#if configGENERATE_RUN_TIME_STATS
+			metrics.family("task_runtime_us_total", "Run time counter of the task", "counter");
+			for (UBaseType_t i = 0; i < count; i++)
+			{
+				metrics.add("task_runtime_us_total", (int64_t)tasks[i].ulRunTimeCounter, "task", tasks[i].pcTaskName);
+			}
+			metrics.family("task_cpu_percent", "Share of the run time since boot, of both cores");
+			for (UBaseType_t i = 0; i < count; i++)
+			{
+				metrics.add("task_cpu_percent", total > 0 ? (float)tasks[i].ulRunTimeCounter * 100 / total / portNUM_PROCESSORS : 0.0f, "task", tasks[i].pcTaskName);
+			}
+#endif
+#endif
+			metrics.family("tasks", "Number of tasks");
+			metrics.add("tasks", (int64_t)uxTaskGetNumberOfTasks()); }});
+		_metrics.push_back({"scan", [this](MetricsWriter &metrics)
+							{ _iotCB->addApplicationMetrics(metrics); }});
+		_metrics.push_back({"network", [this](MetricsWriter &metrics)
+							{
+			metrics.family("network_selection", "0 none, 1 AP, 2 WiFi, 3 Ethernet, 4 modem");
+			metrics.add("network_selection", (int64_t)_NetworkSelection);
+			metrics.family("network_state", "0 boot, 1 AP, 2 connecting, 3 online, 4 offline");
+			metrics.add("network_state", (int64_t)_networkState);
+			metrics.family("network_up", "Link up with an IP address");
+			metrics.add("network_up", (int64_t)(_networkState == OnLine));
+			if (_NetworkSelection == WiFiMode && _networkState == OnLine)
+			{
+				metrics.family("wifi_rssi_dbm", "Signal strength of the access point");
+				metrics.add("wifi_rssi_dbm", (int64_t)WiFi.RSSI());
+			}
+			metrics.family("mqtt_connected", "Connected to the MQTT broker");
+			metrics.add("mqtt_connected", (int64_t)_mqttConnected);
+			JsonDocument doc;
+			JsonObject reconnect = doc.to<JsonObject>();
+			_mqttBackoff.getStatistics(reconnect);
+			metrics.add("mqtt_reconnect", doc.as<JsonVariantConst>()); }});
+		_metrics.push_back({"modbus", [this](MetricsWriter &metrics)
+							{
+			JsonDocument doc;
+			JsonObject server = doc["server"].to<JsonObject>();
+			_MBserver.getStatistics(server);
+			JsonObject poller = doc["poller"].to<JsonObject>();
+			_MBpoller.getStatistics(poller);
+			if (_useGateway)
+			{
+				JsonObject gateway = doc["gateway"].to<JsonObject>();
+				_MBgateway.getStatistics(gateway);
+			}
+			metrics.add("modbus", doc.as<JsonVariantConst>()); }});
+		_metrics.push_back({"mqtt", [this](MetricsWriter &metrics)
+							{
+			JsonDocument doc;
+			JsonObject publisher = doc["publisher"].to<JsonObject>();
+			_publisher.getStatistics(publisher);
+			JsonObject payload = doc["payload"].to<JsonObject>();
+			_codec.getStatistics(payload);
+			JsonObject store = doc["store"].to<JsonObject>();
+			_outbox.getStatistics(store);
+			JsonObject outbox = doc["outbox"].to<JsonObject>();
+			_mqttOutbox.getStatistics(outbox, _mqtt_client_handle);
+			JsonObject commands = doc["commands"].to<JsonObject>();
+			_router.getStatistics(commands);
+			metrics.add("mqtt", doc.as<JsonVariantConst>()); }});
+		_metrics.push_back({"web", [](MetricsWriter &metrics)
+							{
+			JsonDocument doc;
+			JsonObject websockets = doc["websockets"].to<JsonObject>();
+			WebSocketHub::getStatistics(websockets);
+			JsonObject log = doc["log"].to<JsonObject>();
+			WebLog::getStatistics(log);
+			JsonObject assets = doc["assets"].to<JsonObject>();
+			WebAssets::getStatistics(assets);
+			metrics.add("web", doc.as<JsonVariantConst>()); }});
+	}
+
+	void IOT::PublishMetrics()
+	{
+		std::unique_ptr<char[]> buffer(new char[METRICS_CHUNK]);
+		for (auto &group : _metrics)
+		{
+			MetricsWriter metrics(buffer.get(), METRICS_CHUNK, true);
+			metrics.begin();
+			group.collector(metrics);
+			size_t len = metrics.end();
+			if (metrics.overflowed())
+			{
+				logw("Metrics of %s need more than %d bytes, not published", group.name, METRICS_CHUNK);
+				continue;
+			}
+			char subtopic[STR_LEN];
+			snprintf(subtopic, sizeof(subtopic), "metrics/%s", group.name);
+			Publish(subtopic, buffer.get(), len, false);
+		}
 	}
 
 	void IOT::SendNetworkSettings(AsyncWebServerRequest *request)
 	{
-		String page = network_config_top;
-		page.replace("{n}", _AP_SSID);
-		page.replace("{v}", CONFIG_VERSION);
-		String network = network_settings_fs;
-		network.replace("{AP_SSID}", _AP_SSID);
-		network.replace("{AP_Pw}", _AP_Password.length() > 0 ? "******" : "");
-		if (_NetworkSelection == WiFiMode)
+		auto page = std::make_shared<TemplateResponse>();
+		auto resolver = [this](const char *key, TemplateValue &value)
+		{ return ResolveSettings(key, value); };
+		page->add(network_config_top, resolver);
+		page->add(network_settings_fs, resolver);
+		if (_useMQTT)
+		{
+			page->add(mqtt_settings, resolver);
+		}
+		if (_useModbus)
+		{
+			page->add(modbus_settings, resolver);
+		}
+		if (_MBpoller.hasTags())
+		{
+			page->add(poller_settings, resolver);
+		}
+		_iotCB->addApplicationSettings(*page);
+		page->add(network_settings_links);
+		TemplateResponse::send(request, page);
+	}
+
+	bool IOT::ResolveConfig(const char *key, TemplateValue &value)
+	{
+		if (strcmp(key, "n") == 0 || strcmp(key, "AP_SSID") == 0)
+		{
+			value.set(_AP_SSID);
+		}
+		else if (strcmp(key, "v") == 0)
+		{
+			value.set(CONFIG_VERSION);
+		}
+		else if (strcmp(key, "AP_Pw") == 0)
+		{
+			value.set(_AP_Password);
+		}
+		else if (strcmp(key, "WIFI") == 0)
+		{
+			value.set(_NetworkSelection == WiFiMode ? "selected" : "");
+		}
+		else if (strcmp(key, "ETH") == 0)
+		{
+			value.set(_NetworkSelection == EthernetMode ? "selected" : "");
+		}
+		else if (strcmp(key, "4G") == 0)
+		{
+			value.set(_NetworkSelection == ModemMode ? "selected" : "");
+		}
+		else if (strcmp(key, "SSID") == 0)
+		{
+			value.set(_SSID);
+		}
+		else if (strcmp(key, "WiFi_Pw") == 0)
+		{
+			value.set(_WiFi_Password);
+		}
+		else if (strcmp(key, "dhcpChecked") == 0)
+		{
+			value.set(_useDHCP ? "checked" : "unchecked");
+		}
+		else if (strcmp(key, "ETH_SIP") == 0)
+		{
+			value.set(_Static_IP);
+		}
+		else if (strcmp(key, "ETH_SM") == 0)
+		{
+			value.set(_Subnet_Mask);
+		}
+		else if (strcmp(key, "ETH_GW") == 0)
 		{
-			String wifi = network_settings_wifi;
-			wifi.replace("{SSID}", _AP_SSID);
-			wifi.replace("{WiFi_Pw}", _AP_Password.length() > 0 ? "******" : "");
-			network.replace("{NET}", wifi);
+			value.set(_Gateway_IP);
 		}
-		else if (_NetworkSelection == EthernetMode)
+		else if (strcmp(key, "APN") == 0)
 		{
-			String eth;
-			if (_useDHCP)
+			value.set(_APN);
+		}
+		else if (strcmp(key, "SIM_USERNAME") == 0)
+		{
+			value.set(_SIM_Username);
+		}
+		else if (strcmp(key, "SIM_PASSWORD") == 0)
+		{
+			value.set(_SIM_Password);
+		}
+		else if (strcmp(key, "SIM_PIN") == 0)
+		{
+			value.set(_SIM_PIN);
+		}
+		else if (strcmp(key, "mqttchecked") == 0)
+		{
+			value.set(_useMQTT ? "checked" : "unchecked");
+		}
+		else if (strcmp(key, "mqttPw") == 0)
+		{
+			value.set(_mqttUserPassword);
+		}
+		else if (strcmp(key, "edgeschecked") == 0)
+		{
+			value.set(_publishEdges ? "checked" : "unchecked");
+		}
+		else if (strcmp(key, "pointtopicschecked") == 0)
+		{
+			value.set(_pointTopics ? "checked" : "unchecked");
+		}
+		else if (strcmp(key, "JSON") == 0)
+		{
+			value.set(_payloadEncoding == EncodingJson ? "selected" : "");
+		}
+		else if (strcmp(key, "MSGPACK") == 0)
+		{
+			value.set(_payloadEncoding == EncodingMsgPack ? "selected" : "");
+		}
+		else if (strcmp(key, "CBOR") == 0)
+		{
+			value.set(_payloadEncoding == EncodingCBOR ? "selected" : "");
+		}
+		else if (strcmp(key, "positionalchecked") == 0)
+		{
+			value.set(_positional ? "checked" : "unchecked");
+		}
+		else if (strcmp(key, "sparkplugchecked") == 0)
+		{
+			value.set(_sparkplug ? "checked" : "unchecked");
+		}
+		else if (strcmp(key, "OLDEST") == 0)
+		{
+			value.set(_outboxPolicy == OutboxOldestFirst ? "selected" : "");
+		}
+		else if (strcmp(key, "LATEST") == 0)
+		{
+			value.set(_outboxPolicy == OutboxLatestValue ? "selected" : "");
+		}
+		else if (strcmp(key, "QOS0") == 0)
+		{
+			value.set(_telemetryQos == 0 ? "selected" : "");
+		}
+		else if (strcmp(key, "QOS1") == 0)
+		{
+			value.set(_telemetryQos == 1 ? "selected" : "");
+		}
+		else if (strcmp(key, "mqtt5checked") == 0)
+		{
+			value.set(_mqtt5 ? "checked" : "unchecked");
+		}
+		else if (strcmp(key, "modbuschecked") == 0)
+		{
+			value.set(_useModbus ? "checked" : "unchecked");
+		}
+		else if (strcmp(key, "gatewaychecked") == 0)
+		{
+			value.set(_useGateway ? "checked" : "unchecked");
+		}
+		else if (strcmp(key, "pollerConfig") == 0)
+		{
+			value.set(PollerConfig());
+		}
+		else
+		{
+			return ResolveValue(key, value);
+		}
+		return true;
+	}
+
+	bool IOT::ResolveSettings(const char *key, TemplateValue &value)
+	{
+		if (strcmp(key, "n") == 0 || strcmp(key, "AP_SSID") == 0)
+		{
+			value.set(_AP_SSID);
+		}
+		else if (strcmp(key, "v") == 0)
+		{
+			value.set(CONFIG_VERSION);
+		}
+		else if (strcmp(key, "AP_Pw") == 0)
+		{
+			value.set(_AP_Password.length() > 0 ? "******" : "");
+		}
+		else if (strcmp(key, "NET") == 0)
+		{
+			if (_NetworkSelection == WiFiMode)
+			{
+				value.nest(network_settings_wifi);
+			}
+			else if (_NetworkSelection == EthernetMode)
+			{
+				value.nest(_useDHCP ? network_settings_eth_dhcp : network_settings_eth_st);
+			}
+			else if (_NetworkSelection == ModemMode)
 			{
-				eth = network_settings_eth_dhcp;
+				value.nest(network_settings_modem);
 			}
-			else 
+			else
 			{
-				eth = network_settings_eth_st;
-				eth.replace("{ETH_SIP}", _Static_IP);
-				eth.replace("{ETH_SM}", _Subnet_Mask);
-				eth.replace("{ETH_GW}", _Gateway_IP);
+				value.set("No network selected");
 			}
-			network.replace("{NET}", eth);
 		}
-		else if (_NetworkSelection == ModemMode)
+		else if (strcmp(key, "SSID") == 0)
+		{
+			value.set(_SSID);
+		}
+		else if (strcmp(key, "WiFi_Pw") == 0)
+		{
+			value.set(_WiFi_Password.length() > 0 ? "******" : "");
+		}
+		else if (strcmp(key, "ETH_SIP") == 0)
+		{
+			value.set(_Static_IP);
+		}
+		else if (strcmp(key, "ETH_SM") == 0)
+		{
+			value.set(_Subnet_Mask);
+		}
+		else if (strcmp(key, "ETH_GW") == 0)
+		{
+			value.set(_Gateway_IP);
+		}
+		else if (strcmp(key, "APN") == 0)
+		{
+			value.set(_APN);
+		}
+		else if (strcmp(key, "SIM_USERNAME") == 0)
 		{
-			String modem = network_settings_modem;
-			modem.replace("{APN}", _APN);
-			modem.replace("{SIM_USERNAME}", _SIM_Username);
-			modem.replace("{SIM_PASSWORD}", _SIM_Password.length() > 0 ? "******" : "");
-			modem.replace("{SIM_PIN}", _SIM_PIN);
-			network.replace("{NET}", modem);
+			value.set(_SIM_Username);
+		}
+		else if (strcmp(key, "SIM_PASSWORD") == 0)
+		{
+			value.set(_SIM_Password.length() > 0 ? "******" : "");
+		}
+		else if (strcmp(key, "SIM_PIN") == 0)
+		{
+			value.set(_SIM_PIN);
+		}
+		else if (strcmp(key, "mqttPw") == 0)
+		{
+			value.set(_mqttUserPassword.length() > 0 ? "******" : "");
+		}
+		else if (strcmp(key, "publishEdges") == 0)
+		{
+			value.set(_publishEdges ? "Yes" : "No");
+		}
+		else if (strcmp(key, "pointTopics") == 0)
+		{
+			value.set(_pointTopics ? "Yes" : "No");
+		}
+		else if (strcmp(key, "payloadEncoding") == 0)
+		{
+			value.set(PayloadCodec::Name(_payloadEncoding));
+		}
+		else if (strcmp(key, "positional") == 0)
+		{
+			value.set(_positional ? "Yes" : "No");
+		}
+		else if (strcmp(key, "sparkplug") == 0)
+		{
+			value.set(_sparkplug ? "Yes" : "No");
+		}
+		else if (strcmp(key, "outboxPolicy") == 0)
+		{
+			value.set(_outboxPolicy == OutboxLatestValue ? "latest value" : "oldest first");
+		}
+		else if (strcmp(key, "mqttProtocol") == 0)
+		{
+			value.set(UseMqtt5() ? "5" : "3.1.1");
+		}
+		else if (strcmp(key, "GW") == 0)
+		{
+			value.nest(gateway_settings, _useGateway ? 1 : 0);
+		}
+		else if (strcmp(key, "tags") == 0 || strcmp(key, "blocks") == 0)
+		{
+			JsonDocument doc;
+			JsonObject stats = doc.to<JsonObject>();
+			_MBpoller.getStatistics(stats);
+			value.set(stats[key].as<int>());
 		}
 		else
 		{
-			network.replace("{NET}", "No network selected");
+			return ResolveValue(key, value);
 		}
-		page += network;
-		if (_useMQTT)
+		return true;
+	}
+
+	bool IOT::ResolveValue(const char *key, TemplateValue &value)
+	{
+		// settings shown the same way on the config and the settings page
+		if (strcmp(key, "mqttServer") == 0)
 		{
-			String mqtt = mqtt_settings;
-			mqtt.replace("{mqttServer}", _mqttServer);
-			mqtt.replace("{mqttPort}", String(_mqttPort));
-			mqtt.replace("{mqttUser}", _mqttUserName);
-			mqtt.replace("{mqttPw}", _mqttUserPassword.length() > 0 ? "******" : "");
-			page += mqtt;
+			value.set(_mqttServer);
 		}
-		if (_useModbus)
+		else if (strcmp(key, "mqttPort") == 0)
+		{
+			value.set(_mqttPort);
+		}
+		else if (strcmp(key, "mqttUser") == 0)
+		{
+			value.set(_mqttUserName);
+		}
+		else if (strcmp(key, "publishWindow") == 0)
+		{
+			value.set(_publishWindow);
+		}
+		else if (strcmp(key, "publishInterval") == 0)
+		{
+			value.set(_publishInterval);
+		}
+		else if (strcmp(key, "outboxKB") == 0)
+		{
+			value.set(_outboxKB);
+		}
+		else if (strcmp(key, "spGroup") == 0)
+		{
+			value.set(_spGroup);
+		}
+		else if (strcmp(key, "mqttOutboxKB") == 0)
+		{
+			value.set(_mqttOutboxKB);
+		}
+		else if (strcmp(key, "telemetryQos") == 0)
 		{
-			String modbus = modbus_settings;
-			modbus.replace("{modbusPort}", String(_modbusPort));
-			modbus.replace("{modbusID}", String(_modbusID));
-			modbus.replace("{inputRegBase}", String(_input_register_base_addr));
-			modbus.replace("{coilBase}", String(_coil_base_addr));
-			modbus.replace("{discreteBase}", String(_discrete_input_base_addr));
-			page += modbus;
-		}
-		_iotCB->addApplicationSettings(page);
-		page += network_settings_links;
-		request->send(200, "text/html", page);
+			value.set(_telemetryQos);
+		}
+		else if (strcmp(key, "modbusPort") == 0)
+		{
+			value.set(_modbusPort);
+		}
+		else if (strcmp(key, "modbusID") == 0)
+		{
+			value.set(_modbusID);
+		}
+		else if (strcmp(key, "modbusMaxClients") == 0)
+		{
+			value.set(_modbusMaxClients);
+		}
+		else if (strcmp(key, "modbusIdleTimeout") == 0)
+		{
+			value.set(_modbusIdleTimeout);
+		}
+		else if (strcmp(key, "modbusRateLimit") == 0)
+		{
+			value.set(_modbusRateLimit);
+		}
+		else if (strcmp(key, "inputRegBase") == 0)
+		{
+			value.set(_input_register_base_addr);
+		}
+		else if (strcmp(key, "coilBase") == 0)
+		{
+			value.set(_coil_base_addr);
+		}
+		else if (strcmp(key, "discreteBase") == 0)
+		{
+			value.set(_discrete_input_base_addr);
+		}
+		else if (strcmp(key, "gatewayBaud") == 0)
+		{
+			value.set(_gatewayBaud);
+		}
+		else if (strcmp(key, "gatewayTimeout") == 0)
+		{
+			value.set(_gatewayTimeout);
+		}
+		else if (strcmp(key, "gatewayCacheTTL") == 0)
+		{
+			value.set(_gatewayCacheTTL);
+		}
+		else
+		{
+			return false;
+		}
+		return true;
 	}
+
 	void IOT::registerMBWorkers(FunctionCode fc, MBSworker worker)
 	{
 		_MBserver.registerWorker(_modbusID, fc, worker);
 	}
 
+	void IOT::ProcessImageChanged()
+	{
+		_MBserver.imageChanged();
+	}
+
+	bool IOT::Offer(PublishClass cls, const char *subtopic, const char *payload, size_t len, bool text)
+	{
+		return _publisher.Offer(cls, subtopic, payload, len, text);
+	}
+
+	PayloadCodec &IOT::Codec()
+	{
+		return _codec;
+	}
+
+	CommandRouter &IOT::Commands()
+	{
+		return _router;
+	}
+
+	AsyncAuthenticationMiddleware &IOT::Authentication()
+	{
+		return basicAuth;
+	}
+
+	bool IOT::Store(const char *payload, size_t len)
+	{
+		if (!_outbox.isOpen() || !_useMQTT || _mqttServer.length() == 0)
+		{
+			return true; // nowhere to keep it or nobody to send it to
+		}
+		unsigned long now = millis();
+		if (now - _lastStored < OUTBOX_MIN_INTERVAL)
+		{
+			return false; // try again with the latest readings
+		}
+		_lastStored = now;
+		_outbox.Append(payload, len, time(nullptr));
+		return true;
+	}
+
+	void IOT::DrainOutbox()
+	{
+		unsigned long now = millis();
+		if (_outboxResized)
+		{
+			_outboxResized = false;
+			_drainMsgId = -1;
+			_outbox.begin(_outboxKB * 1024);
+		}
+		// a batch stays in flash until the broker acknowledged it, then it is marked sent
+		if (_drainMsgId != -1)
+		{
+			if (_drainAcked)
+			{
+				_outbox.Commit();
+				_drainMsgId = -1;
+			}
+			else if (!_mqttConnected || now - _lastDrain > OUTBOX_ACK_TIMEOUT)
+			{
+				_drainMsgId = -1; // peeked again, the broker may see the batch twice
+			}
+			else
+			{
+				return;
+			}
+		}
+		// one batch per interval so the backlog never crowds out live readings
+		if (!_mqttConnected || _outbox.Pending() == 0 || now - _lastDrain < OUTBOX_DRAIN_INTERVAL || _mqttOutbox.Bytes() > _mqttOutbox.Capacity() / 2 || esp_mqtt_client_get_outbox_size(_mqtt_client_handle) >= MQTT_INFLIGHT_BYTES)
+		{
+			return;
+		}
+		_lastDrain = now;
+		uint16_t records = 0;
+		size_t len = _outbox.Peek(records);
+		if (records == 0)
+		{
+			_outbox.Commit(); // corrupt records only
+			return;
+		}
+		// sent past the RAM queue as QoS 1, so its msg_id is known when MQTT_EVENT_PUBLISHED comes
+		char topic[STR_LEN * 2];
+		snprintf(topic, sizeof(topic), "%s/stat/backlog", _rootTopicPrefix);
+		_drainAcked = false;
+		_drainMsgId = _mqttOutbox.Send(_mqtt_client_handle, topic, _outbox.Batch(), len, 1, false);
+	}
+
+	void IOT::PublishEdge(const char *name, const char *state)
+	{
+		_publisher.Edge(name, state);
+	}
+
 	void IOT::loadSettings()
 	{
 		String jsonString;
@@ -358,18 +1063,50 @@ namespace EDGEBOX
 			_mqttPort = iot["mqttPort"].isNull() ? 1883 : iot["mqttPort"].as<uint16_t>();
 			_mqttUserName = iot["mqttUser"].isNull() ? "" : iot["mqttUser"].as<String>();
 			_mqttUserPassword = iot["mqttPw"].isNull() ? "" : iot["mqttPw"].as<String>();
+			_publishWindow = iot["publishWindow"].isNull() ? MQTT_PUBLISH_WINDOW : iot["publishWindow"].as<uint32_t>();
+			_publishInterval = iot["publishInterval"].isNull() ? MQTT_PUBLISH_RATE_LIMIT : iot["publishInterval"].as<uint32_t>();
+			_publishEdges = iot["publishEdges"].isNull() ? false : iot["publishEdges"].as<bool>();
+			_pointTopics = iot["pointTopics"].isNull() ? false : iot["pointTopics"].as<bool>();
+			_payloadEncoding = iot["payloadEncoding"].isNull() ? EncodingJson : iot["payloadEncoding"].as<PayloadEncoding>();
+			_positional = iot["positional"].isNull() ? false : iot["positional"].as<bool>();
+			_outboxKB = iot["outboxKB"].isNull() ? OUTBOX_RETENTION_KB : iot["outboxKB"].as<uint16_t>();
+			_sparkplug = iot["sparkplug"].isNull() ? false : iot["sparkplug"].as<bool>();
+			_spGroup = iot["spGroup"].isNull() ? TAG : iot["spGroup"].as<String>();
+			_mqttOutboxKB = iot["mqttOutboxKB"].isNull() ? MQTT_OUTBOX_KB : iot["mqttOutboxKB"].as<uint16_t>();
+			_outboxPolicy = iot["outboxPolicy"].isNull() ? OutboxOldestFirst : iot["outboxPolicy"].as<OutboxPolicy>();
+			_telemetryQos = iot["telemetryQos"].isNull() ? MQTT_QOS_TELEMETRY : iot["telemetryQos"].as<uint8_t>();
+			_mqtt5 = iot["mqtt5"].isNull() ? false : iot["mqtt5"].as<bool>();
 			_useModbus = iot["useModbus"].isNull() ? false : iot["useModbus"].as<bool>();
 			_modbusPort = iot["modbusPort"].isNull() ? 502 : iot["modbusPort"].as<uint16_t>();
 			_modbusID = iot["modbusID"].isNull() ? 1 : iot["modbusID"].as<uint16_t>();
+			_modbusMaxClients = iot["modbusMaxClients"].isNull() ? MB_MAX_CLIENTS : iot["modbusMaxClients"].as<uint8_t>();
+			_modbusIdleTimeout = iot["modbusIdleTimeout"].isNull() ? MB_IDLE_TIMEOUT : iot["modbusIdleTimeout"].as<uint16_t>();
+			_modbusRateLimit = iot["modbusRateLimit"].isNull() ? MB_RATE_LIMIT : iot["modbusRateLimit"].as<uint16_t>();
 			_input_register_base_addr = iot["inputRegBase"].isNull() ? INPUT_REGISTER_BASE_ADDRESS : iot["inputRegBase"].as<uint16_t>();
 			_coil_base_addr = iot["coilBase"].isNull() ? COIL_BASE_ADDRESS : iot["coilBase"].as<uint16_t>();
 			_discrete_input_base_addr = iot["discreteBase"].isNull() ? DISCRETE_BASE_ADDRESS : iot["discreteBase"].as<uint16_t>();
+			_useGateway = iot["useGateway"].isNull() ? false : iot["useGateway"].as<bool>();
+			_gatewayBaud = iot["gatewayBaud"].isNull() ? MB_GATEWAY_BAUD : iot["gatewayBaud"].as<uint32_t>();
+			_gatewayTimeout = iot["gatewayTimeout"].isNull() ? MB_GATEWAY_TIMEOUT : iot["gatewayTimeout"].as<uint32_t>();
+			_gatewayCacheTTL = iot["gatewayCacheTTL"].isNull() ? MB_GATEWAY_CACHE_TTL : iot["gatewayCacheTTL"].as<uint32_t>();
+			String pollerConfig;
+			if (!iot["poller"].isNull())
+			{
+				serializeJson(iot["poller"], pollerConfig);
+				_MBpoller.Configure(iot["poller"].as<JsonObject>());
+			}
+			{
+				std::lock_guard<std::mutex> guard(_pollerLock);
+				_pollerConfig = pollerConfig;
+			}
 			_iotCB->onLoadSetting(doc);
 		}
 	}
 
-	void IOT::saveSettings()
+	bool IOT::saveSettings()
 	{
+		// /submit saves on async_tcp, SaveSettingsLater on the main loop
+		std::lock_guard<std::mutex> guard(_settingsLock);
 		JsonDocument doc;
 		JsonObject iot = doc["iot"].to<JsonObject>();
 		iot["version"] = CONFIG_VERSION;
@@ -392,16 +1129,47 @@ namespace EDGEBOX
 		iot["mqttPort"] = _mqttPort;
 		iot["mqttUser"] = _mqttUserName;
 		iot["mqttPw"] = _mqttUserPassword;
+		iot["publishWindow"] = _publishWindow;
+		iot["publishInterval"] = _publishInterval;
+		iot["publishEdges"] = _publishEdges;
+		iot["pointTopics"] = _pointTopics;
+		iot["payloadEncoding"] = _payloadEncoding;
+		iot["positional"] = _positional;
+		iot["outboxKB"] = _outboxKB;
+		iot["sparkplug"] = _sparkplug;
+		iot["spGroup"] = _spGroup;
+		iot["mqttOutboxKB"] = _mqttOutboxKB;
+		iot["outboxPolicy"] = _outboxPolicy;
+		iot["telemetryQos"] = _telemetryQos;
+		iot["mqtt5"] = _mqtt5;
 		iot["useModbus"] = _useModbus;
 		iot["modbusPort"] = _modbusPort;
 		iot["modbusID"] = _modbusID;
+		iot["modbusMaxClients"] = _modbusMaxClients;
+		iot["modbusIdleTimeout"] = _modbusIdleTimeout;
+		iot["modbusRateLimit"] = _modbusRateLimit;
 		iot["inputRegBase"] = _input_register_base_addr;
 		iot["coilBase"] = _coil_base_addr;
 		iot["discreteBase"] = _discrete_input_base_addr;
+		iot["useGateway"] = _useGateway;
+		iot["gatewayBaud"] = _gatewayBaud;
+		iot["gatewayTimeout"] = _gatewayTimeout;
+		iot["gatewayCacheTTL"] = _gatewayCacheTTL;
+		String pollerConfig = PollerConfig();
+		if (pollerConfig.length() > 0)
+		{
+			iot["poller"] = serialized(pollerConfig);
+		}
 		_iotCB->onSaveSetting(doc);
 		String jsonString;
 		serializeJson(doc, jsonString);
 		// Serial.println(jsonString.c_str());
+		if (jsonString.length() >= EEPROM_SIZE)
+		{
+			// a cut string doesn't parse on the next boot, which would reset every setting
+			loge("Settings need %d bytes, more than the EEPROM holds, not saved", jsonString.length() + 1);
+			return false;
+		}
 		for (int i = 0; i < jsonString.length(); ++i)
 		{
 			EEPROM.write(i, jsonString[i]);
@@ -409,11 +1177,34 @@ namespace EDGEBOX
 		EEPROM.write(jsonString.length(), '\0'); // Null-terminate the string
 		EEPROM.commit();
 		logd("JSON saved, required EEPROM size: %d", jsonString.length());
+		return true;
+	}
+
+	String IOT::PollerConfig()
+	{
+		std::lock_guard<std::mutex> guard(_pollerLock);
+		return _pollerConfig;
 	}
 
 	void IOT::Run()
 	{
 		uint32_t now = millis();
+		if (_savePending)
+		{
+			_savePending = false;
+			saveSettings();
+		}
+		if (_publisherChanged)
+		{
+			_publisherChanged = false;
+			_publisher.configure(_publishWindow, _publishInterval, _publishEdges);
+		}
+		if (_encodingChanged)
+		{
+			// between two encodes, a command decoded on the MQTT task meanwhile uses either encoding whole
+			_encodingChanged = false;
+			_codec.setEncoding(_payloadEncoding, _positional);
+		}
 		if (_networkState == Boot && _NetworkSelection == NotConnected)
 		{ // Network not setup?, see if flasher is trying to send us the SSID/Pw
 			if (Serial.peek() == '{')
@@ -489,6 +1280,48 @@ namespace EDGEBOX
 		else if (_networkState == OnLine)
 		{
 			_webLog.process();
+			if (_pollerChanged)
+			{
+				// a tag list from /submit, applied once the blocks of the old one are off the bus
+				_MBpoller.Stop();
+				if (_MBpoller.Idle())
+				{
+					_pollerChanged = false;
+					JsonDocument doc;
+					deserializeJson(doc, PollerConfig());
+					_MBpoller.Configure(doc.as<JsonObject>());
+					if (_MBpoller.needsRTU())
+					{
+						_MBgateway.begin(_gatewayBaud, _gatewayTimeout, _gatewayCacheTTL);
+					}
+					_MBpoller.begin(&_MBgateway);
+				}
+			}
+			_MBpoller.Run();
+			if (_MBpoller.hasChanges() && _publisher.Ready(PublishPoller))
+			{
+				// poller changes are deltas, they accumulate in the poller until the publisher is ready
+				JsonDocument doc;
+				_MBpoller.TakeChanges(doc);
+				_publisher.Sent(PublishPoller, Publish("poller", doc));
+			}
+			_publisher.Run();
+			if (_mqttConnected && millis() - _lastMetrics >= METRICS_PUBLISH_INTERVAL)
+			{
+				_lastMetrics = millis();
+				PublishMetrics();
+			}
+			if (_mqttConnected && _spRebirth)
+			{
+				// built here, before the scan publishes DDATA, so births and data are sequenced by one task
+				_spRebirth = false;
+				PublishNodeBirth();
+			}
+			DrainOutbox();
+			if (_mqttConnected)
+			{
+				_mqttOutbox.Flush(_mqtt_client_handle);
+			}
 		}
 #ifndef LOG_TO_SERIAL_PORT
 		// use LED if the log level is none (edgeBox shares the LED pin with the serial TX gpio)
@@ -517,7 +1350,7 @@ namespace EDGEBOX
 	{
 		logd("GoOnline called");
 		_pwebServer->begin();
-		_webLog.begin(_pwebServer);
+		_webLog.begin(_pwebServer, &basicAuth);
 		_OTA.begin(_pwebServer);
 		if (_networkState > ApState)
 		{
@@ -528,19 +1361,38 @@ namespace EDGEBOX
 				logd("Active mDNS services: %d", MDNS.queryService("http", "tcp"));
 			}
 			this->IOTCB()->onNetworkConnect();
+			if ((_useModbus && _useGateway) || _MBpoller.needsRTU())
+			{
+				_MBgateway.begin(_gatewayBaud, _gatewayTimeout, _gatewayCacheTTL); // RS485 bus
+			}
 			if (_useModbus && !_MBserver.isRunning())
 			{
-				_MBserver.start(_modbusPort, 5, 0); // listen for modbus requests
+				if (_useGateway)
+				{
+					// unit ids without a local worker are forwarded to the RS485 slaves
+					_MBserver.setRouter([](ModbusMessage request, MBResponder respond)
+										{ return _MBgateway.Route(request, respond); });
+				}
+				_MBserver.setRateLimit(_modbusRateLimit);
+				_MBserver.start(_modbusPort, _modbusMaxClients, _modbusIdleTimeout * 1000); // listen for modbus requests
 			}
+			_MBpoller.begin(&_MBgateway);
 			logd("Before xTimerStart _NetworkSelection: %d", _NetworkSelection );
-			xTimerStart(mqttReconnectTimer, 0);
+			xTimerChangePeriod(mqttReconnectTimer, pdMS_TO_TICKS(MQTT_CONNECT_DELAY), 0); // starts the one shot
 			setState(OnLine);
 		}
 	}
 
 	void IOT::GoOffline()
 	{
+		if (_mqttStarted)
+		{
+			_mqttStarted = false; // the client is started again with the next network
+			esp_mqtt_client_stop(_mqtt_client_handle);
+		}
 		xTimerStop(mqttReconnectTimer, 0); // ensure we don't reconnect to MQTT while reconnecting to Wi-Fi
+		_mqttConnected = false; // readings go to the outbox until the broker is back
+		_mqttOutbox.Disconnected();
 		_webLog.end();
 		_dnsServer.stop();
 		MDNS.end();
@@ -627,66 +1479,99 @@ namespace EDGEBOX
 	{
 		auto event = (esp_mqtt_event_handle_t)event_data;
 		esp_mqtt_client_handle_t client = event->client;
-		JsonDocument doc;
 		switch ((esp_mqtt_event_id_t)event_id)
 		{
 		case MQTT_EVENT_CONNECTED:
-			logi("Connected to MQTT.");
+			mlogi(MQTT, "Connected to MQTT.");
+			_mqttConnected = true;
+			_mqttBackoff.Connected();
+			_mqttOutbox.Connected();
 			char buf[128];
-			sprintf(buf, "%s/cmnd/#", _rootTopicPrefix);
-			esp_mqtt_client_subscribe(client, buf, 0);
+			// an MQTT 5 session that survived the drop still holds the subscriptions
+			if (!(UseMqtt5() && event->session_present))
+			{
+				sprintf(buf, "%s/cmnd/#", _rootTopicPrefix);
+				esp_mqtt_client_subscribe(client, buf, 0);
+				if (_sparkplug)
+				{
+					snprintf(buf, sizeof(buf), "%s/%s/NCMD/%s", SPARKPLUG_NAMESPACE, _spGroup.c_str(), _rootTopicPrefix);
+					esp_mqtt_client_subscribe(client, buf, 0);
+					snprintf(buf, sizeof(buf), "%s/%s/DCMD/%s/#", SPARKPLUG_NAMESPACE, _spGroup.c_str(), _rootTopicPrefix);
+					esp_mqtt_client_subscribe(client, buf, 0);
+				}
+			}
+			else
+			{
+				mlogi(MQTT, "MQTT 5 session resumed");
+			}
 			IOTCB()->onMqttConnect();
-			esp_mqtt_client_publish(client, _willTopic, "Offline", 0, 1, 0);
+			if (_sparkplug)
+			{
+				_spBorn = false; // no DDATA until the births are queued
+				_spRebirth = true;
+			}
+			else if (UseMqtt5())
+			{
+				_mqttOutbox.Push(_willTopic, "Offline", 7, 1, false, false); // publish properties are set from the main loop only
+			}
+			else
+			{
+				esp_mqtt_client_publish(client, _willTopic, "Offline", 0, 1, 0);
+			}
 			break;
 		case MQTT_EVENT_DISCONNECTED:
-			logw("Disconnected from MQTT");
-			if (_networkState == OnLine)
+			mlogw(MQTT, "Disconnected from MQTT");
+			_mqttConnected = false;
+			_mqttOutbox.Disconnected();
+			_spBorn = false;
+			if (_networkState == OnLine && _mqttStarted)
 			{
-				xTimerStart(mqttReconnectTimer, 5000);
+				uint32_t delay = _mqttBackoff.Lost();
+				mlogi(MQTT, "Reconnecting to MQTT in %dms", delay);
+				xTimerChangePeriod(mqttReconnectTimer, pdMS_TO_TICKS(delay) + 1, 0); // starts the one shot
 			}
 			break;
 
 		case MQTT_EVENT_SUBSCRIBED:
-			logi("MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
+			mlogi(MQTT, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
 			break;
 		case MQTT_EVENT_UNSUBSCRIBED:
-			logi("MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
+			mlogi(MQTT, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
 			break;
 		case MQTT_EVENT_PUBLISHED:
-			logi("MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+			mlogi(MQTT, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+			if (event->msg_id == _drainMsgId)
+			{
+				_drainAcked = true;
+			}
 			break;
 		case MQTT_EVENT_DATA:
-			logd("MQTT Message arrived [%s]  qos: %d len: %d index: %d total: %d", event->topic, event->qos, event->data_len, event->current_data_offset, event->total_data_len);
-			if (deserializeJson(doc, event->data)) // not json!
+			mlogd(MQTT, "MQTT Message arrived [%.*s]  qos: %d len: %d index: %d total: %d", event->topic_len, event->topic, event->qos, event->data_len, event->current_data_offset, event->total_data_len);
+			const char *topic;
+			const uint8_t *data;
+			size_t len;
+			if (!_router.Assemble(event, topic, data, len))
 			{
-				logd("MQTT payload {%s} is not valid JSON!", event->data);
+				break; // more fragments to come
+			}
+			if (_sparkplug && strncmp(topic, SPARKPLUG_NAMESPACE "/", strlen(SPARKPLUG_NAMESPACE) + 1) == 0)
+			{
+				HandleSparkplugCommand(topic, data, len);
 			}
 			else
 			{
-				if (doc.containsKey("status"))
-				{
-					doc.clear();
-					doc["sw_version"] = CONFIG_VERSION;
-					// doc["IP"] = WiFi.localIP().toString().c_str();
-					// doc["SSID"] = WiFi.SSID();
-					doc["uptime"] = formatDuration(millis() - _lastBootTimeStamp);
-					Publish("status", doc, true);
-				}
-				else
-				{
-					IOTCB()->onMqttMessage(event->topic, doc);
-				}
+				_router.Dispatch(_rootTopicPrefix, topic, data, len, _codec);
 			}
 			break;
 		case MQTT_EVENT_ERROR:
-			loge("MQTT_EVENT_ERROR");
+			mloge(MQTT, "MQTT_EVENT_ERROR");
 			if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT)
 			{
-				logi("Last errno string (%s)", strerror(event->error_handle->esp_transport_sock_errno));
+				mlogi(MQTT, "Last errno string (%s)", strerror(event->error_handle->esp_transport_sock_errno));
 			}
 			break;
 		default:
-			logi("Other event id:%d", event->event_id);
+			mlogi(MQTT, "Other event id:%d", event->event_id);
 			break;
 		}
 	}
@@ -697,47 +1582,174 @@ namespace EDGEBOX
 		{
 			if (_useMQTT && _mqttServer.length() > 0) // mqtt configured?
 			{
-				logd("Connecting to MQTT...");
+				mlogd(MQTT, "Connecting to MQTT...");
 				int len = strlen(_AP_SSID.c_str());
 				strncpy(_rootTopicPrefix, _AP_SSID.c_str(), len);
-				logd("rootTopicPrefix: %s", _rootTopicPrefix);
+				mlogd(MQTT, "rootTopicPrefix: %s", _rootTopicPrefix);
 				sprintf(_willTopic, "%s/tele/LWT", _rootTopicPrefix);
-				logd("_willTopic: %s", _willTopic);
+				size_t willLen = 7;
+				if (_sparkplug)
+				{
+					// the will is the Sparkplug NDEATH, its bdSeq ties it to the NBIRTH of this session
+					_bdSeq = _bdSeqNext++;
+					snprintf(_willTopic, sizeof(_willTopic), "%s/%s/NDEATH/%s", SPARKPLUG_NAMESPACE, _spGroup.c_str(), _rootTopicPrefix);
+					SparkplugPayload death(_spDeath, sizeof(_spDeath));
+					death.begin(SparkplugPayload::Now());
+					death.addUInt64("bdSeq", 0, _bdSeq);
+					willLen = death.length();
+				}
+				mlogd(MQTT, "_willTopic: %s", _willTopic);
 				esp_mqtt_client_config_t mqtt_cfg = {};
+#if ESP_IDF_VERSION_MAJOR >= 5
+				mqtt_cfg.broker.address.hostname = _mqttServer.c_str();
+				mqtt_cfg.broker.address.port = _mqttPort;
+				mqtt_cfg.broker.address.transport = MQTT_TRANSPORT_OVER_TCP;
+				mqtt_cfg.credentials.username = _mqttUserName.c_str();
+				mqtt_cfg.credentials.authentication.password = _mqttUserPassword.c_str();
+				mqtt_cfg.credentials.client_id = _AP_SSID.c_str();
+				mqtt_cfg.session.last_will.topic = _willTopic;
+				mqtt_cfg.session.last_will.retain = _sparkplug ? 0 : 1;
+				mqtt_cfg.session.last_will.qos = 1;
+				mqtt_cfg.session.last_will.msg = _sparkplug ? (const char *)_spDeath : "Offline";
+				mqtt_cfg.session.last_will.msg_len = willLen;
+				mqtt_cfg.network.disable_auto_reconnect = true; // paced by _mqttBackoff
+#ifdef CONFIG_MQTT_PROTOCOL_5
+				if (_mqtt5)
+				{
+					// keep the session on the broker so a 4G reconnect doesn't have to subscribe again
+					mqtt_cfg.session.protocol_ver = MQTT_PROTOCOL_V_5;
+					mqtt_cfg.session.disable_clean_session = true;
+				}
+#endif
+#else
 				mqtt_cfg.host = _mqttServer.c_str();
 				mqtt_cfg.port = _mqttPort;
 				mqtt_cfg.username = _mqttUserName.c_str();
 				mqtt_cfg.password = _mqttUserPassword.c_str();
 				mqtt_cfg.client_id = _AP_SSID.c_str();
 				mqtt_cfg.lwt_topic = _willTopic;
-				mqtt_cfg.lwt_retain = 1;
-				mqtt_cfg.lwt_msg = "Offline";
-				mqtt_cfg.lwt_msg_len = 7;
-				_mqtt_client_handle = esp_mqtt_client_init(&mqtt_cfg);
-				esp_mqtt_client_register_event(_mqtt_client_handle, (esp_mqtt_event_id_t)ESP_EVENT_ANY_ID, mqtt_event_handler, this);
-				esp_mqtt_client_start(_mqtt_client_handle);
+				mqtt_cfg.lwt_retain = _sparkplug ? 0 : 1;
+				mqtt_cfg.lwt_qos = 1;
+				mqtt_cfg.lwt_msg = _sparkplug ? (const char *)_spDeath : "Offline";
+				mqtt_cfg.lwt_msg_len = willLen;
+				mqtt_cfg.disable_auto_reconnect = true; // paced by _mqttBackoff
+#endif
+				if (_mqtt5 && !UseMqtt5())
+				{
+					mlogw(MQTT, "MQTT 5 needs CONFIG_MQTT_PROTOCOL_5, connecting with 3.1.1");
+				}
+				_mqttOutbox.setProtocol(UseMqtt5());
+				_mqttBackoff.Attempt();
+				// one client for the life of the firmware, a new session only updates its config (the will changes with Sparkplug)
+				bool created = _mqtt_client_handle == 0;
+				if (created)
+				{
+					_mqtt_client_handle = esp_mqtt_client_init(&mqtt_cfg);
+				}
+				else
+				{
+					esp_mqtt_set_config(_mqtt_client_handle, &mqtt_cfg);
+				}
+#ifdef CONFIG_MQTT_PROTOCOL_5
+				if (_mqtt5)
+				{
+					esp_mqtt5_connection_property_config_t property = {};
+					property.session_expiry_interval = MQTT5_SESSION_EXPIRY;
+					esp_mqtt5_client_set_connect_property(_mqtt_client_handle, &property);
+				}
+#endif
+				if (created)
+				{
+					esp_mqtt_client_register_event(_mqtt_client_handle, (esp_mqtt_event_id_t)ESP_EVENT_ANY_ID, mqtt_event_handler, this);
+				}
+				if (!_mqttStarted)
+				{
+					_mqttStarted = esp_mqtt_client_start(_mqtt_client_handle) == ESP_OK;
+				}
+				else if (esp_mqtt_client_reconnect(_mqtt_client_handle) != ESP_OK)
+				{
+					mlogd(MQTT, "MQTT client is not waiting to reconnect"); // its DISCONNECTED event schedules the next attempt
+				}
 			}
 		}
 	}
 
 	boolean IOT::Publish(const char *subtopic, JsonDocument &payload, boolean retained)
 	{
-		String s;
-		serializeJson(payload, s);
-		return Publish(subtopic, s.c_str(), retained);
+		if (_codec.encoding() == EncodingJson)
+		{
+			String s;
+			serializeJson(payload, s);
+			_codec.Count(s.length(), s.length());
+			return Publish(subtopic, s.c_str(), s.length(), retained);
+		}
+		// CBOR can run a byte longer than MessagePack on short strings
+		size_t size = measureMsgPack(payload);
+		std::vector<uint8_t> buf(size + size / 8 + 16);
+		size_t len = _codec.Encode(payload, buf.data(), buf.size());
+		if (len == 0)
+		{
+			mloge(MQTT, "Failed to encode %s payload", subtopic);
+			return false;
+		}
+		return Publish(subtopic, (const char *)buf.data(), len, retained);
 	}
 
 	boolean IOT::Publish(const char *subtopic, const char *value, boolean retained)
+	{
+		return Publish(subtopic, value, strlen(value), retained);
+	}
+
+	uint8_t IOT::QosFor(const char *subtopic)
+	{
+		// telemetry is superseded by the next scan, everything else is sent at least once
+		if (AliasFor(subtopic) != 0)
+		{
+			return _telemetryQos;
+		}
+		return 1;
+	}
+
+	uint8_t IOT::AliasFor(const char *subtopic)
+	{
+		// the high rate topics get an MQTT 5 topic alias
+		if (strcmp(subtopic, "readings") == 0)
+		{
+			return 1;
+		}
+		if (strcmp(subtopic, "poller") == 0)
+		{
+			return 2;
+		}
+		return 0;
+	}
+
+	boolean IOT::Publish(const char *subtopic, const char *payload, size_t len, boolean retained)
 	{
 		boolean rVal = false;
 		if (_mqtt_client_handle != 0)
 		{
 			char buf[128];
 			sprintf(buf, "%s/stat/%s", _rootTopicPrefix, subtopic);
-			rVal = (esp_mqtt_client_publish(_mqtt_client_handle, buf, value, strlen(value), 1, retained) != -1);
+			uint8_t alias = AliasFor(subtopic);
+			rVal = _mqttOutbox.Push(buf, payload, len, QosFor(subtopic), retained, true, alias, alias != 0 ? MQTT5_TELEMETRY_EXPIRY : 0);
+			if (!rVal)
+			{
+				mloge(MQTT, "**** Failed to publish MQTT message");
+			}
+		}
+		return rVal;
+	}
+
+	boolean IOT::PublishTopic(const char *topic, const char *value, boolean retained)
+	{
+		boolean rVal = false;
+		if (_mqtt_client_handle != 0)
+		{
+			rVal = _mqttOutbox.Push(topic, value, strlen(value), _telemetryQos, retained); // point values
 			if (!rVal)
 			{
-				loge("**** Failed to publish MQTT message");
+				mloge(MQTT, "**** Failed to publish MQTT message to %s", topic);
 			}
 		}
 		return rVal;
@@ -757,27 +1769,132 @@ namespace EDGEBOX
 		{
 			String s;
 			serializeJson(payload, s);
-			rVal = (esp_mqtt_client_publish(_mqtt_client_handle, topic, s.c_str(), s.length(), 0, retained) != -1);
+			rVal = _mqttOutbox.Push(topic, s.c_str(), s.length(), 0, retained);
 			if (!rVal)
 			{
-				loge("**** Configuration payload exceeds MAX MQTT Packet Size, %d [%s] topic: %s", s.length(), s.c_str(), topic);
+				mloge(MQTT, "**** Configuration payload exceeds the MQTT outbox cap, %d topic: %s", s.length(), topic);
 			}
 		}
 		return rVal;
 	}
 
-	boolean IOT::PublishHADiscovery(JsonDocument &payload)
+	boolean IOT::PublishHADiscovery(const char *component, const char *objectId, const char *payload, size_t len)
 	{
+		// an empty payload removes the component, no object id addresses the device config of earlier versions
 		boolean rVal = false;
 		if (_mqtt_client_handle != 0)
 		{
-			char topic[64];
-			sprintf(topic, "%s/device/%s_%X/config", HOME_ASSISTANT_PREFIX, TAG, getUniqueId());
-			rVal = PublishMessage(topic, payload, true);
+			char topic[STR_LEN * 2];
+			if (objectId != nullptr)
+			{
+				snprintf(topic, sizeof(topic), "%s/%s/%s_%X_%s/config", HOME_ASSISTANT_PREFIX, component, TAG, getUniqueId(), objectId);
+			}
+			else
+			{
+				snprintf(topic, sizeof(topic), "%s/%s/%s_%X/config", HOME_ASSISTANT_PREFIX, component, TAG, getUniqueId());
+			}
+			rVal = _mqttOutbox.Push(topic, len > 0 ? payload : "", len, 1, true);
+			if (!rVal)
+			{
+				mloge(MQTT, "**** Failed to queue discovery for %s", topic);
+			}
 		}
 		return rVal;
 	}
 
+	bool IOT::PublishSparkplug(const char *type, const char *device, const uint8_t *payload, size_t len)
+	{
+		if (_mqtt_client_handle == 0 || len == 0)
+		{
+			return false;
+		}
+		char topic[STR_LEN * 2];
+		if (device != nullptr)
+		{
+			snprintf(topic, sizeof(topic), "%s/%s/%s/%s/%s", SPARKPLUG_NAMESPACE, _spGroup.c_str(), type, _rootTopicPrefix, device);
+		}
+		else
+		{
+			snprintf(topic, sizeof(topic), "%s/%s/%s/%s", SPARKPLUG_NAMESPACE, _spGroup.c_str(), type, _rootTopicPrefix);
+		}
+		// sequenced, a newer message must never replace a queued one
+		return _mqttOutbox.Push(topic, (const char *)payload, len, 0, false, false);
+	}
+
+	void IOT::PublishNodeBirth()
+	{
+		_spBorn = false; // hold DDATA until the device birth is queued, main loop only
+		uint8_t buf[SPARKPLUG_BUFFER];
+		SparkplugPayload payload(buf, sizeof(buf));
+		payload.begin(SparkplugPayload::Now());
+		payload.addUInt64("bdSeq", 0, _bdSeq);
+		payload.addBool("Node Control/Rebirth", 0, false);
+		payload.addString("Properties/sw_version", 0, CONFIG_VERSION);
+		_spSeq = 0;
+		payload.seq(SparkplugSeq());
+		PublishSparkplug("NBIRTH", nullptr, buf, payload.length());
+		IOTCB()->onSparkplugBirth();
+		_spBorn = true;
+		mlogi(MQTT, "Sparkplug birth, bdSeq: %d", _bdSeq);
+	}
+
+	void IOT::HandleCommand(const char *topic, JsonDocument &doc)
+	{
+		// commands in the payload of <prefix>/cmnd, as sent before per command topics
+		if (!doc["status"].isNull())
+		{
+			PublishStatus();
+		}
+		else if (doc["log"].is<JsonObject>())
+		{
+			// {"log": {"MB": 4}} sets the runtime log threshold of a module
+			WebLog::setLevels(doc["log"].as<JsonObject>());
+			doc.clear();
+			JsonObject levels = doc.to<JsonObject>();
+			WebLog::getLevels(levels);
+			Publish("log", doc, false);
+		}
+		else
+		{
+			IOTCB()->onMqttMessage((char *)topic, doc);
+		}
+	}
+
+	void IOT::PublishStatus()
+	{
+		JsonDocument doc;
+		doc["sw_version"] = CONFIG_VERSION;
+		// doc["IP"] = WiFi.localIP().toString().c_str();
+		// doc["SSID"] = WiFi.SSID();
+		doc["uptime"] = formatDuration(millis() - _lastBootTimeStamp);
+		Publish("status", doc, true);
+	}
+
+	void IOT::HandleSparkplugCommand(const char *topic, const uint8_t *data, size_t len)
+	{
+		JsonDocument doc;
+		if (!SparkplugPayload::Decode(data, len, doc))
+		{
+			mlogw(MQTT, "Invalid Sparkplug payload on %s", topic);
+			return;
+		}
+		if (strstr(topic, "/NCMD/") != nullptr)
+		{
+			for (JsonObject metric : doc["metrics"].as<JsonArray>())
+			{
+				if (metric["name"] == "Node Control/Rebirth" && metric["value"] == true)
+				{
+					_spBorn = false;
+					_spRebirth = true;
+				}
+			}
+		}
+		else if (strstr(topic, "/DCMD/") != nullptr)
+		{
+			IOTCB()->onMqttMessage((char *)topic, doc);
+		}
+	}
+
 	std::string IOT::getRootTopicPrefix()
 	{
 		std::string s(_rootTopicPrefix);
@@ -792,9 +1909,10 @@ namespace EDGEBOX
 
 	void IOT::PublishOnline()
 	{
-		if (!_publishedOnline)
+		if (!_publishedOnline && !_sparkplug) // Sparkplug hosts go by NBIRTH/NDEATH
 		{
-			if (esp_mqtt_client_publish(_mqtt_client_handle, _willTopic, "Online", 0, 1, 1) != -1)
+			// with MQTT 5 it queues behind the Offline published on connect
+			if (UseMqtt5() ? _mqttOutbox.Push(_willTopic, "Online", 6, 1, true, false) : _mqttOutbox.Send(_mqtt_client_handle, _willTopic, "Online", 6, 1, true) != -1)
 			{
 				_publishedOnline = true;
 			}
@@ -807,49 +1925,49 @@ namespace EDGEBOX
 		if (event_id == IP_EVENT_PPP_GOT_IP || event_id == IP_EVENT_ETH_GOT_IP)
 		{
 			const esp_netif_ip_info_t *ip_info = &event->ip_info;
-			logi("Got IP Address");
-			logi("~~~~~~~~~~~");
-			logi("IP:" IPSTR, IP2STR(&ip_info->ip));
-			logi("IPMASK:" IPSTR, IP2STR(&ip_info->netmask));
-			logi("Gateway:" IPSTR, IP2STR(&ip_info->gw));
-			logi("~~~~~~~~~~~");
+			mlogi(NET, "Got IP Address");
+			mlogi(NET, "~~~~~~~~~~~");
+			mlogi(NET, "IP:" IPSTR, IP2STR(&ip_info->ip));
+			mlogi(NET, "IPMASK:" IPSTR, IP2STR(&ip_info->netmask));
+			mlogi(NET, "Gateway:" IPSTR, IP2STR(&ip_info->gw));
+			mlogi(NET, "~~~~~~~~~~~");
 			GoOnline();
 		}
 		else if (event_id == IP_EVENT_PPP_LOST_IP)
 		{
-			logi("Modem Disconnect from PPP Server");
+			mlogi(NET, "Modem Disconnect from PPP Server");
 			GoOffline();
 		}
 		else if (event_id == IP_EVENT_ETH_LOST_IP)
 		{
-			logi("Ethernet Disconnect");
+			mlogi(NET, "Ethernet Disconnect");
 			GoOffline();
 		}
 		else if (event_id == IP_EVENT_GOT_IP6)
 		{
 			ip_event_got_ip6_t *event = (ip_event_got_ip6_t *)event_data;
-			logi("Got IPv6 address " IPV6STR, IPV62STR(event->ip6_info.ip));
+			mlogi(NET, "Got IPv6 address " IPV6STR, IPV62STR(event->ip6_info.ip));
 		}
 		else 
 		{
-			logd("IP event! %d", (int)event_id);
+			mlogd(NET, "IP event! %d", (int)event_id);
 		}
 	}
 
 	esp_err_t IOT::ConnectEthernet()
 	{
-		logd("ConnectEthernet");
+		mlogd(NET, "ConnectEthernet");
 		esp_err_t ret = ESP_OK;
 		if ((ret = gpio_install_isr_service(0)) != ESP_OK)
 		{
 			if (ret == ESP_ERR_INVALID_STATE)
 			{
-				logw("GPIO ISR handler has been already installed");
+				mlogw(NET, "GPIO ISR handler has been already installed");
 				ret = ESP_OK; // ISR handler has been already installed so no issues
 			}
 			else
 			{
-				logd("GPIO ISR handler install failed");
+				mlogd(NET, "GPIO ISR handler install failed");
 			}
 		}
 		spi_bus_config_t buscfg = {
@@ -861,7 +1979,7 @@ namespace EDGEBOX
 		};
 		if ((ret = spi_bus_initialize(SPI2_HOST, &buscfg, SPI_DMA_CH_AUTO)) != ESP_OK)
 		{
-			logd("SPI host #1 init failed");
+			mlogd(NET, "SPI host #1 init failed");
 			return ret;
 		}
 		uint8_t base_mac_addr[6];
@@ -869,7 +1987,7 @@ namespace EDGEBOX
 		{
 			uint8_t local_mac_1[6];
 			esp_derive_local_mac(local_mac_1, base_mac_addr);
-			logi("ETH MAC: %02X:%02X:%02X:%02X:%02X:%02X", local_mac_1[0], local_mac_1[1], local_mac_1[2], local_mac_1[3], local_mac_1[4], local_mac_1[5]);
+			mlogi(NET, "ETH MAC: %02X:%02X:%02X:%02X:%02X:%02X", local_mac_1[0], local_mac_1[1], local_mac_1[2], local_mac_1[3], local_mac_1[4], local_mac_1[5]);
 			eth_mac_config_t mac_config = ETH_MAC_DEFAULT_CONFIG(); // Init common MAC and PHY configs to default
 			eth_phy_config_t phy_config = ETH_PHY_DEFAULT_CONFIG();
 			phy_config.phy_addr = 1;
@@ -885,7 +2003,7 @@ namespace EDGEBOX
 			spi_device_handle_t spi_handle;
 			if ((ret = spi_bus_add_device(SPI2_HOST, &spi_devcfg, &spi_handle)) != ESP_OK)
 			{
-				loge("spi_bus_add_device failed");
+				mloge(NET, "spi_bus_add_device failed");
 				return ret;
 			}
 			eth_w5500_config_t w5500_config = ETH_W5500_DEFAULT_CONFIG(spi_handle);
@@ -896,12 +2014,12 @@ namespace EDGEBOX
 			esp_eth_config_t eth_config_spi = ETH_DEFAULT_CONFIG(mac, phy);
 			if ((ret = esp_eth_driver_install(&eth_config_spi, &_eth_handle)) != ESP_OK)
 			{
-				loge("esp_eth_driver_install failed");
+				mloge(NET, "esp_eth_driver_install failed");
 				return ret;
 			}
 			if ((ret = esp_eth_ioctl(_eth_handle, ETH_CMD_S_MAC_ADDR, local_mac_1)) != ESP_OK) // set mac address
 			{
-				logd("SPI Ethernet MAC address config failed");
+				mlogd(NET, "SPI Ethernet MAC address config failed");
 			}
 			esp_netif_config_t cfg = ESP_NETIF_DEFAULT_ETH(); // Initialize the Ethernet interface
 			_netif = esp_netif_new(&cfg);
@@ -919,24 +2037,24 @@ namespace EDGEBOX
 				ipInfo.gw.addr = static_cast<uint32_t>(ip);
 				if ((ret = esp_netif_set_ip_info(_netif, &ipInfo)) != ESP_OK)
 				{
-					loge("esp_netif_set_ip_info failed: %d", ret);
+					mloge(NET, "esp_netif_set_ip_info failed: %d", ret);
 					return ret;
 				}
 			}
 			_eth_netif_glue = esp_eth_new_netif_glue(_eth_handle);
 			if ((ret = esp_netif_attach(_netif, _eth_netif_glue)) != ESP_OK)
 			{
-				loge("esp_netif_attach failed");
+				mloge(NET, "esp_netif_attach failed");
 				return ret;
 			}
 			if ((ret = esp_event_handler_register(IP_EVENT, ESP_EVENT_ANY_ID, &on_ip_event, this)) != ESP_OK)
 			{
-				loge("esp_event_handler_register IP_EVENT->IP_EVENT_ETH_GOT_IP failed");
+				mloge(NET, "esp_event_handler_register IP_EVENT->IP_EVENT_ETH_GOT_IP failed");
 				return ret;
 			}
 			if ((ret = esp_eth_start(_eth_handle)) != ESP_OK)
 			{
-				loge("esp_netif_attach failed");
+				mloge(NET, "esp_netif_attach failed");
 				return ret;
 			}
 		}
@@ -950,15 +2068,15 @@ namespace EDGEBOX
 		digitalWrite(MODEM_PWR_EN, HIGH); // send power to the A7670G
 		digitalWrite(MODEM_PWR_KEY, LOW);
 		delay(1000);
-		logd("Power on the modem");
+		mlogd(MODEM, "Power on the modem");
 		digitalWrite(MODEM_PWR_KEY, HIGH);
 		delay(2000);
-		logd("Modem is powered up and ready");
+		mlogd(MODEM, "Modem is powered up and ready");
 	}
 
 	esp_err_t IOT::ConnectModem()
 	{
-		logd("ConnectModem");
+		mlogd(MODEM, "ConnectModem");
 		esp_err_t ret = ESP_OK;
 		wakeup_modem();
 		esp_netif_config_t ppp_netif_config = ESP_NETIF_DEFAULT_PPP(); // Initialize lwip network interface in PPP mode
@@ -975,30 +2093,30 @@ namespace EDGEBOX
 		{
 			if (!modem_check_sync())
 			{
-				logw("Modem does not respond, maybe in DATA mode? ...exiting network mode");
+				mlogw(MODEM, "Modem does not respond, maybe in DATA mode? ...exiting network mode");
 				modem_stop_network();
 				if (!modem_check_sync())
 				{
-					logw("Modem does not respond to AT ...restarting");
+					mlogw(MODEM, "Modem does not respond to AT ...restarting");
 					modem_reset();
-					logi("Restarted");
+					mlogi(MODEM, "Restarted");
 				}
 				continue;
 			}
 			if (!modem_check_signal())
 			{
-				logw("Poor signal ...will check after 5s");
+				mlogw(MODEM, "Poor signal ...will check after 5s");
 				vTaskDelay(pdMS_TO_TICKS(5000));
 				continue;
 			}
 			if (!modem_start_network())
 			{
-				loge("Modem could not enter network mode ...will retry after 10s");
+				mloge(MODEM, "Modem could not enter network mode ...will retry after 10s");
 				vTaskDelay(pdMS_TO_TICKS(10000));
 				continue;
 			}
 		}
-		logi("Modem has acquired network");
+		mlogi(MODEM, "Modem has acquired network");
 		return ret;
 	}
 
@@ -0,0 +1,207 @@
+#include <Arduino.h>
+#include "JsonWriter.h"
+
+namespace EDGEBOX
+{
+	void JsonWriter::begin()
+	{
+		_len = 0;
+		_first = true;
+		_overflow = false;
+		put('{');
+	}
+
+	void JsonWriter::put(char c)
+	{
+		if (_len + 1 < _size)
+		{
+			_buffer[_len++] = c;
+		}
+		else
+		{
+			_overflow = true;
+		}
+	}
+
+	void JsonWriter::put(const char *s)
+	{
+		while (*s)
+		{
+			put(*s++);
+		}
+	}
+
+	void JsonWriter::putString(const char *s)
+	{
+		put('"');
+		while (*s)
+		{
+			if (*s == '"' || *s == '\\')
+			{
+				put('\\');
+			}
+			put(*s++);
+		}
+		put('"');
+	}
+
+	void JsonWriter::putUnsigned(uint32_t value, uint8_t minDigits)
+	{
+		char digits[10];
+		uint8_t n = 0;
+		do
+		{
+			digits[n++] = '0' + value % 10;
+			value /= 10;
+		} while (value > 0 || n < minDigits);
+		while (n > 0)
+		{
+			put(digits[--n]);
+		}
+	}
+
+	void JsonWriter::key(const char *name)
+	{
+		if (!_first)
+		{
+			put(',');
+		}
+		_first = false;
+		putString(name);
+		put(':');
+	}
+
+	void JsonWriter::add(const char *name, const char *value)
+	{
+		key(name);
+		putString(value);
+	}
+
+	void JsonWriter::add(const char *name, int32_t value)
+	{
+		key(name);
+		if (value < 0)
+		{
+			put('-');
+		}
+		putUnsigned(value < 0 ? -(int64_t)value : value);
+	}
+
+	void JsonWriter::addBool(const char *name, bool value)
+	{
+		key(name);
+		put(value ? "true" : "false");
+	}
+
+	void JsonWriter::add(const char *name, float value, uint8_t decimals)
+	{
+		key(name);
+		putFloat(value, decimals);
+	}
+
+	void JsonWriter::addPrecise(const char *name, float value)
+	{
+		key(name);
+		putPrecise(value);
+	}
+
+	size_t JsonWriter::formatFloat(char *buffer, size_t size, float value, uint8_t decimals)
+	{
+		JsonWriter writer(buffer, size);
+		writer.putFloat(value, decimals);
+		if (writer._overflow)
+		{
+			buffer[0] = 0;
+			return 0;
+		}
+		buffer[writer._len] = 0;
+		return writer._len;
+	}
+
+	void JsonWriter::putFloat(float value, uint8_t decimals)
+	{
+		uint32_t scale = 1;
+		for (uint8_t i = 0; i < decimals; i++)
+		{
+			scale *= 10;
+		}
+		if (isnan(value) || isinf(value) || fabsf(value) >= 4.0e9f / scale)
+		{
+			put("null"); // out of range for the integer formatting
+			return;
+		}
+		int64_t scaled = llroundf(value * scale);
+		if (scaled < 0)
+		{
+			put('-');
+			scaled = -scaled;
+		}
+		putUnsigned(scaled / scale);
+		uint32_t fraction = scaled % scale;
+		if (fraction == 0)
+		{
+			return; // 12.0 prints as 12, same as ArduinoJson
+		}
+		while (fraction % 10 == 0)
+		{
+			fraction /= 10; // drop trailing zeros
+			decimals--;
+		}
+		put('.');
+		putUnsigned(fraction, decimals);
+	}
+
+	size_t JsonWriter::end()
+	{
+		put('}');
+		if (_overflow)
+		{
+			_buffer[0] = 0;
+			return 0;
+		}
+		_buffer[_len] = 0;
+		return _len;
+	}
+
+	void JsonWriter::putPrecise(float value)
+	{
+		if (isnan(value) || isinf(value) || fabsf(value) >= 4.0e9f)
+		{
+			put("null");
+			return;
+		}
+		bool negative = value < 0;
+		value = fabsf(value);
+		uint32_t integral = (uint32_t)value;
+		// the decimals left of 7 significant digits
+		uint32_t scale = 1000000;
+		uint8_t decimals = 6;
+		for (uint32_t i = integral; i >= 10 && decimals > 0; i /= 10)
+		{
+			scale /= 10;
+			decimals--;
+		}
+		uint32_t fraction = lroundf((value - integral) * scale);
+		if (fraction >= scale)
+		{
+			integral++;
+			fraction = 0;
+		}
+		if (negative && (integral > 0 || fraction > 0))
+		{
+			put('-');
+		}
+		putUnsigned(integral);
+		if (fraction == 0)
+		{
+			return;
+		}
+		while (fraction % 10 == 0)
+		{
+			fraction /= 10;
+			decimals--;
+		}
+		put('.');
+		putUnsigned(fraction, decimals);
+	}
+}
@@ -0,0 +1,110 @@
+#include <Arduino.h>
+#include "LogRing.h"
+
+namespace EDGEBOX
+{
+	void LogRing::copyIn(uint32_t pos, const void *data, size_t len)
+	{
+		uint32_t mask = _size - 1;
+		size_t first = min(len, (size_t)(_size - (pos & mask)));
+		memcpy(_buffer + (pos & mask), data, first);
+		memcpy(_buffer, (const uint8_t *)data + first, len - first);
+	}
+
+	void LogRing::copyOut(uint32_t pos, void *data, size_t len)
+	{
+		uint32_t mask = _size - 1;
+		size_t first = min(len, (size_t)(_size - (pos & mask)));
+		memcpy(data, _buffer + (pos & mask), first);
+		memcpy((uint8_t *)data + first, _buffer, len - first);
+	}
+
+	bool LogRing::Push(uint8_t level, const void *data, size_t len)
+	{
+		if (len == 0)
+		{
+			return true; // nothing to log, and Pop returns 0 only when there is no record
+		}
+		len = min(len, (size_t)UINT16_MAX);
+		uint32_t size = HEADER + len;
+		uint32_t head = _head.load(std::memory_order_relaxed);
+		do
+		{
+			if (head + size - _tail.load(std::memory_order_acquire) > _size)
+			{
+				_dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+		} while (!_head.compare_exchange_weak(head, head + size, std::memory_order_acq_rel, std::memory_order_relaxed));
+		uint8_t header[HEADER - 1] = {level, (uint8_t)(len & 0xFF), (uint8_t)(len >> 8)};
+		copyIn(head + 1, header, sizeof(header));
+		copyIn(head + HEADER, data, len);
+		__atomic_store_n(&_buffer[head & (_size - 1)], 1, __ATOMIC_RELEASE); // published
+		_pushed.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	bool LogRing::record(uint32_t pos, uint8_t &level, size_t &len)
+	{
+		if (pos == _head.load(std::memory_order_acquire) || __atomic_load_n(&_buffer[pos & (_size - 1)], __ATOMIC_ACQUIRE) == 0)
+		{
+			return false; // empty, or the record is still being written
+		}
+		uint8_t header[HEADER];
+		copyOut(pos, header, HEADER);
+		level = header[1];
+		len = header[2] | header[3] << 8;
+		return true;
+	}
+
+	void LogRing::consume(uint32_t tail, size_t len)
+	{
+		// zeroed so the next record written over it reads as unpublished until its state byte is set
+		uint32_t end = tail + HEADER + len;
+		for (uint32_t pos = tail; pos != end; pos++)
+		{
+			_buffer[pos & (_size - 1)] = 0;
+		}
+		_tail.store(end, std::memory_order_release);
+	}
+
+	size_t LogRing::Peek(uint32_t &cursor, uint8_t &level, void *data, size_t size)
+	{
+		size_t len;
+		if (!record(cursor, level, len))
+		{
+			return 0;
+		}
+		size_t n = min(len, size - 1);
+		copyOut(cursor + HEADER, data, n);
+		((uint8_t *)data)[n] = 0;
+		cursor += HEADER + len;
+		return n;
+	}
+
+	size_t LogRing::Pop(uint8_t &level, void *data, size_t size)
+	{
+		uint32_t tail = _tail.load(std::memory_order_relaxed);
+		_highWater = max(_highWater, _head.load(std::memory_order_relaxed) - tail);
+		uint32_t cursor = tail;
+		size_t n = Peek(cursor, level, data, size);
+		if (n > 0)
+		{
+			consume(tail, cursor - tail - HEADER);
+		}
+		return n;
+	}
+
+	bool LogRing::Skip()
+	{
+		uint32_t tail = _tail.load(std::memory_order_relaxed);
+		uint8_t level;
+		size_t len;
+		if (!record(tail, level, len))
+		{
+			return false;
+		}
+		consume(tail, len);
+		return true;
+	}
+}
@@ -0,0 +1,304 @@
+#define LOG_MODULE IOT
+#include <Arduino.h>
+#include "Log.h"
+#include "JsonWriter.h"
+#include "MetricsWriter.h"
+
+namespace EDGEBOX
+{
+	void MetricsWriter::begin()
+	{
+		_len = 0;
+		_first = true;
+		_overflow = false;
+		if (_json)
+		{
+			append("{", 1);
+		}
+	}
+
+	size_t MetricsWriter::end()
+	{
+		if (_json)
+		{
+			_buffer[_len++] = '}'; // append left room for it
+		}
+		_buffer[_len] = 0;
+		return _len;
+	}
+
+	bool MetricsWriter::append(const char *text, size_t len)
+	{
+		if (_overflow || _len + len + (_json ? 1 : 0) >= _size) // room for the closing brace and the terminator
+		{
+			_overflow = true;
+			return false;
+		}
+		memcpy(_buffer + _len, text, len);
+		_len += len;
+		return true;
+	}
+
+	void MetricsWriter::family(const char *name, const char *help, const char *type)
+	{
+		if (_json)
+		{
+			return;
+		}
+		char line[METRICS_LINE];
+		int len = snprintf(line, sizeof(line), "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s %s\n", name, help, name, type);
+		append(line, min((size_t)len, sizeof(line) - 1));
+	}
+
+	void MetricsWriter::sample(const char *name, const char *labels, const char *value)
+	{
+		char line[METRICS_LINE];
+		int len;
+		if (_json)
+		{
+			len = snprintf(line, sizeof(line), "%s\"%s\":%s", _first ? "" : ",", name, value);
+		}
+		else if (labels != nullptr && labels[0] != 0)
+		{
+			len = snprintf(line, sizeof(line), METRICS_PREFIX "%s{%s} %s\n", name, labels, value);
+		}
+		else
+		{
+			len = snprintf(line, sizeof(line), METRICS_PREFIX "%s %s\n", name, value);
+		}
+		if (len > 0 && (size_t)len < sizeof(line) && append(line, len))
+		{
+			_first = false;
+		}
+	}
+
+	void MetricsWriter::add(const char *name, int64_t value, const char *label, const char *labelValue)
+	{
+		char text[24];
+		snprintf(text, sizeof(text), "%lld", (long long)value);
+		char key[METRICS_NAME];
+		if (label == nullptr)
+		{
+			sample(name, nullptr, text);
+		}
+		else if (_json)
+		{
+			snprintf(key, sizeof(key), "%s_%s", name, labelValue);
+			sample(key, nullptr, text);
+		}
+		else
+		{
+			snprintf(key, sizeof(key), "%s=\"%s\"", label, labelValue);
+			sample(name, key, text);
+		}
+	}
+
+	void MetricsWriter::add(const char *name, float value, const char *label, const char *labelValue)
+	{
+		char text[24];
+		JsonWriter::formatFloat(text, sizeof(text), value, 3);
+		char key[METRICS_NAME];
+		if (label == nullptr)
+		{
+			sample(name, nullptr, text);
+		}
+		else if (_json)
+		{
+			snprintf(key, sizeof(key), "%s_%s", name, labelValue);
+			sample(key, nullptr, text);
+		}
+		else
+		{
+			snprintf(key, sizeof(key), "%s=\"%s\"", label, labelValue);
+			sample(name, key, text);
+		}
+	}
+
+	// copies key with anything but letters, digits and underscores replaced
+	static size_t sanitize(char *dest, size_t size, const char *key)
+	{
+		size_t len = 0;
+		while (*key != 0 && len + 1 < size)
+		{
+			dest[len++] = isalnum(*key) ? *key : '_';
+			key++;
+		}
+		dest[len] = 0;
+		return len;
+	}
+
+	void MetricsWriter::add(const char *name, JsonVariantConst stats)
+	{
+		if (_json)
+		{
+			size_t len = measureJson(stats);
+			char key[METRICS_NAME];
+			int keyLen = snprintf(key, sizeof(key), "%s\"%s\":", _first ? "" : ",", name);
+			if (append(key, keyLen))
+			{
+				if (_len + len + 2 <= _size)
+				{
+					_len += serializeJson(stats, _buffer + _len, _size - _len);
+					_first = false;
+				}
+				else
+				{
+					_len -= keyLen;
+					_overflow = true;
+				}
+			}
+			return;
+		}
+		char path[METRICS_NAME];
+		char labels[METRICS_LABELS] = "";
+		size_t pathLen = sanitize(path, sizeof(path), name);
+		// the samples of a family have to follow its HELP and TYPE lines, one walk per family
+		std::vector<std::string> families;
+		flatten(path, pathLen, labels, 0, name, stats, [&](const char *sampleName, const char *, const char *)
+				{
+			for (auto &f : families)
+			{
+				if (f == sampleName)
+				{
+					return;
+				}
+			}
+			families.emplace_back(sampleName); });
+		char help[METRICS_NAME + 16];
+		snprintf(help, sizeof(help), "From the %s statistics", name);
+		for (auto &f : families)
+		{
+			family(f.c_str(), help, "untyped");
+			flatten(path, pathLen, labels, 0, name, stats, [&](const char *sampleName, const char *sampleLabels, const char *value)
+					{
+				if (f == sampleName)
+				{
+					sample(sampleName, sampleLabels, value);
+				} });
+		}
+	}
+
+	void MetricsWriter::flatten(char *name, size_t nameLen, char *labels, size_t labelsLen, const char *member, JsonVariantConst value, const SampleVisitor &visit)
+	{
+		if (value.is<JsonObjectConst>() || value.is<JsonArrayConst>())
+		{
+			// a key that isn't a name, or an array index, is a label named after the member holding it
+			char label[METRICS_NAME];
+			sanitize(label, sizeof(label), member);
+			auto labelled = [&](const char *key, JsonVariantConst child)
+			{
+				int n = snprintf(labels + labelsLen, METRICS_LABELS - labelsLen, "%s%s=\"%s\"", labelsLen > 0 ? "," : "", label, key);
+				if (n > 0 && labelsLen + n < METRICS_LABELS)
+				{
+					flatten(name, nameLen, labels, labelsLen + n, member, child, visit);
+				}
+				labels[labelsLen] = 0;
+			};
+			if (value.is<JsonArrayConst>())
+			{
+				uint16_t index = 0;
+				for (JsonVariantConst element : value.as<JsonArrayConst>())
+				{
+					char key[8];
+					snprintf(key, sizeof(key), "%u", index++);
+					labelled(key, element);
+				}
+				return;
+			}
+			for (JsonPairConst kv : value.as<JsonObjectConst>())
+			{
+				const char *key = kv.key().c_str();
+				if (isalpha(key[0]) && nameLen + 2 < METRICS_NAME)
+				{
+					name[nameLen] = '_';
+					size_t len = nameLen + 1 + sanitize(name + nameLen + 1, METRICS_NAME - nameLen - 1, key);
+					flatten(name, len, labels, labelsLen, key, kv.value(), visit);
+					name[nameLen] = 0;
+				}
+				else
+				{
+					labelled(key, kv.value());
+				}
+			}
+			return;
+		}
+		char text[24];
+		if (value.is<bool>())
+		{
+			strcpy(text, value.as<bool>() ? "1" : "0");
+		}
+		else if (value.is<int64_t>())
+		{
+			snprintf(text, sizeof(text), "%lld", (long long)value.as<int64_t>());
+		}
+		else if (value.is<uint64_t>())
+		{
+			snprintf(text, sizeof(text), "%llu", (unsigned long long)value.as<uint64_t>());
+		}
+		else if (value.is<float>())
+		{
+			JsonWriter::formatFloat(text, sizeof(text), value.as<float>(), 3);
+		}
+		else
+		{
+			return; // strings aren't samples
+		}
+		visit(name, labels, text);
+	}
+
+	size_t MetricsResponse::fill(uint8_t *buffer, size_t maxLen)
+	{
+		size_t len = 0;
+		while (len < maxLen)
+		{
+			if (_chunkPos < _chunkLen)
+			{
+				size_t n = min(maxLen - len, _chunkLen - _chunkPos);
+				memcpy(buffer + len, _chunk + _chunkPos, n);
+				_chunkPos += n;
+				len += n;
+				continue;
+			}
+			if (_group >= _groups.size())
+			{
+				break; // done
+			}
+			const MetricsGroup &group = _groups[_group++];
+			if (!collect(group))
+			{
+				// grew since send checked it, too late for a 500 but a cut family would read as complete
+				logw("Metrics of %s outgrew %d bytes, left out", group.name, METRICS_CHUNK);
+				_chunkLen = 0;
+			}
+			_chunkPos = 0;
+		}
+		return len;
+	}
+
+	bool MetricsResponse::collect(const MetricsGroup &group)
+	{
+		MetricsWriter metrics(_chunk, sizeof(_chunk));
+		metrics.begin();
+		group.collector(metrics);
+		_chunkLen = metrics.end();
+		return !metrics.overflowed();
+	}
+
+	void MetricsResponse::send(AsyncWebServerRequest *request, std::shared_ptr<MetricsResponse> metrics)
+	{
+		// a scrape gets every sample or an error, Prometheus can't tell a cut body from a complete one
+		for (auto &group : metrics->_groups)
+		{
+			if (!metrics->collect(group))
+			{
+				loge("Metrics of %s need more than %d bytes", group.name, METRICS_CHUNK);
+				request->send(500, "text/plain", "Metrics don't fit METRICS_CHUNK");
+				return;
+			}
+		}
+		metrics->_chunkLen = 0;
+		AsyncWebServerResponse *response = request->beginChunkedResponse("text/plain; version=0.0.4", [metrics](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+																		 { return metrics->fill(buffer, maxLen); });
+		request->send(response);
+	}
+}
@@ -0,0 +1,167 @@
+#define LOG_MODULE MB
+#include <Arduino.h>
+#include "Log.h"
+#include "ModbusGateway.h"
+
+namespace EDGEBOX
+{
+	void ModbusGateway::begin(uint32_t baud, uint32_t timeout, uint32_t cacheTTL)
+	{
+		if (_running)
+		{
+			return;
+		}
+		_cacheTTL = cacheTTL;
+		RTUutils::prepareHardwareSerial(Serial2);
+		Serial2.begin(baud, SERIAL_8N1, RS485_RXD, RS485_TXD);
+		_rtu.onDataHandler([this](ModbusMessage response, uint32_t token)
+						   { onResponse(token, response, SUCCESS); });
+		_rtu.onErrorHandler([this](Error err, uint32_t token)
+							{
+			ModbusMessage none;
+			onResponse(token, none, err); });
+		_rtu.setTimeout(timeout);
+		_rtu.begin(Serial2);
+		_running = true;
+		logi("Modbus gateway on RS485 at %d baud, timeout: %dms cache TTL: %dms", baud, timeout, cacheTTL);
+	}
+
+	bool ModbusGateway::Route(ModbusMessage request, MBResponder respond)
+	{
+		if (!_running)
+		{
+			return false;
+		}
+		uint8_t serverID = request.getServerID();
+		uint8_t fc = request.getFunctionCode();
+		MBCacheKey key;
+		bool cacheable = ModbusResponseCache::MakeKey(request, key);
+		ModbusMessage response;
+		std::unique_lock<std::mutex> lock(_lock);
+		SlaveStats &stats = _slaveStats[serverID];
+		stats.requests++;
+		if (cacheable && _cacheTTL > 0 && _cache.Lookup(key, _cacheTTL, response))
+		{
+			stats.cacheHits++;
+			lock.unlock();
+			respond(response);
+			return true;
+		}
+		int slot = -1;
+		for (int i = 0; i < MB_GATEWAY_MAX_PENDING; i++)
+		{
+			Pending &p = _pending[i];
+			if (p.used)
+			{
+				if (cacheable && p.cacheable && p.key == key)
+				{
+					// identical poll already on the bus, piggyback on its response
+					stats.coalesced++;
+					p.waiters.push_back(respond);
+					return true;
+				}
+			}
+			else if (slot < 0)
+			{
+				slot = i;
+			}
+		}
+		if (slot < 0)
+		{
+			lock.unlock();
+			response.setError(serverID, fc, SERVER_DEVICE_BUSY);
+			respond(response);
+			return true;
+		}
+		Pending &p = _pending[slot];
+		p.used = true;
+		p.cacheable = cacheable;
+		p.key = key;
+		p.key.unit = serverID;
+		p.key.fc = fc;
+		p.start = micros();
+		p.waiters.clear();
+		p.waiters.push_back(respond);
+		lock.unlock();
+		Error err = _rtu.addRequest(request, slot);
+		if (err != SUCCESS)
+		{
+			logw("Gateway request to %d not queued: %02X", serverID, err);
+			ModbusMessage none;
+			onResponse(slot, none, GATEWAY_PATH_UNAVAIL);
+		}
+		return true;
+	}
+
+	void ModbusGateway::onResponse(uint32_t token, ModbusMessage &response, Error err)
+	{
+		if (token >= MB_GATEWAY_MAX_PENDING)
+		{
+			return;
+		}
+		std::vector<MBResponder> waiters;
+		ModbusMessage reply = response;
+		{
+			std::lock_guard<std::mutex> guard(_lock);
+			Pending &p = _pending[token];
+			if (!p.used)
+			{
+				return;
+			}
+			uint32_t latency = micros() - p.start;
+			SlaveStats &stats = _slaveStats[p.key.unit];
+			if (err == SUCCESS)
+			{
+				stats.minLatency = min(stats.minLatency, latency);
+				stats.maxLatency = max(stats.maxLatency, latency);
+				stats.avgLatency = stats.avgLatency == 0 ? latency : (stats.avgLatency * 7 + latency) / 8;
+				if (p.cacheable)
+				{
+					_cache.Store(p.key, response);
+				}
+			}
+			else
+			{
+				// exceptions from the slave pass through, local errors map to the gateway codes
+				if (err == TIMEOUT)
+				{
+					stats.timeouts++;
+					err = GATEWAY_TARGET_NO_RESP;
+				}
+				else if (err >= TIMEOUT)
+				{
+					err = GATEWAY_PATH_UNAVAIL;
+				}
+				stats.errors++;
+				reply.setError(p.key.unit, p.key.fc, err);
+			}
+			waiters.swap(p.waiters);
+			p.used = false;
+		}
+		for (auto &respond : waiters)
+		{
+			respond(reply);
+		}
+	}
+
+	void ModbusGateway::getStatistics(JsonObject &stats)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		stats["queued"] = _running ? _rtu.pendingRequests() : 0;
+		JsonObject cache = stats["cache"].to<JsonObject>();
+		_cache.getStatistics(cache);
+		JsonObject slaves = stats["slaves"].to<JsonObject>();
+		for (auto &s : _slaveStats)
+		{
+			JsonObject slave = slaves[String(s.first)].to<JsonObject>();
+			slave["requests"] = s.second.requests;
+			slave["cache_hits"] = s.second.cacheHits;
+			slave["coalesced"] = s.second.coalesced;
+			slave["errors"] = s.second.errors;
+			slave["timeouts"] = s.second.timeouts;
+			slave["min_us"] = s.second.maxLatency > 0 ? s.second.minLatency : 0;
+			slave["avg_us"] = s.second.avgLatency;
+			slave["max_us"] = s.second.maxLatency;
+		}
+	}
+}
@@ -0,0 +1,440 @@
+#define LOG_MODULE MB
+#include <Arduino.h>
+#include <numeric>
+#include "Log.h"
+#include "ModbusPoller.h"
+
+namespace EDGEBOX
+{
+	static const uint32_t defaultRates[POLLER_RATE_CLASSES] = {POLLER_FAST_RATE, POLLER_NORMAL_RATE, POLLER_SLOW_RATE};
+
+	uint8_t ModbusPoller::tagWidth(uint8_t fc, PollTagType type)
+	{
+		if (fc <= READ_DISCR_INPUT)
+		{
+			return 1; // bits
+		}
+		return (type == TagU32 || type == TagS32 || type == TagF32) ? 2 : 1;
+	}
+
+	bool ModbusPoller::Configure(JsonObject config)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_running = false;
+		_generation++; // responses to blocks of the old tag list are dropped
+		_devices.clear(); // their TCP clients stay in _clients
+		_tags.clear();
+		_blocks.clear();
+		for (int r = 0; r < POLLER_RATE_CLASSES; r++)
+		{
+			_rates[r] = RateClass();
+		}
+		if (config.isNull())
+		{
+			return false;
+		}
+		_maxGap = config["maxGap"].isNull() ? POLLER_MAX_GAP : config["maxGap"].as<uint16_t>();
+		JsonArray rates = config["rates"].as<JsonArray>();
+		for (int r = 0; r < POLLER_RATE_CLASSES; r++)
+		{
+			_rates[r].period = rates[r].isNull() ? defaultRates[r] : rates[r].as<uint32_t>();
+		}
+		for (JsonObject dev : config["devices"].as<JsonArray>())
+		{
+			Device d;
+			d.name = dev["name"].isNull() ? String("dev") + String((int)_devices.size()) : dev["name"].as<String>();
+			d.unit = dev["unit"].isNull() ? 1 : dev["unit"].as<uint8_t>();
+			if (!dev["ip"].isNull())
+			{
+				d.rtu = false;
+				d.ip.fromString(dev["ip"].as<String>());
+				d.port = dev["port"].isNull() ? 502 : dev["port"].as<uint16_t>();
+			}
+			_devices.push_back(d);
+		}
+		for (JsonObject tag : config["tags"].as<JsonArray>())
+		{
+			Tag t;
+			t.name = tag["name"].as<String>();
+			t.device = tag["dev"].isNull() ? 0 : tag["dev"].as<uint8_t>();
+			t.fc = tag["fc"].isNull() ? READ_HOLD_REGISTER : tag["fc"].as<uint8_t>();
+			t.addr = tag["addr"].as<uint16_t>();
+			t.rate = tag["rate"].isNull() ? 1 : tag["rate"].as<uint8_t>();
+			t.scale = tag["scale"].isNull() ? 1.0 : tag["scale"].as<float>();
+			t.swap = tag["swap"].isNull() ? false : tag["swap"].as<bool>();
+			String type = tag["type"].isNull() ? "u16" : tag["type"].as<String>();
+			t.type = type == "bool" ? TagBool : type == "s16" ? TagS16 : type == "u32" ? TagU32 : type == "s32" ? TagS32 : type == "f32" ? TagF32 : TagU16;
+			if (t.fc <= READ_DISCR_INPUT)
+			{
+				t.type = TagBool;
+			}
+			if (t.name.length() == 0 || t.device >= _devices.size() || t.fc < READ_COIL || t.fc > READ_INPUT_REGISTER || t.rate >= POLLER_RATE_CLASSES)
+			{
+				logw("Poller tag %s ignored, invalid definition", t.name.c_str());
+				continue;
+			}
+			_tags.push_back(t);
+		}
+		buildBlocks();
+		logi("Poller configured %d devices, %d tags in %d block reads", _devices.size(), _tags.size(), _blocks.size());
+		return !_tags.empty();
+	}
+
+	void ModbusPoller::buildBlocks()
+	{
+		std::vector<uint16_t> order(_tags.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [this](uint16_t a, uint16_t b)
+				  {
+			const Tag &ta = _tags[a];
+			const Tag &tb = _tags[b];
+			if (ta.device != tb.device) return ta.device < tb.device;
+			if (ta.fc != tb.fc) return ta.fc < tb.fc;
+			if (ta.rate != tb.rate) return ta.rate < tb.rate;
+			return ta.addr < tb.addr; });
+		for (uint16_t idx : order)
+		{
+			Tag &t = _tags[idx];
+			uint32_t end = t.addr + tagWidth(t.fc, t.type);
+			uint16_t maxCount = t.fc <= READ_DISCR_INPUT ? POLLER_MAX_BITS : POLLER_MAX_REGISTERS;
+			if (!_blocks.empty())
+			{
+				Block &b = _blocks.back();
+				if (b.device == t.device && b.fc == t.fc && b.rate == t.rate && t.addr <= (uint32_t)(b.start + b.count + _maxGap) && (end - b.start) <= maxCount)
+				{
+					b.count = max((uint32_t)b.count, end - b.start);
+					b.tags.push_back(idx);
+					continue;
+				}
+			}
+			Block b;
+			b.device = t.device;
+			b.fc = t.fc;
+			b.rate = t.rate;
+			b.start = t.addr;
+			b.count = end - t.addr;
+			b.tags.push_back(idx);
+			_blocks.push_back(b);
+		}
+	}
+
+	bool ModbusPoller::needsRTU()
+	{
+		for (auto &d : _devices)
+		{
+			if (d.rtu)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	ModbusClientTCPasync *ModbusPoller::client(IPAddress ip, uint16_t port)
+	{
+		// never deleted, async_tcp may still be calling back with requests of an earlier tag list
+		for (auto &c : _clients)
+		{
+			if (c.ip == ip && c.port == port)
+			{
+				return c.tcp;
+			}
+		}
+		ModbusClientTCPasync *tcp = new ModbusClientTCPasync(ip, port);
+		tcp->onDataHandler([this](ModbusMessage response, uint32_t token)
+						   { onBlockResponse(token, response); });
+		tcp->onErrorHandler([this](Error err, uint32_t token)
+							{
+			ModbusMessage response;
+			response.setError(0, 0, err);
+			onBlockResponse(token, response); });
+		tcp->setTimeout(POLLER_TCP_TIMEOUT);
+		tcp->connect();
+		_clients.push_back({ip, port, tcp});
+		return tcp;
+	}
+
+	void ModbusPoller::begin(ModbusGateway *rtuBus)
+	{
+		if (_running || _tags.empty())
+		{
+			return;
+		}
+		_rtuBus = rtuBus;
+		for (auto &d : _devices)
+		{
+			if (!d.rtu && d.tcp == nullptr)
+			{
+				d.tcp = client(d.ip, d.port);
+			}
+		}
+		uint32_t now = millis();
+		for (int r = 0; r < POLLER_RATE_CLASSES; r++)
+		{
+			_rates[r].nextDue = now;
+		}
+		_running = true;
+	}
+
+	void ModbusPoller::Stop()
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		if (_running)
+		{
+			_running = false;
+			_stopped = millis();
+		}
+	}
+
+	bool ModbusPoller::Idle()
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		if (millis() - _stopped > POLLER_TCP_TIMEOUT * 2)
+		{
+			return true; // a lost response, dropped by its generation if it comes after all
+		}
+		for (auto &b : _blocks)
+		{
+			if (b.busy)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void ModbusPoller::Run()
+	{
+		if (!_running)
+		{
+			return;
+		}
+		uint32_t now = millis();
+		for (int r = 0; r < POLLER_RATE_CLASSES; r++)
+		{
+			std::vector<uint16_t> due;
+			{
+				std::lock_guard<std::mutex> guard(_lock);
+				RateClass &rc = _rates[r];
+				if (rc.period == 0 || (int32_t)(now - rc.nextDue) < 0)
+				{
+					continue;
+				}
+				rc.nextDue += rc.period;
+				if ((int32_t)(now - rc.nextDue) >= 0)
+				{
+					rc.nextDue = now + rc.period; // fell behind, don't burst
+				}
+				if (rc.outstanding > 0)
+				{
+					rc.overruns++; // previous cycle still on the bus
+					continue;
+				}
+				for (uint16_t i = 0; i < _blocks.size(); i++)
+				{
+					if (_blocks[i].rate == r && !_blocks[i].busy)
+					{
+						_blocks[i].busy = true;
+						due.push_back(i);
+					}
+				}
+				rc.outstanding = due.size();
+				rc.cycleStart = micros();
+				rc.busTime = 0;
+			}
+			for (uint16_t i : due)
+			{
+				submit(i);
+			}
+		}
+	}
+
+	void ModbusPoller::submit(uint16_t index)
+	{
+		uint32_t token = (uint32_t)_generation << 16 | index;
+		Block &b = _blocks[index];
+		Device &d = _devices[b.device];
+		ModbusMessage request;
+		request.add(d.unit, b.fc, b.start, b.count);
+		b.sent = micros();
+		Error err = SUCCESS;
+		if (d.rtu)
+		{
+			if (_rtuBus == nullptr || !_rtuBus->Route(request, [this, token](ModbusMessage response)
+													  { onBlockResponse(token, response); }))
+			{
+				err = GATEWAY_PATH_UNAVAIL;
+			}
+		}
+		else
+		{
+			err = d.tcp->addRequest(request, token);
+		}
+		if (err != SUCCESS)
+		{
+			ModbusMessage response;
+			response.setError(d.unit, b.fc, err);
+			onBlockResponse(token, response);
+		}
+	}
+
+	void ModbusPoller::onBlockResponse(uint32_t token, ModbusMessage &response)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		uint16_t index = token & 0xFFFF;
+		if (token >> 16 != _generation || index >= _blocks.size())
+		{
+			return; // the tag list changed while it was on the bus
+		}
+		Block &b = _blocks[index];
+		if (!b.busy)
+		{
+			return;
+		}
+		b.busy = false;
+		RateClass &rc = _rates[b.rate];
+		rc.busTime += micros() - b.sent;
+		uint16_t expected = 3 + (b.fc <= READ_DISCR_INPUT ? (b.count + 7) / 8 : b.count * 2);
+		bool good = response.getError() == SUCCESS && response.size() >= expected;
+		if (!good)
+		{
+			b.errors++;
+		}
+		time_t ts = time(nullptr);
+		uint32_t now = millis();
+		for (uint16_t idx : b.tags)
+		{
+			Tag &t = _tags[idx];
+			if (!good)
+			{
+				if (t.valid)
+				{
+					t.valid = false;
+					t.changed = true;
+					_dirty = true;
+				}
+				continue;
+			}
+			uint16_t offset = t.addr - b.start;
+			double value = 0;
+			if (b.fc <= READ_DISCR_INPUT)
+			{
+				value = (response[3 + offset / 8] >> (offset % 8)) & 0x01;
+			}
+			else
+			{
+				uint16_t hi = 0;
+				uint16_t lo = 0;
+				response.get(3 + offset * 2, hi);
+				if (tagWidth(b.fc, t.type) == 2)
+				{
+					response.get(5 + offset * 2, lo);
+					if (t.swap)
+					{
+						std::swap(hi, lo);
+					}
+				}
+				uint32_t raw = ((uint32_t)hi << 16) | lo;
+				switch (t.type)
+				{
+				case TagS16:
+					value = (int16_t)hi;
+					break;
+				case TagU32:
+					value = raw;
+					break;
+				case TagS32:
+					value = (int32_t)raw;
+					break;
+				case TagF32:
+					float f;
+					memcpy(&f, &raw, sizeof(f));
+					value = f;
+					break;
+				default:
+					value = hi;
+					break;
+				}
+				value *= t.scale;
+			}
+			if (!t.valid || value != t.value)
+			{
+				t.changed = true;
+				_dirty = true;
+			}
+			t.value = value;
+			t.valid = true;
+			t.timeStamp = ts;
+			t.updated = now;
+		}
+		if (rc.outstanding > 0 && --rc.outstanding == 0)
+		{
+			rc.lastCycleTime = micros() - rc.cycleStart;
+			rc.lastBusTime = rc.busTime;
+			rc.cycles++;
+		}
+	}
+
+	bool ModbusPoller::TakeChanges(JsonDocument &doc)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		if (!_dirty)
+		{
+			return false;
+		}
+		for (auto &t : _tags)
+		{
+			if (t.changed)
+			{
+				if (t.valid)
+				{
+					doc[t.name] = t.value;
+				}
+				else
+				{
+					doc[t.name] = nullptr;
+				}
+				t.changed = false;
+			}
+		}
+		_dirty = false;
+		return true;
+	}
+
+	void ModbusPoller::getValues(JsonObject &values)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		uint32_t now = millis();
+		for (auto &t : _tags)
+		{
+			JsonObject v = values[t.name].to<JsonObject>();
+			v["value"] = t.value;
+			v["valid"] = t.valid;
+			v["ts"] = t.timeStamp;
+			v["age_ms"] = t.updated > 0 ? now - t.updated : 0;
+		}
+	}
+
+	void ModbusPoller::getStatistics(JsonObject &stats)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		stats["tags"] = _tags.size();
+		stats["blocks"] = _blocks.size();
+		uint32_t errors = 0;
+		for (auto &b : _blocks)
+		{
+			errors += b.errors;
+		}
+		stats["errors"] = errors;
+		JsonArray rates = stats["rates"].to<JsonArray>();
+		for (int r = 0; r < POLLER_RATE_CLASSES; r++)
+		{
+			JsonObject rate = rates.add<JsonObject>();
+			rate["period_ms"] = _rates[r].period;
+			rate["cycles"] = _rates[r].cycles;
+			rate["overruns"] = _rates[r].overruns;
+			rate["cycle_us"] = _rates[r].lastCycleTime;
+			rate["bus_us"] = _rates[r].lastBusTime;
+		}
+	}
+}
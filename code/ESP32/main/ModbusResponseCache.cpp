@@ -0,0 +1,96 @@
+#include <Arduino.h>
+#include <ModbusTypeDefs.h>
+#include "ModbusResponseCache.h"
+
+namespace EDGEBOX
+{
+	bool ModbusResponseCache::MakeKey(ModbusMessage &request, MBCacheKey &key)
+	{
+		uint8_t fc = request.getFunctionCode();
+		if (fc < READ_COIL || fc > READ_INPUT_REGISTER || request.size() < 6)
+		{
+			return false;
+		}
+		key.unit = request.getServerID();
+		key.fc = fc;
+		request.get(2, key.addr, key.count);
+		return true;
+	}
+
+	ModbusResponseCache::Entry *ModbusResponseCache::find(const MBCacheKey &key)
+	{
+		for (int i = 0; i < MB_CACHE_ENTRIES; i++)
+		{
+			if (_entries[i].valid && _entries[i].key == key)
+			{
+				return &_entries[i];
+			}
+		}
+		return nullptr;
+	}
+
+	bool ModbusResponseCache::Lookup(const MBCacheKey &key, uint32_t maxAge, ModbusMessage &response)
+	{
+		Entry *e = find(key);
+		if (e != nullptr)
+		{
+			if ((millis() - e->timeStamp) <= maxAge)
+			{
+				_hits++;
+				response = e->response;
+				return true;
+			}
+			e->valid = false; // expired
+		}
+		_misses++;
+		return false;
+	}
+
+	bool ModbusResponseCache::LookupCurrent(const MBCacheKey &key, uint32_t sequence, ModbusMessage &response)
+	{
+		Entry *e = find(key);
+		if (e != nullptr)
+		{
+			if (e->sequence == sequence)
+			{
+				_hits++;
+				response = e->response;
+				return true;
+			}
+			e->valid = false; // built from an older process image
+		}
+		_misses++;
+		return false;
+	}
+
+	void ModbusResponseCache::Store(const MBCacheKey &key, ModbusMessage &response, uint32_t sequence)
+	{
+		Entry *slot = find(key);
+		if (slot == nullptr)
+		{
+			slot = &_entries[_next];
+			_next = (_next + 1) % MB_CACHE_ENTRIES;
+		}
+		slot->key = key;
+		slot->response = response;
+		slot->timeStamp = millis();
+		slot->sequence = sequence;
+		slot->valid = true;
+	}
+
+	void ModbusResponseCache::Clear()
+	{
+		for (int i = 0; i < MB_CACHE_ENTRIES; i++)
+		{
+			_entries[i].valid = false;
+		}
+	}
+
+	void ModbusResponseCache::getStatistics(JsonObject &stats)
+	{
+		uint32_t lookups = _hits + _misses;
+		stats["hits"] = _hits;
+		stats["misses"] = _misses;
+		stats["hit_rate"] = lookups > 0 ? roundf(_hits * 1000.0 / lookups) / 10.0 : 0; // percent
+	}
+}
@@ -0,0 +1,432 @@
+#define LOG_MODULE MB
+#include <Arduino.h>
+#include <algorithm>
+#include "Log.h"
+#include "ModbusTCPServer.h"
+
+#define MBAP_HEADER_SIZE 6 // transaction id, protocol id, length
+#define MB_MAX_ADU 260
+
+namespace EDGEBOX
+{
+	// upper bounds (us) of the service time histogram buckets, the last bucket is open ended
+	static const uint32_t histBounds[MB_HIST_BUCKETS - 1] = {250, 1000, 4000, 16000, 64000, 256000, 1000000};
+
+	bool ModbusTCPServer::start(uint16_t port, uint8_t maxClients, uint32_t idleTimeout)
+	{
+		if (_server != nullptr)
+		{
+			return false;
+		}
+		_maxClients = maxClients;
+		_idleTimeout = idleTimeout;
+		_server = new AsyncServer(port);
+		_server->setNoDelay(true);
+		_server->onClient([this](void *arg, AsyncClient *client)
+						  { onConnect(client); }, nullptr);
+		_server->begin();
+		logi("Modbus TCP server listening on port %d, max clients: %d idle timeout: %dms rate limit: %d/s", port, maxClients, idleTimeout, _rateLimit);
+		return true;
+	}
+
+	void ModbusTCPServer::stop()
+	{
+		if (_server == nullptr)
+		{
+			return;
+		}
+		std::vector<ConnectionPtr> connections;
+		{
+			std::lock_guard<std::mutex> guard(_lock);
+			connections = _connections;
+		}
+		for (auto &con : connections)
+		{
+			con->client->close(true);
+		}
+		_server->end();
+		delete _server;
+		_server = nullptr;
+	}
+
+	uint16_t ModbusTCPServer::activeClients()
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		return _connections.size();
+	}
+
+	void ModbusTCPServer::registerWorker(uint8_t serverID, uint8_t functionCode, MBSworker worker)
+	{
+		_workers[serverID][functionCode] = worker;
+	}
+
+	MBSworker ModbusTCPServer::getWorker(uint8_t serverID, uint8_t functionCode)
+	{
+		auto server = _workers.find(serverID);
+		if (server == _workers.end())
+		{
+			return nullptr;
+		}
+		auto worker = server->second.find(functionCode);
+		if (worker != server->second.end())
+		{
+			return worker->second;
+		}
+		worker = server->second.find(ANY_FUNCTION_CODE);
+		return worker != server->second.end() ? worker->second : nullptr;
+	}
+
+	void ModbusTCPServer::onConnect(AsyncClient *client)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		if (_connections.size() >= _maxClients)
+		{
+			_rejected++;
+			logw("Modbus client %s rejected, %d clients connected", client->remoteIP().toString().c_str(), _connections.size());
+			client->close(true);
+			delete client;
+			return;
+		}
+		ConnectionPtr con = std::make_shared<Connection>();
+		con->client = client;
+		con->remote = client->remoteIP().toString() + ":" + String(client->remotePort());
+		con->rx.reserve(MB_MAX_ADU);
+		con->tokens = _rateLimit;
+		con->lastRefill = millis();
+		if (_idleTimeout > 0)
+		{
+			client->setRxTimeout((_idleTimeout + 999) / 1000);
+		}
+		client->onData([this, con](void *arg, AsyncClient *c, void *data, size_t len)
+					   { onData(con, (uint8_t *)data, len); }, nullptr);
+		client->onDisconnect([this, con](void *arg, AsyncClient *c)
+							 { onDisconnect(con); }, nullptr);
+		_connections.push_back(con);
+		logd("Modbus client %s connected", con->remote.c_str());
+	}
+
+	void ModbusTCPServer::onDisconnect(ConnectionPtr con)
+	{
+		{
+			std::lock_guard<std::mutex> guard(_lock);
+			con->alive = false;
+			Counters &c = con->counters;
+			_totals.requests += c.requests;
+			_totals.exceptions += c.exceptions;
+			_totals.throttled += c.throttled;
+			_totals.bytesIn += c.bytesIn;
+			_totals.bytesOut += c.bytesOut;
+			for (int i = 0; i < MB_HIST_BUCKETS; i++)
+			{
+				_totals.serviceTime[i] += c.serviceTime[i];
+			}
+			_connections.erase(std::remove(_connections.begin(), _connections.end(), con), _connections.end());
+		}
+		logd("Modbus client %s disconnected, %d pending requests dropped", con->remote.c_str(), con->waiting.size() + con->inflight.size());
+		delete con->client;
+	}
+
+	void ModbusTCPServer::onData(ConnectionPtr con, uint8_t *data, size_t len)
+	{
+		con->counters.bytesIn += len;
+		con->rx.insert(con->rx.end(), data, data + len);
+		while (con->rx.size() >= MBAP_HEADER_SIZE)
+		{
+			uint8_t *hdr = con->rx.data();
+			uint16_t tid = (hdr[0] << 8) | hdr[1];
+			uint16_t protocol = (hdr[2] << 8) | hdr[3];
+			uint16_t length = (hdr[4] << 8) | hdr[5];
+			if (protocol != 0 || length < 2 || length > (MB_MAX_ADU - MBAP_HEADER_SIZE))
+			{
+				logw("Invalid MBAP header from %s, closing Modbus connection", con->remote.c_str());
+				con->rx.clear();
+				con->client->close();
+				return;
+			}
+			if (con->rx.size() < (size_t)(MBAP_HEADER_SIZE + length))
+			{
+				break; // wait for the rest of the frame
+			}
+			ModbusMessage request;
+			request.add(hdr + MBAP_HEADER_SIZE, length);
+			con->rx.erase(con->rx.begin(), con->rx.begin() + MBAP_HEADER_SIZE + length);
+			handleRequest(con, tid, request);
+		}
+	}
+
+	bool ModbusTCPServer::takeToken(ConnectionPtr con)
+	{
+		if (_rateLimit == 0)
+		{
+			return true;
+		}
+		uint32_t now = millis();
+		con->tokens = min((float)_rateLimit, con->tokens + (now - con->lastRefill) * _rateLimit / 1000.0f);
+		con->lastRefill = now;
+		if (con->tokens < 1.0)
+		{
+			return false;
+		}
+		con->tokens -= 1.0;
+		return true;
+	}
+
+	void ModbusTCPServer::handleRequest(ConnectionPtr con, uint16_t tid, ModbusMessage &request)
+	{
+		uint32_t start = micros();
+		con->counters.requests++;
+		ModbusMessage response;
+		uint8_t serverID = request.getServerID();
+		uint8_t fc = request.getFunctionCode();
+		MBSworker worker = getWorker(serverID, fc);
+		if (!takeToken(con))
+		{
+			// over its request rate, answer busy without touching the process image or the bus
+			con->counters.throttled++;
+			response.setError(serverID, fc, SERVER_DEVICE_BUSY);
+		}
+		else if (worker)
+		{
+			response = localRequest(request, worker);
+			if (response == NIL_RESPONSE)
+			{
+				return;
+			}
+		}
+		else if (_workers.find(serverID) != _workers.end())
+		{
+			response.setError(serverID, fc, ILLEGAL_FUNCTION);
+		}
+		else if (_router)
+		{
+			bool queued = false;
+			{
+				std::lock_guard<std::mutex> guard(_lock);
+				if ((con->waiting.size() + con->inflight.size()) < MB_MAX_INFLIGHT)
+				{
+					Routed routed;
+					routed.tid = tid;
+					routed.start = start;
+					routed.request = request;
+					con->waiting.push_back(routed);
+					queued = true;
+				}
+				else
+				{
+					con->counters.throttled++;
+				}
+			}
+			if (queued)
+			{
+				dispatch();
+				return; // answered when the router completes it
+			}
+			response.setError(serverID, fc, SERVER_DEVICE_BUSY);
+		}
+		else
+		{
+			response.setError(serverID, fc, GATEWAY_PATH_UNAVAIL);
+		}
+		sendResponse(con, tid, response, start);
+	}
+
+	ModbusMessage ModbusTCPServer::localRequest(ModbusMessage &request, MBSworker worker)
+	{
+		MBCacheKey key;
+		ModbusMessage response;
+		bool cacheable = ModbusResponseCache::MakeKey(request, key);
+		uint32_t sequence = _imageSequence;
+		if (cacheable)
+		{
+			std::lock_guard<std::mutex> guard(_lock);
+			if (_cache.LookupCurrent(key, sequence, response))
+			{
+				return response; // same read in the same scan
+			}
+		}
+		response = worker(request);
+		if (response == ECHO_RESPONSE)
+		{
+			response = request;
+		}
+		if (!cacheable)
+		{
+			_imageSequence++; // writes change the process image
+		}
+		else if (response != NIL_RESPONSE && response.getError() == SUCCESS)
+		{
+			// stored under the sequence read before the worker ran, stale if the image moved meanwhile
+			std::lock_guard<std::mutex> guard(_lock);
+			_cache.Store(key, response, sequence);
+		}
+		return response;
+	}
+
+	void ModbusTCPServer::dispatch()
+	{
+		while (true)
+		{
+			ConnectionPtr con;
+			Routed next;
+			{
+				std::lock_guard<std::mutex> guard(_lock);
+				if (_dispatching || _routedOutstanding >= MB_MAX_ROUTED || _connections.empty())
+				{
+					return;
+				}
+				size_t count = _connections.size();
+				for (size_t i = 0; i < count; i++)
+				{
+					ConnectionPtr c = _connections[(_nextConnection + i) % count];
+					if (!c->waiting.empty())
+					{
+						con = c;
+						_nextConnection = (_nextConnection + i + 1) % count;
+						break;
+					}
+				}
+				if (!con)
+				{
+					return;
+				}
+				next = con->waiting.front();
+				con->waiting.pop_front();
+				Routed pending;
+				pending.tid = next.tid;
+				pending.start = next.start;
+				con->inflight.push_back(pending);
+				_routedOutstanding++;
+				_dispatching = true;
+			}
+			std::weak_ptr<Connection> weak = con;
+			uint16_t tid = next.tid;
+			MBResponder respond = [this, weak, tid](ModbusMessage routed)
+			{
+				{
+					std::lock_guard<std::mutex> guard(_lock);
+					_routedOutstanding--;
+				}
+				ConnectionPtr c = weak.lock();
+				if (c)
+				{
+					completeRequest(c, tid, routed);
+				}
+				dispatch();
+			};
+			if (!_router(next.request, respond))
+			{
+				ModbusMessage response;
+				response.setError(next.request.getServerID(), next.request.getFunctionCode(), GATEWAY_PATH_UNAVAIL);
+				respond(response);
+			}
+			std::lock_guard<std::mutex> guard(_lock);
+			_dispatching = false;
+		}
+	}
+
+	void ModbusTCPServer::completeRequest(ConnectionPtr con, uint16_t tid, ModbusMessage &response)
+	{
+		uint32_t start = 0;
+		{
+			std::lock_guard<std::mutex> guard(_lock);
+			auto it = std::find_if(con->inflight.begin(), con->inflight.end(), [tid](const Routed &r)
+								   { return r.tid == tid; });
+			if (it == con->inflight.end())
+			{
+				return; // already answered
+			}
+			start = it->start;
+			con->inflight.erase(it);
+		}
+		sendResponse(con, tid, response, start);
+	}
+
+	void ModbusTCPServer::sendResponse(ConnectionPtr con, uint16_t tid, ModbusMessage &response, uint32_t start)
+	{
+		uint32_t elapsed = micros() - start;
+		uint8_t bucket = 0;
+		while (bucket < (MB_HIST_BUCKETS - 1) && elapsed >= histBounds[bucket])
+		{
+			bucket++;
+		}
+		uint8_t hdr[MBAP_HEADER_SIZE];
+		hdr[0] = tid >> 8;
+		hdr[1] = tid & 0xFF;
+		hdr[2] = 0;
+		hdr[3] = 0;
+		hdr[4] = response.size() >> 8;
+		hdr[5] = response.size() & 0xFF;
+		std::lock_guard<std::mutex> guard(_lock);
+		Counters &counters = con->counters;
+		if (response.getError() != SUCCESS)
+		{
+			counters.exceptions++;
+		}
+		counters.serviceTime[bucket]++;
+		if (!con->alive)
+		{
+			return;
+		}
+		if (con->client->space() < (MBAP_HEADER_SIZE + response.size()))
+		{
+			logw("Modbus client %s send buffer full, response %d dropped", con->remote.c_str(), tid);
+			return;
+		}
+		con->client->add((const char *)hdr, MBAP_HEADER_SIZE);
+		con->client->add((const char *)response.data(), response.size());
+		con->client->send();
+		counters.bytesOut += MBAP_HEADER_SIZE + response.size();
+	}
+
+	void ModbusTCPServer::addCounters(JsonObject &obj, const Counters &counters)
+	{
+		obj["requests"] = counters.requests;
+		obj["exceptions"] = counters.exceptions;
+		obj["throttled"] = counters.throttled;
+		obj["bytes_in"] = counters.bytesIn;
+		obj["bytes_out"] = counters.bytesOut;
+		JsonArray hist = obj["service_hist"].to<JsonArray>();
+		for (int i = 0; i < MB_HIST_BUCKETS; i++)
+		{
+			hist.add(counters.serviceTime[i]);
+		}
+	}
+
+	void ModbusTCPServer::getStatistics(JsonObject &stats)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		stats["clients"] = _connections.size();
+		stats["max_clients"] = _maxClients;
+		stats["idle_timeout_ms"] = _idleTimeout;
+		stats["rate_limit"] = _rateLimit;
+		stats["rejected"] = _rejected;
+		stats["routed_outstanding"] = _routedOutstanding;
+		JsonObject cache = stats["cache"].to<JsonObject>();
+		_cache.getStatistics(cache);
+		JsonArray bounds = stats["hist_bounds_us"].to<JsonArray>();
+		for (int i = 0; i < MB_HIST_BUCKETS - 1; i++)
+		{
+			bounds.add(histBounds[i]);
+		}
+		Counters totals = _totals;
+		JsonArray connections = stats["connections"].to<JsonArray>();
+		for (auto &con : _connections)
+		{
+			JsonObject c = connections.add<JsonObject>();
+			c["remote"] = con->remote;
+			c["queued"] = con->waiting.size() + con->inflight.size();
+			addCounters(c, con->counters);
+			totals.requests += con->counters.requests;
+			totals.exceptions += con->counters.exceptions;
+			totals.throttled += con->counters.throttled;
+			totals.bytesIn += con->counters.bytesIn;
+			totals.bytesOut += con->counters.bytesOut;
+			for (int i = 0; i < MB_HIST_BUCKETS; i++)
+			{
+				totals.serviceTime[i] += con->counters.serviceTime[i];
+			}
+		}
+		JsonObject all = stats["totals"].to<JsonObject>();
+		addCounters(all, totals);
+	}
+}
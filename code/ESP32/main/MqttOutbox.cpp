@@ -0,0 +1,244 @@
+#define LOG_MODULE MQTT
+#include <Arduino.h>
+#include "Log.h"
+#include "MqttOutbox.h"
+
+namespace EDGEBOX
+{
+	static size_t varintLength(size_t value)
+	{
+		return value < 128 ? 1 : value < 16384 ? 2 : value < 2097152 ? 3 : 4;
+	}
+
+	// size of a PUBLISH packet on the wire
+	static size_t wireSize(size_t topicLen, size_t payloadLen, uint8_t qos, bool mqtt5, size_t properties)
+	{
+		size_t remaining = 2 + topicLen + (qos > 0 ? 2 : 0) + payloadLen;
+		if (mqtt5)
+		{
+			remaining += varintLength(properties) + properties;
+		}
+		return 1 + varintLength(remaining) + remaining;
+	}
+
+	void MqttOutbox::configure(uint32_t capacity, OutboxPolicy policy)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_capacity = capacity;
+		_policy = policy;
+		logi("MQTT outbox cap: %dB policy: %s", capacity, policy == OutboxLatestValue ? "latest value" : "oldest first");
+	}
+
+	void MqttOutbox::setProtocol(bool mqtt5)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_mqtt5 = mqtt5;
+	}
+
+	void MqttOutbox::Connected()
+	{
+		// topic aliases live as long as the network connection
+		std::lock_guard<std::mutex> guard(_lock);
+		memset(_aliasKnown, 0, sizeof(_aliasKnown));
+		_aliasRefused = false;
+		_connected = true;
+	}
+
+	void MqttOutbox::Disconnected()
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		memset(_aliasKnown, 0, sizeof(_aliasKnown));
+		_connected = false;
+	}
+
+	bool MqttOutbox::Push(const char *topic, const char *payload, size_t len, uint8_t qos, bool retain, bool mergeable, uint8_t alias, uint32_t expiry)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		size_t size = strlen(topic) + len;
+		if (size > _capacity)
+		{
+			_rejected++;
+			logw("MQTT message for %s exceeds the outbox cap: %d", topic, size);
+			return false;
+		}
+		_queued++;
+		if (_policy == OutboxLatestValue && mergeable)
+		{
+			for (auto &m : _queue)
+			{
+				if (m.mergeable && m.topic == topic && m.retain == retain)
+				{
+					// only the newest value of a topic is worth sending
+					_bytes = _bytes - m.payload.length() + len;
+					m.payload.assign(payload, len);
+					m.qos = qos;
+					m.expiry = expiry;
+					_replaced++;
+					_peakBytes = max(_peakBytes, _bytes);
+					return true;
+				}
+			}
+		}
+		while (!_queue.empty() && _bytes + size > _capacity)
+		{
+			_bytes -= _queue.front().size();
+			_queue.pop_front();
+			_evicted++;
+		}
+		Message m;
+		m.topic = topic;
+		m.payload.assign(payload, len);
+		m.qos = qos;
+		m.retain = retain;
+		m.mergeable = mergeable;
+		m.alias = alias;
+		m.expiry = expiry;
+		m.pushed = micros();
+		_queue.push_back(std::move(m));
+		_bytes += size;
+		_peakBytes = max(_peakBytes, _bytes);
+		return true;
+	}
+
+	void MqttOutbox::Flush(esp_mqtt_client_handle_t client)
+	{
+		if (client == 0)
+		{
+			return;
+		}
+		// ESP-MQTT calls are made without holding _lock, event handlers publish while holding the client lock
+		while (esp_mqtt_client_get_outbox_size(client) < MQTT_INFLIGHT_BYTES)
+		{
+			Message m;
+			{
+				std::lock_guard<std::mutex> guard(_lock);
+				if (_queue.empty())
+				{
+					return;
+				}
+				m = std::move(_queue.front());
+				_queue.pop_front();
+				_bytes -= m.size();
+			}
+			if (Send(client, m.topic.c_str(), m.payload.data(), m.payload.length(), m.qos, m.retain, m.alias, m.expiry) == -1)
+			{
+				logw("MQTT enqueue failed for %s", m.topic.c_str());
+				std::lock_guard<std::mutex> guard(_lock);
+				_bytes += m.size();
+				_queue.push_front(std::move(m)); // try again on the next flush
+				return;
+			}
+			std::lock_guard<std::mutex> guard(_lock);
+			_enqueued++;
+			_latency = micros() - m.pushed;
+			_maxLatency = max(_maxLatency, _latency);
+			_totalLatency += _latency;
+		}
+	}
+
+	int MqttOutbox::Send(esp_mqtt_client_handle_t client, const char *topic, const char *payload, size_t len, uint8_t qos, bool retain, uint8_t alias, uint32_t expiry)
+	{
+		const char *sendTopic = topic;
+		size_t properties = 0;
+		bool mqtt5 = false;
+		bool registering = false;
+		// an empty topic must not pass a message still waiting in the ESP-MQTT outbox, the registration may be in it
+		bool direct = esp_mqtt_client_get_outbox_size(client) == 0;
+		{
+			std::lock_guard<std::mutex> guard(_lock);
+			mqtt5 = _mqtt5;
+			// aliases only go on QoS 0, a stored QoS 1 message may be resent on a connection that never saw the alias
+			if (!mqtt5 || qos > 0 || alias > MQTT5_TOPIC_ALIASES || _aliasRefused)
+			{
+				alias = 0;
+			}
+			if (alias != 0 && !_aliasKnown[alias] && !_connected)
+			{
+				alias = 0; // registered with the next connection
+			}
+			if (alias != 0 && _aliasKnown[alias] && !direct)
+			{
+				alias = 0;
+			}
+			if (alias != 0)
+			{
+				registering = !_aliasKnown[alias];
+				sendTopic = registering ? topic : "";
+				properties += 3;
+			}
+			if (mqtt5 && expiry != 0)
+			{
+				properties += 5;
+			}
+		}
+#ifdef CONFIG_MQTT_PROTOCOL_5
+		if (mqtt5)
+		{
+			// publish properties apply to the next publish of the client, Send is only called from the main loop
+			esp_mqtt5_publish_property_config_t property = {};
+			property.message_expiry_interval = expiry;
+			property.topic_alias = alias;
+			esp_mqtt5_client_set_publish_property(client, &property);
+		}
+#endif
+		// QoS 0 publish writes to the connection, or fails when there is none
+		int msgId = alias != 0 && !registering ? esp_mqtt_client_publish(client, sendTopic, payload, len, qos, retain) : esp_mqtt_client_enqueue(client, sendTopic, payload, len, qos, retain, true);
+		if (msgId == -1 && alias != 0)
+		{
+			int retry = Send(client, topic, payload, len, qos, retain, 0, expiry);
+			if (retry != -1 && registering)
+			{
+				// only the alias failed ESP-MQTT's check against the broker's topic alias maximum
+				logw("MQTT broker refused topic alias %d, sending full topics", alias);
+				std::lock_guard<std::mutex> guard(_lock);
+				_aliasRefused = true;
+			}
+			return retry;
+		}
+		if (msgId != -1)
+		{
+			std::lock_guard<std::mutex> guard(_lock);
+			if (registering)
+			{
+				_aliasKnown[alias] = true;
+			}
+			else if (alias != 0)
+			{
+				_aliased++;
+			}
+			_sent++;
+			_wireBytes += wireSize(strlen(sendTopic), len, qos, mqtt5, properties);
+			_wireBytes311 += wireSize(strlen(topic), len, qos, false, 0);
+		}
+		return msgId;
+	}
+
+	void MqttOutbox::getStatistics(JsonObject &stats, esp_mqtt_client_handle_t client)
+	{
+		int inflight = client != 0 ? esp_mqtt_client_get_outbox_size(client) : 0;
+		std::lock_guard<std::mutex> guard(_lock);
+		stats["capacity"] = _capacity;
+		stats["policy"] = _policy == OutboxLatestValue ? "latest" : "oldest";
+		stats["depth"] = _queue.size();
+		stats["bytes"] = _bytes;
+		stats["peak_bytes"] = _peakBytes;
+		stats["inflight_bytes"] = inflight;
+		stats["queued"] = _queued;
+		stats["enqueued"] = _enqueued;
+		stats["evicted"] = _evicted;
+		stats["replaced"] = _replaced;
+		stats["rejected"] = _rejected;
+		stats["latency_us"] = _latency;
+		stats["max_latency_us"] = _maxLatency;
+		stats["avg_latency_us"] = _enqueued > 0 ? (uint32_t)(_totalLatency / _enqueued) : 0;
+		stats["protocol"] = _mqtt5 ? "5" : "3.1.1";
+		stats["aliased"] = _aliased;
+		stats["wire_bytes"] = _wireBytes;
+		stats["wire_bytes_v311"] = _wireBytes311; // the same messages sent over MQTT 3.1.1
+		if (_sent > 0)
+		{
+			stats["bytes_per_msg"] = (float)_wireBytes / _sent;
+			stats["bytes_per_msg_v311"] = (float)_wireBytes311 / _sent;
+		}
+	}
+}
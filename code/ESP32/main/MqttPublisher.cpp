@@ -0,0 +1,153 @@
+#define LOG_MODULE MQTT
+#include <Arduino.h>
+#include "Log.h"
+#include "MqttPublisher.h"
+
+namespace EDGEBOX
+{
+	void MqttPublisher::configure(uint32_t window, uint32_t interval, bool edges)
+	{
+		_window = window;
+		_interval = interval;
+		_edgesEnabled = edges;
+		logi("MQTT publish window: %dms interval: %dms edges: %d", window, interval, edges);
+	}
+
+	bool MqttPublisher::Offer(PublishClass cls, const char *subtopic, const char *payload, size_t len, bool text)
+	{
+		Slot &slot = _slots[cls];
+		slot.offered++;
+		if (len >= sizeof(slot.payload))
+		{
+			slot.dropped++;
+			logw("Payload for %s exceeds MQTT_PUBLISH_BUFFER: %d", subtopic, len);
+			return false;
+		}
+		if (slot.pending)
+		{
+			slot.merged++; // burst, only the latest values go out
+		}
+		else
+		{
+			slot.pending = true;
+			slot.since = millis();
+		}
+		slot.subtopic = subtopic;
+		memcpy(slot.payload, payload, len);
+		slot.payload[len] = 0;
+		slot.len = len;
+		slot.text = text;
+		return true;
+	}
+
+	void MqttPublisher::Edge(const char *name, const char *state)
+	{
+		if (!_edgesEnabled)
+		{
+			return;
+		}
+		char edge[64];
+		int len = snprintf(edge, sizeof(edge), "%s{\"p\":\"%s\",\"v\":\"%s\",\"t\":%u}", _edgesLen > 0 ? "," : "", name, state, millis());
+		if (len <= 0 || _edgesLen + len >= sizeof(_edges))
+		{
+			_edgesDropped++;
+			return;
+		}
+		memcpy(_edges + _edgesLen, edge, len + 1);
+		_edgesLen += len;
+	}
+
+	bool MqttPublisher::due(Slot &slot, uint32_t now)
+	{
+		if ((now - slot.since) < _window)
+		{
+			return false; // still coalescing
+		}
+		if (_interval == 0)
+		{
+			return true;
+		}
+		slot.tokens = min((float)MQTT_PUBLISH_BURST, slot.tokens + (float)(now - slot.lastRefill) / _interval);
+		slot.lastRefill = now;
+		if (slot.tokens < 1.0)
+		{
+			return false; // keeps merging until a token is available
+		}
+		slot.tokens -= 1.0;
+		return true;
+	}
+
+	bool MqttPublisher::Ready(PublishClass cls)
+	{
+		Slot &slot = _slots[cls];
+		uint32_t now = millis();
+		if (!slot.pending)
+		{
+			slot.pending = true;
+			slot.since = now;
+			slot.offered++;
+		}
+		return due(slot, now);
+	}
+
+	void MqttPublisher::Sent(PublishClass cls, bool ok)
+	{
+		Slot &slot = _slots[cls];
+		slot.pending = false;
+		if (ok)
+		{
+			slot.published++;
+		}
+		else
+		{
+			slot.dropped++;
+		}
+	}
+
+	void MqttPublisher::Run()
+	{
+		uint32_t now = millis();
+		for (int cls = 0; cls < PUBLISH_CLASSES; cls++)
+		{
+			Slot &slot = _slots[cls];
+			if (!slot.pending || slot.subtopic == nullptr || !due(slot, now))
+			{
+				continue;
+			}
+			const char *payload = slot.payload;
+			size_t len = slot.len;
+			if (cls == PublishReadings && slot.text && _edgesLen > 0 && slot.len > 1)
+			{
+				// splice the edges into the readings object: {...,"edges":[...]}
+				memcpy(_out, slot.payload, slot.len - 1);
+				len = slot.len - 1;
+				len += sprintf(_out + len, ",\"edges\":[");
+				memcpy(_out + len, _edges, _edgesLen);
+				len += _edgesLen;
+				strcpy(_out + len, "]}");
+				len += 2;
+				payload = _out;
+				_edgesLen = 0;
+			}
+			Sent((PublishClass)cls, _sender && _sender(slot.subtopic, payload, len));
+		}
+	}
+
+	void MqttPublisher::getStatistics(JsonObject &stats)
+	{
+		static const char *names[PUBLISH_CLASSES] = {"readings", "poller"};
+		stats["window_ms"] = _window;
+		stats["interval_ms"] = _interval;
+		stats["edges_dropped"] = _edgesDropped;
+		for (int cls = 0; cls < PUBLISH_CLASSES; cls++)
+		{
+			Slot &slot = _slots[cls];
+			JsonObject c = stats[names[cls]].to<JsonObject>();
+			c["offered"] = slot.offered;
+			c["published"] = slot.published;
+			c["merged"] = slot.merged;
+			c["dropped"] = slot.dropped;
+			c["pending"] = slot.pending;
+		}
+	}
+}
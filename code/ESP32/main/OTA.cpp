@@ -1,3 +1,4 @@
+#define LOG_MODULE IOT
 #include <Arduino.h>
 #include <ArduinoJson.h>
 #include <WiFi.h>
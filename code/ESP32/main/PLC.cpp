@@ -1,60 +1,100 @@
+#define LOG_MODULE PLC
 #include <Arduino.h>
 #include "Log.h"
 #include "IOT.h"
 #include "PLC.h"
 #include "PLC.html"
+#include "JsonWriter.h"
+#include "ReadingsWriter.h"
+#include "PayloadCodec.h"
+#include "Sparkplug.h"
+#include "HelperFunctions.h"
+#include "WebAssets.h"
+#include "WebSocketHub.h"
+
+WEB_ASSET(home_html_gz)
 
 namespace EDGEBOX
 {
 	static AsyncWebServer _asyncServer(ASYNC_WEBSERVER_PORT);
-	static AsyncWebSocket _webSocket("/ws_home");
+	static WebSocketHub _homeHub("/ws_home");
 	IOT _iot = IOT();
 
-	void PLC::addApplicationSettings(String &page)
+	bool PLC::ResolveAnalog(uint16_t index, const char *key, TemplateValue &value)
 	{
-		String appFields = app_settings_fields;
-		appFields.replace("{digitalInputs}", String(_digitalInputs));
-		appFields.replace("{analogInputs}", String(_analogInputs));
-
-		String appConvs;
-		for (int i = 0; i < _analogInputs; i++)
+		if (strcmp(key, "An") == 0)
+		{
+			value.set("A" + String(index));
+		}
+		else if (strcmp(key, "minV") == 0)
+		{
+			value.set(_AnalogSensors[index].minV(), 1);
+		}
+		else if (strcmp(key, "minT") == 0)
+		{
+			value.set(_AnalogSensors[index].minT(), 1);
+		}
+		else if (strcmp(key, "maxV") == 0)
+		{
+			value.set(_AnalogSensors[index].maxV(), 1);
+		}
+		else if (strcmp(key, "maxT") == 0)
+		{
+			value.set(_AnalogSensors[index].maxT(), 1);
+		}
+		else
 		{
-			String conv_flds(analog_conv_val);
-			conv_flds.replace("{An}", "A" + String(i));
-			conv_flds.replace("{minV}", String(_AnalogSensors[i].minV(), 1));
-			conv_flds.replace("{minT}", String(_AnalogSensors[i].minT(), 1));
-			conv_flds.replace("{maxV}", String(_AnalogSensors[i].maxV(), 1));
-			conv_flds.replace("{maxT}", String(_AnalogSensors[i].maxT(), 1));
-			appConvs += conv_flds;	
+			return false;
 		}
-		appFields.replace("{aconv}", appConvs);
-		page += appFields;
+		return true;
 	}
 
-	void PLC::addApplicationConfigs(String &page)
+	void PLC::addApplicationSettings(TemplateResponse &page)
 	{
-		String appFields = app_config_fields;
-		
-		appFields.replace("{digitalInputs}", String(_digitalInputs));
-		appFields.replace("{analogInputs}", String(_analogInputs));
-		String appConvs;
-		String scriptConvs;
-		for (int i = 0; i < _analogInputs; i++)
-		{
-			String conv_flds(analog_conv_flds);
-			String conv_script(app_validateInputs);
-			conv_flds.replace("{An}", "A" + String(i));
-			conv_script.replace("{An}", "A" + String(i));
-			conv_flds.replace("{minV}", String(_AnalogSensors[i].minV(), 1));
-			conv_flds.replace("{minT}", String(_AnalogSensors[i].minT(), 1));
-			conv_flds.replace("{maxV}", String(_AnalogSensors[i].maxV(), 1));
-			conv_flds.replace("{maxT}", String(_AnalogSensors[i].maxT(), 1));
-			scriptConvs += conv_script;
-			appConvs += conv_flds;	
-		}
-		appFields.replace("{aconv}", appConvs);
-		page += appFields;
-		page.replace("{validateInputs}", scriptConvs);
+		page.add(app_settings_fields, [this](const char *key, TemplateValue &value)
+				 {
+			if (strcmp(key, "digitalInputs") == 0)
+			{
+				value.set(_digitalInputs);
+			}
+			else if (strcmp(key, "analogInputs") == 0)
+			{
+				value.set(_analogInputs);
+			}
+			else if (strcmp(key, "aconv") == 0)
+			{
+				value.nest(analog_conv_val, _analogInputs, [this](uint16_t index, const char *key, TemplateValue &value)
+						   { return ResolveAnalog(index, key, value); });
+			}
+			else
+			{
+				return false;
+			}
+			return true; });
+	}
+
+	void PLC::addApplicationConfigs(TemplateResponse &page)
+	{
+		page.add(app_config_fields, [this](const char *key, TemplateValue &value)
+				 {
+			if (strcmp(key, "digitalInputs") == 0)
+			{
+				value.set(_digitalInputs);
+			}
+			else if (strcmp(key, "analogInputs") == 0)
+			{
+				value.set(_analogInputs);
+			}
+			else if (strcmp(key, "aconv") == 0)
+			{
+				value.nest(analog_conv_flds, _analogInputs, [this](uint16_t index, const char *key, TemplateValue &value)
+						   { return ResolveAnalog(index, key, value); });
+			}
+			else
+			{
+				return false;
+			}
+			return true; });
 	}
 
 	void PLC::onSubmitForm(AsyncWebServerRequest *request)
@@ -94,6 +134,7 @@ namespace EDGEBOX
 		JsonObject plc = doc["plc"].to<JsonObject>();
 		plc["digitalInputs"] = _digitalInputs;
 		plc["analogInputs"] = _analogInputs;
+		plc["discoveryHash"] = _discoveryHash;
 		for (int i = 0; i < _analogInputs; i++)
 		{
 			String ain = "A" + String(i);
@@ -109,6 +150,7 @@ namespace EDGEBOX
 		JsonObject plc = doc["plc"].as<JsonObject>();
 		_digitalInputs = plc["digitalInputs"].isNull() ? DI_PINS : plc["digitalInputs"].as<uint16_t>();
 		_analogInputs = plc["analogInputs"].isNull() ? AI_PINS : plc["analogInputs"].as<uint16_t>();
+		_discoveryHash = plc["discoveryHash"].isNull() ? 0 : plc["discoveryHash"].as<uint32_t>(); // of the configs last published, 0 if never
 		for (int i = 0; i < _analogInputs; i++)
 		{
 			String ain = "A" + String(i);
@@ -123,66 +165,69 @@ namespace EDGEBOX
 	{
 		logd("setup");
 		_iot.Init(this, &_asyncServer);
-		_asyncServer.on("/", HTTP_GET, [this](AsyncWebServerRequest *request)
+		// {"coil": 1, "state": "on"} on <prefix>/cmnd/coil
+		_iot.Commands().on("coil", [this](const char *topic, JsonDocument &doc)
+						   { WriteCoil(doc["coil"] | 0, doc["state"]); }, {"coil", "state"});
+		WebAssets::serve(&_asyncServer, "/", "text/html", home_html_gz_start, home_html_gz_end);
+		_asyncServer.on("/home.json", HTTP_GET, [this](AsyncWebServerRequest *request)
 						{
-			String page = home_html;
-			page.replace("{n}", _iot.getThingName().c_str());
-			page.replace("{v}", CONFIG_VERSION);
-			String s;
+			JsonDocument doc;
+			doc["n"] = _iot.getThingName();
+			doc["v"] = CONFIG_VERSION;
+			JsonArray points = doc["digitalInputs"].to<JsonArray>();
 			for (int i = 0; i < _digitalInputs; i++)
 			{
-				s += "<div class='box' id=";
-				s += _DigitalSensors[i].Pin().c_str();
-				s += "> ";
-				s += _DigitalSensors[i].Pin().c_str();
-				s += "</div>";
+				points.add(_DigitalSensors[i].Pin());
 			}
-			page.replace("{digitalInputs}", s);
-			s.clear();
+			points = doc["analogInputs"].to<JsonArray>();
 			for (int i = 0; i < _analogInputs; i++)
 			{
-				s += "<div class='box' id=";
-				s += _AnalogSensors[i].Channel().c_str();
-				s += "> ";
-				s += _AnalogSensors[i].Channel().c_str();
-				s += "</div>";
+				points.add(_AnalogSensors[i].Channel());
 			}
-			page.replace("{analogInputs}", s);
-			s.clear();
+			points = doc["digitalOutputs"].to<JsonArray>();
 			for (int i = 0; i < DO_PINS; i++)
 			{
-				s += "<div class='box' id=";
-				s += _Coils[i].Pin().c_str();
-				s += "> ";
-				s += _Coils[i].Pin().c_str();
-				s += "</div>";
-			}
-			page.replace("{digitalOutputs}", s);
-			request->send(200, "text/html", page); });
-		_asyncServer.addHandler(&_webSocket).addMiddleware([this](AsyncWebServerRequest *request, ArMiddlewareNext next)
-														   {
-			// ws.count() is the current count of WS clients: this one is trying to upgrade its HTTP connection
-			if (_webSocket.count() > 1) {
-			// if we have 2 clients or more, prevent the next one to connect
-			request->send(503, "text/plain", "Server is busy");
-			} else {
-			// process next middleware and at the end the handler
-			next();
-		} });
-		_webSocket.onEvent([this](AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
-						   {
-			(void)len;
-			if (type == WS_EVT_CONNECT) {
-				_lastMessagePublished.clear(); //force a broadcast
-				client->setCloseClientOnQueueFull(false);
-				client->ping();
-			} else if (type == WS_EVT_DISCONNECT) {
-				// logi("Home Page Disconnected!");
-			} else if (type == WS_EVT_ERROR) {
-				loge("ws error");
-			// } else if (type == WS_EVT_PONG) {
-            // 	logd("ws pong");
-        	} });
+				points.add(_Coils[i].Pin());
+			}
+			String s;
+			serializeJson(doc, s);
+			request->send(200, "application/json", s); });
+		_asyncServer.on("/trends", HTTP_GET, [this](AsyncWebServerRequest *request)
+						{ SendTrends(request); });
+		_asyncServer.on("/api/v1/points", HTTP_GET, [this](AsyncWebServerRequest *request)
+						{ SendPoints(request); });
+		_asyncServer.on(
+			"/api/v1/coils", HTTP_POST, [this](AsyncWebServerRequest *request)
+			{ WriteCoils(request); },
+			nullptr,
+			[](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+			{
+				// gathered for WriteCoils, the server frees _tempObject with the request
+				if (index == 0 && total <= API_BODY_MAX)
+				{
+					request->_tempObject = calloc(total + 1, 1);
+				}
+				if (request->_tempObject != nullptr)
+				{
+					memcpy((uint8_t *)request->_tempObject + index, data, len);
+				}
+			})
+			.addMiddleware(&_iot.Authentication()); // drives the outputs
+		for (int i = 0; i < AI_PINS; i++)
+		{
+			_trends[i][0].begin(TREND_FINE_SAMPLES, TREND_FINE_INTERVAL);
+			_trends[i][1].begin(TREND_COARSE_SAMPLES, TREND_COARSE_INTERVAL);
+		}
+		_bootId = esp_random();
+		for (int i = 0; i < PLC_POINTS; i++)
+		{
+			_dashboardValues[i] = INT32_MIN;
+		}
+		_homeHub.begin(
+			&_asyncServer, [this](DashboardFrame frame, uint32_t points, uint8_t *buffer, size_t size)
+			{ return SerializeDashboard(frame, points, buffer, size); },
+			[this](const char *name)
+			{ return PointIndex(name); });
 	}
 
 	void PLC::onNetworkConnect()
@@ -199,7 +244,7 @@ namespace EDGEBOX
 			addr -= _iot.InputRegisterBaseAddr();
 			if ((addr + words) > AI_PINS)
 			{
-				logw("READ_INPUT_REGISTER error: %d", (addr + words));
+				mlogw(MB, "READ_INPUT_REGISTER error: %d", (addr + words));
 				response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
 			}
 			else
@@ -220,12 +265,12 @@ namespace EDGEBOX
 			uint16_t start = 0;
 			uint16_t numCoils = 0;
 			request.get(2, start, numCoils);
-			logd("READ_COIL %d %d[%d]", request.getFunctionCode(), start, numCoils);
+			mlogd(MB, "READ_COIL %d %d[%d]", request.getFunctionCode(), start, numCoils);
 			// Address overflow?
 			start -= _iot.CoilBaseAddr();
 			if ((start + numCoils) > DO_PINS)
 			{
-				logw("READ_COIL error: %d", (start + numCoils));
+				mlogw(MB, "READ_COIL error: %d", (start + numCoils));
 				response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
 			}
 			for (int i = 0; i < DO_PINS; i++)
@@ -244,12 +289,12 @@ namespace EDGEBOX
 			uint16_t start = 0;
 			uint16_t numDiscretes = 0;
 			request.get(2, start, numDiscretes);
-			logd("READ_DISCR_INPUT %d %d[%d]", request.getFunctionCode(), start, numDiscretes);
+			mlogd(MB, "READ_DISCR_INPUT %d %d[%d]", request.getFunctionCode(), start, numDiscretes);
 			start -= _iot.DiscreteBaseAddr();
 			// Address overflow?
 			if ((start + numDiscretes) > DI_PINS)
 			{
-				logw("READ_DISCR_INPUT error: %d", (start + numDiscretes));
+				mlogw(MB, "READ_DISCR_INPUT error: %d", (start + numDiscretes));
 				response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
 			}
 			for (int i = 0; i < DI_PINS; i++)
@@ -269,7 +314,7 @@ namespace EDGEBOX
 			uint16_t start = 0;
 			uint16_t state = 0;
 			request.get(2, start, state);
-			logd("WRITE_COIL %d %d:%d", request.getFunctionCode(), start, state);
+			mlogd(MB, "WRITE_COIL %d %d:%d", request.getFunctionCode(), start, state);
 			start -= _iot.CoilBaseAddr();
 			// Is the coil number within the range of the coils?
 			if (start <= DO_PINS)
@@ -315,7 +360,7 @@ namespace EDGEBOX
 			uint8_t numBytes = 0;
 			uint16_t offset = 2; // Parameters start after serverID and FC
 			offset = request.get(offset, start, numCoils, numBytes);
-			logd("WRITE_MULT_COILS %d %d[%d]", request.getFunctionCode(), start, numCoils);
+			mlogd(MB, "WRITE_MULT_COILS %d %d[%d]", request.getFunctionCode(), start, numCoils);
 			start -= _iot.CoilBaseAddr();
 			// Check the parameters so far
 			if (start + numCoils <= DO_PINS)
@@ -364,152 +409,953 @@ namespace EDGEBOX
 
 	void PLC::CleanUp()
 	{
-		_webSocket.cleanupClients(); // cleanup disconnected clients or too many clients
+		_homeHub.CleanUp(); // cleanup disconnected clients
 	}
 
 	void PLC::Monitor()
 	{
+		uint32_t started = micros();
+		bool changed = false;
 		for (int i = 0; i < _analogInputs; i++)
 		{
 			_AnalogSensors[i].Run();
+			uint16_t level = _AnalogSensors[i].Level();
+			if (level != _imageAnalog[i])
+			{
+				_imageAnalog[i] = level;
+				changed = true;
+			}
+		}
+		uint16_t bits = 0;
+		for (int i = 0; i < DI_PINS; i++)
+		{
+			bits |= _DigitalSensors[i].Level() << i;
+		}
+		for (int i = 0; i < DO_PINS; i++)
+		{
+			bits |= _Coils[i].Level() << (DI_PINS + i);
+		}
+		if (bits != _imageBits)
+		{
+			uint16_t edges = bits ^ _imageBits;
+			for (int i = 0; i < DI_PINS; i++)
+			{
+				if (edges & (1 << i))
+				{
+					_iot.PublishEdge(_DigitalSensors[i].Pin(), (bits & (1 << i)) ? "High" : "Low");
+				}
+			}
+			for (int i = 0; i < DO_PINS; i++)
+			{
+				if (edges & (1 << (DI_PINS + i)))
+				{
+					_iot.PublishEdge(_Coils[i].Pin(), (bits & (1 << (DI_PINS + i))) ? "On" : "Off");
+				}
+			}
+			_imageBits = bits;
+			changed = true;
 		}
+		if (changed)
+		{
+			_iot.ProcessImageChanged(); // cached Modbus reads are stale
+		}
+		_monitorTime.add(micros() - started);
 	}
 
-	void PLC::Process()
+	size_t PLC::SerializeReadings(char *buffer, size_t size, uint32_t points)
 	{
-		_iot.Run();
-		if (_iot.getNetworkState() == OnLine)
+		ReadingsWriter writer(buffer, size, points);
+		writer.begin();
+		for (int i = 0; i < _digitalInputs; i++)
 		{
-			JsonDocument doc;
-			doc.clear();
-			for (int i = 0; i < _digitalInputs; i++)
+			writer.digital(i, _DigitalSensors[i].Pin(), _DigitalSensors[i].Level());
+		}
+		for (int i = 0; i < _analogInputs; i++)
+		{
+			writer.analog(i, _AnalogSensors[i].Channel(), _AnalogSensors[i].Level());
+		}
+		for (int i = 0; i < DO_PINS; i++)
+		{
+			writer.coil(i, _Coils[i].Pin(), _Coils[i].Level());
+		}
+		size_t len = writer.end();
+		if (len == 0)
+		{
+			loge("Readings exceed READINGS_BUFFER_SIZE");
+		}
+		return len;
+	}
+
+	uint32_t PLC::DashboardChanges()
+	{
+		uint32_t changed = 0;
+		for (int i = 0; i < PLC_POINTS; i++)
+		{
+			int32_t value;
+			if (i < DI_PINS)
 			{
-				doc[_DigitalSensors[i].Pin()] = _DigitalSensors[i].Level() ? "High" : "Low";
+				if (i >= _digitalInputs)
+				{
+					continue;
+				}
+				value = _DigitalSensors[i].Level();
 			}
-			for (int i = 0; i < _analogInputs; i++)
+			else if (i < DI_PINS + AI_PINS)
 			{
-				doc[_AnalogSensors[i].Channel()] = _AnalogSensors[i].Level();
+				if (i - DI_PINS >= _analogInputs)
+				{
+					continue;
+				}
+				value = lroundf(_AnalogSensors[i - DI_PINS].Level() * 10);
 			}
-			for (int i = 0; i < DO_PINS; i++)
+			else
 			{
-				doc[_Coils[i].Pin()] = _Coils[i].Level() ? "On" : "Off";
+				value = _Coils[i - DI_PINS - AI_PINS].Level();
 			}
-			String s;
-			serializeJson(doc, s);
-			DeserializationError err = deserializeJson(doc, s);
-			if (err)
+			if (value != _dashboardValues[i])
+			{
+				_dashboardValues[i] = value;
+				changed |= 1u << i;
+			}
+		}
+		return changed;
+	}
+
+	// Binary frames: type, point count, then per point
+	// schema: index, kind (0 digital input, 1 analog input, 2 coil), name length, name
+	// full and delta: index, value as int16 little endian, tenths for analog points
+	size_t PLC::SerializeDashboard(DashboardFrame frame, uint32_t points, uint8_t *buffer, size_t size)
+	{
+		if (frame == FrameText)
+		{
+			return SerializeReadings((char *)buffer, size, points);
+		}
+		size_t len = 2;
+		uint8_t count = 0;
+		for (int i = 0; i < PLC_POINTS; i++)
+		{
+			if (!(points & (1u << i)) || _dashboardValues[i] == INT32_MIN)
 			{
-				loge("deserializeJson() failed: %s", err.c_str());
+				continue; // not subscribed or not configured
 			}
-			if (_lastMessagePublished == s) // anything changed?
+			if (frame == FrameSchema)
 			{
-				return;
+				const char *name = i < DI_PINS ? _DigitalSensors[i].Pin() : i < DI_PINS + AI_PINS ? _AnalogSensors[i - DI_PINS].Channel() : _Coils[i - DI_PINS - AI_PINS].Pin();
+				size_t n = strlen(name);
+				if (len + 3 + n > size)
+				{
+					return 0;
+				}
+				buffer[len++] = i;
+				buffer[len++] = i < DI_PINS ? 0 : i < DI_PINS + AI_PINS ? 1 : 2;
+				buffer[len++] = n;
+				memcpy(buffer + len, name, n);
+				len += n;
 			}
-			_iot.PublishOnline();
-			_iot.Publish("readings", s.c_str(), false);
-			_lastMessagePublished = s;
-			_webSocket.textAll(s);
+			else
+			{
+				if (len + 3 > size)
+				{
+					return 0;
+				}
+				int16_t value = constrain(_dashboardValues[i], INT16_MIN, INT16_MAX);
+				buffer[len++] = i;
+				buffer[len++] = value & 0xFF;
+				buffer[len++] = (value >> 8) & 0xFF;
+			}
+			count++;
 		}
+		buffer[0] = frame;
+		buffer[1] = count;
+		return len;
 	}
 
-	void PLC::onMqttConnect()
+	int PLC::PointIndex(const char *name)
 	{
-		if (ReadyToPublish())
+		for (int i = 0; i < DI_PINS; i++)
 		{
-			logd("Publishing discovery ");
-			char buffer[STR_LEN];
-			JsonDocument doc;
-			JsonObject device = doc["device"].to<JsonObject>();
-			device["sw_version"] = CONFIG_VERSION;
-			device["manufacturer"] = "ClassicDIY";
-			sprintf(buffer, "ESP32-Bit (%X)", _iot.getUniqueId());
-			device["model"] = buffer;
+			if (strcmp(name, _DigitalSensors[i].Pin()) == 0)
+			{
+				return i;
+			}
+		}
+		for (int i = 0; i < AI_PINS; i++)
+		{
+			if (strcmp(name, _AnalogSensors[i].Channel()) == 0)
+			{
+				return DI_PINS + i;
+			}
+		}
+		for (int i = 0; i < DO_PINS; i++)
+		{
+			if (strcmp(name, _Coils[i].Pin()) == 0)
+			{
+				return DI_PINS + AI_PINS + i;
+			}
+		}
+		return -1;
+	}
 
-			JsonObject origin = doc["origin"].to<JsonObject>();
-			origin["name"] = TAG;
+	size_t PLC::EncodeReadings()
+	{
+		PayloadCodec &codec = _iot.Codec();
+		BinaryWriter writer(_encoded, sizeof(_encoded), codec.encoding());
+		bool positional = codec.positional();
+		size_t count = _digitalInputs + _analogInputs + DO_PINS;
+		if (positional)
+		{
+			writer.beginArray(count); // order and names published on <prefix>/stat/schema
+		}
+		else
+		{
+			writer.beginMap(count);
+		}
+		for (int i = 0; i < _digitalInputs; i++)
+		{
+			if (positional)
+			{
+				writer.addBool(_DigitalSensors[i].Level());
+			}
+			else
+			{
+				writer.addString(_DigitalSensors[i].Pin());
+				writer.addString(_DigitalSensors[i].Level() ? "High" : "Low");
+			}
+		}
+		for (int i = 0; i < _analogInputs; i++)
+		{
+			if (!positional)
+			{
+				writer.addString(_AnalogSensors[i].Channel());
+			}
+			writer.addFloat(_AnalogSensors[i].Level());
+		}
+		for (int i = 0; i < DO_PINS; i++)
+		{
+			if (positional)
+			{
+				writer.addBool(_Coils[i].Level());
+			}
+			else
+			{
+				writer.addString(_Coils[i].Pin());
+				writer.addString(_Coils[i].Level() ? "On" : "Off");
+			}
+		}
+		if (writer.overflowed())
+		{
+			loge("Encoded readings exceed READINGS_BUFFER_SIZE");
+		}
+		return writer.length();
+	}
 
-			JsonArray identifiers = device["identifiers"].to<JsonArray>();
-			sprintf(buffer, "%X", _iot.getUniqueId());
-			identifiers.add(buffer);
+	void PLC::PublishSchema()
+	{
+		// positional readings are plain arrays, this retained message tells subscribers what each element is
+		PayloadCodec &codec = _iot.Codec();
+		JsonDocument doc;
+		doc["encoding"] = PayloadCodec::Name(codec.encoding());
+		JsonArray names = doc["readings"].to<JsonArray>();
+		JsonArray types = doc["types"].to<JsonArray>();
+		for (int i = 0; i < _digitalInputs; i++)
+		{
+			names.add(_DigitalSensors[i].Pin());
+			types.add("bool");
+		}
+		for (int i = 0; i < _analogInputs; i++)
+		{
+			names.add(_AnalogSensors[i].Channel());
+			types.add("float");
+		}
+		for (int i = 0; i < DO_PINS; i++)
+		{
+			names.add(_Coils[i].Pin());
+			types.add("bool");
+		}
+		char topic[STR_LEN * 2];
+		snprintf(topic, sizeof(topic), "%s/stat/schema", _iot.getRootTopicPrefix().c_str());
+		_iot.PublishMessage(topic, doc, true);
+	}
 
-			JsonObject components = doc["components"].to<JsonObject>();
+	void PLC::PublishPoints()
+	{
+		if (_pointTopics[0][0] == 0)
+		{
+			return; // not connected yet
+		}
+		if (_pointsStale)
+		{
+			_pointsStale = false;
+			for (int i = 0; i < PLC_POINTS; i++)
+			{
+				_pointValues[i] = INT32_MIN;
+			}
+		}
+		for (int i = 0; i < _digitalInputs; i++)
+		{
+			int32_t level = _DigitalSensors[i].Level();
+			if (level != _pointValues[i] && _iot.PublishTopic(_pointTopics[i], level ? "High" : "Low", true))
+			{
+				_pointValues[i] = level;
+			}
+		}
+		char value[16];
+		for (int i = 0; i < _analogInputs; i++)
+		{
+			float level = _AnalogSensors[i].Level();
+			int32_t tenths = lroundf(level * 10);
+			if (tenths != _pointValues[DI_PINS + i])
+			{
+				JsonWriter::formatFloat(value, sizeof(value), level);
+				if (_iot.PublishTopic(_pointTopics[DI_PINS + i], value, true))
+				{
+					_pointValues[DI_PINS + i] = tenths;
+				}
+			}
+		}
+		for (int i = 0; i < DO_PINS; i++)
+		{
+			int32_t level = _Coils[i].Level();
+			int point = DI_PINS + AI_PINS + i;
+			if (level != _pointValues[point] && _iot.PublishTopic(_pointTopics[point], level ? "On" : "Off", true))
+			{
+				_pointValues[point] = level;
+			}
+		}
+	}
 
-			for (int i = 0; i < _digitalInputs; i++)
+	void PLC::OfferReadings(size_t len)
+	{
+		if (_iot.Codec().encoding() == EncodingJson)
+		{
+			_iot.Codec().Count(len, len);
+			_iot.Offer(PublishReadings, "readings", _readings, len);
+			return;
+		}
+		size_t encoded = EncodeReadings();
+		if (encoded > 0)
+		{
+			_iot.Codec().Count(len, encoded);
+			_iot.Offer(PublishReadings, "readings", (const char *)_encoded, encoded, false);
+		}
+	}
+
+	void PLC::onSparkplugBirth()
+	{
+		// aliases are the point index + 1, DDATA carries aliases only
+		uint8_t buf[SPARKPLUG_BUFFER];
+		SparkplugPayload payload(buf, sizeof(buf));
+		payload.begin(SparkplugPayload::Now());
+		for (int i = 0; i < _digitalInputs; i++)
+		{
+			_spValues[i] = _DigitalSensors[i].Level();
+			payload.addBool(_DigitalSensors[i].Pin(), i + 1, _spValues[i]);
+		}
+		for (int i = 0; i < _analogInputs; i++)
+		{
+			float level = _AnalogSensors[i].Level();
+			_spValues[DI_PINS + i] = lroundf(level * 10);
+			payload.addFloat(_AnalogSensors[i].Channel(), DI_PINS + i + 1, level);
+		}
+		for (int i = 0; i < DO_PINS; i++)
+		{
+			int point = DI_PINS + AI_PINS + i;
+			_spValues[point] = _Coils[i].Level();
+			payload.addBool(_Coils[i].Pin(), point + 1, _spValues[point]);
+		}
+		payload.seq(_iot.SparkplugSeq());
+		if (payload.length() == 0)
+		{
+			loge("DBIRTH exceeds SPARKPLUG_BUFFER");
+			return;
+		}
+		_iot.PublishSparkplug("DBIRTH", SPARKPLUG_DEVICE, buf, payload.length());
+	}
+
+	void PLC::PublishSparkplugData()
+	{
+		// report by exception, only metrics that changed since the last DBIRTH/DDATA
+		if (!_iot.SparkplugReady())
+		{
+			return;
+		}
+		uint8_t buf[SPARKPLUG_BUFFER];
+		SparkplugPayload payload(buf, sizeof(buf));
+		payload.begin(SparkplugPayload::Now());
+		int changed = 0;
+		for (int i = 0; i < _digitalInputs; i++)
+		{
+			int32_t level = _DigitalSensors[i].Level();
+			if (level != _spValues[i])
 			{
-				JsonObject din = components[_DigitalSensors[i].Pin()].to<JsonObject>();
-				din["platform"] = "sensor";
-				din["name"] = _DigitalSensors[i].Pin().c_str();
-				sprintf(buffer, "%X_%s", _iot.getUniqueId(), _DigitalSensors[i].Pin().c_str());
-				din["unique_id"] = buffer;
-				sprintf(buffer, "{{ value_json.%s }}", _DigitalSensors[i].Pin().c_str());
-				din["value_template"] = buffer;
-				din["icon"] = "mdi:switch";
+				_spValues[i] = level;
+				payload.addBool(nullptr, i + 1, level);
+				changed++;
 			}
-			for (int i = 0; i < _analogInputs; i++)
+		}
+		for (int i = 0; i < _analogInputs; i++)
+		{
+			float level = _AnalogSensors[i].Level();
+			int32_t tenths = lroundf(level * 10);
+			if (tenths != _spValues[DI_PINS + i])
+			{
+				_spValues[DI_PINS + i] = tenths;
+				payload.addFloat(nullptr, DI_PINS + i + 1, level);
+				changed++;
+			}
+		}
+		for (int i = 0; i < DO_PINS; i++)
+		{
+			int point = DI_PINS + AI_PINS + i;
+			int32_t level = _Coils[i].Level();
+			if (level != _spValues[point])
 			{
-				JsonObject ain = components[_AnalogSensors[i].Channel()].to<JsonObject>();
-				ain["platform"] = "sensor";
-				ain["name"] = _AnalogSensors[i].Channel().c_str();
-				ain["unit_of_measurement"] = "%";
-				sprintf(buffer, "%X_%s", _iot.getUniqueId(), _AnalogSensors[i].Channel().c_str());
-				ain["unique_id"] = buffer;
-				sprintf(buffer, "{{ value_json.%s }}", _AnalogSensors[i].Channel().c_str());
-				ain["value_template"] = buffer;
-				ain["icon"] = "mdi:lightning-bolt";
+				_spValues[point] = level;
+				payload.addBool(nullptr, point + 1, level);
+				changed++;
 			}
+		}
+		if (changed > 0)
+		{
+			payload.seq(_iot.SparkplugSeq());
+			_iot.PublishSparkplug("DDATA", SPARKPLUG_DEVICE, buf, payload.length());
+		}
+	}
+
+	void PLC::WriteSparkplugMetrics(JsonDocument &doc)
+	{
+		// DCMD, coils are addressed by name or alias
+		for (JsonObject metric : doc["metrics"].as<JsonArray>())
+		{
+			uint16_t alias = metric["alias"].isNull() ? 0 : metric["alias"].as<uint16_t>();
+			const char *name = metric["name"].isNull() ? "" : metric["name"].as<const char *>();
+			int coil = -1;
 			for (int i = 0; i < DO_PINS; i++)
 			{
-				JsonObject dout = components[_Coils[i].Pin()].to<JsonObject>();
-				dout["platform"] = "sensor";
-				dout["name"] = _Coils[i].Pin().c_str();
-				sprintf(buffer, "%X_%s", _iot.getUniqueId(), _Coils[i].Pin().c_str());
-				dout["unique_id"] = buffer;
-				sprintf(buffer, "{{ value_json.%s }}", _Coils[i].Pin().c_str());
-				dout["value_template"] = buffer;
-				dout["icon"] = "mdi:valve-open";
+				if (alias == DI_PINS + AI_PINS + i + 1 || strcmp(name, _Coils[i].Pin()) == 0)
+				{
+					coil = i;
+				}
+			}
+			if (coil < 0 || !metric["value"].is<bool>())
+			{
+				logw("DCMD metric %s (%d) ignored, only coils are writable", name, alias);
+				continue;
+			}
+			_Coils[coil].Set(metric["value"].as<bool>() ? HIGH : LOW);
+			_iot.ProcessImageChanged();
+			logi("DCMD Coil %d %s", coil, metric["value"].as<bool>() ? "HIGH" : "LOW");
+		}
+	}
+
+	void PLC::Process()
+	{
+		uint32_t started = micros();
+		_iot.Run();
+		bool online = _iot.getNetworkState() == OnLine;
+		if (online && _iot.PointTopics())
+		{
+			PublishPoints();
+		}
+		if (online && _iot.Sparkplug())
+		{
+			PublishSparkplugData();
+		}
+		size_t len = SerializeReadings(_readings, sizeof(_readings));
+		if (len > 0 && (len != _lastReadingsLength || memcmp(_readings, _lastReadings, len) != 0)) // anything changed?
+		{
+			if (online && _iot.MqttConnected())
+			{
+				_iot.PublishOnline();
+				if (!_iot.PointTopics() && !_iot.Sparkplug())
+				{
+					OfferReadings(len);
+				}
+			}
+			else
+			{
+				_storePending = true;
 			}
+			memcpy(_lastReadings, _readings, len + 1);
+			_lastReadingsLength = len;
+		}
+		uint32_t changed = DashboardChanges();
+		if (changed != 0)
+		{
+			_homeHub.Changed(changed);
+			UpdateApi(changed);
+		}
+		SampleTrends();
+		if (_storePending && _iot.Store(_lastReadings, _lastReadingsLength))
+		{
+			_storePending = false; // broker unreachable, kept in flash until it is back
+		}
+		_homeHub.Process(); // clients that connected, subscribed or caught up
+		_processTime.add(micros() - started);
+	}
 
-			sprintf(buffer, "%s/stat/readings", _iot.getRootTopicPrefix().c_str());
+	void PLC::addApplicationMetrics(MetricsWriter &metrics)
+	{
+		static const char *names[] = {"monitor", "process"};
+		ScanTime *scans[] = {&_monitorTime, &_processTime};
+		metrics.family("scans_total", "PLC scans run", "counter");
+		for (int i = 0; i < 2; i++)
+		{
+			metrics.add("scans_total", (int64_t)scans[i]->count, "scan", names[i]);
+		}
+		metrics.family("scan_duration_us", "Duration of the last scan");
+		for (int i = 0; i < 2; i++)
+		{
+			metrics.add("scan_duration_us", (int64_t)scans[i]->last, "scan", names[i]);
+		}
+		metrics.family("scan_duration_max_us", "Longest scan since boot");
+		for (int i = 0; i < 2; i++)
+		{
+			metrics.add("scan_duration_max_us", (int64_t)scans[i]->max, "scan", names[i]);
+		}
+		metrics.family("scan_duration_us_total", "Time spent scanning", "counter");
+		for (int i = 0; i < 2; i++)
+		{
+			metrics.add("scan_duration_us_total", (int64_t)scans[i]->total, "scan", names[i]);
+		}
+	}
+
+	void PLC::SetStateTopic(JsonObject &component, int point, const char *name)
+	{
+		if (_iot.PointTopics())
+		{
+			component["state_topic"] = _pointTopics[point];
+			component["value_template"] = "{{ value }}";
+		}
+		else
+		{
+			char buffer[STR_LEN];
+			sprintf(buffer, "{{ value_json.%s }}", name);
+			component["value_template"] = buffer;
+		}
+	}
+
+	void PLC::onMqttConnect()
+	{
+		// point topics are prebuilt here so publishing a point never formats a topic
+		std::string prefix = _iot.getRootTopicPrefix();
+		for (int i = 0; i < DI_PINS; i++)
+		{
+			snprintf(_pointTopics[i], sizeof(_pointTopics[i]), "%s/stat/%s", prefix.c_str(), _DigitalSensors[i].Pin());
+		}
+		for (int i = 0; i < AI_PINS; i++)
+		{
+			snprintf(_pointTopics[DI_PINS + i], sizeof(_pointTopics[0]), "%s/stat/%s", prefix.c_str(), _AnalogSensors[i].Channel());
+		}
+		for (int i = 0; i < DO_PINS; i++)
+		{
+			snprintf(_pointTopics[DI_PINS + AI_PINS + i], sizeof(_pointTopics[0]), "%s/stat/%s", prefix.c_str(), _Coils[i].Pin());
+		}
+		_pointsStale = true; // republish every point, the broker keeps them retained
+		if (_iot.Codec().positional())
+		{
+			PublishSchema();
+		}
+		PublishDiscovery();
+	}
+
+	size_t PLC::DiscoveryComponent(int point, char *payload, size_t size)
+	{
+		const char *name;
+		const char *icon;
+		if (point < DI_PINS)
+		{
+			if (point >= _digitalInputs)
+			{
+				return 0;
+			}
+			name = _DigitalSensors[point].Pin();
+			icon = "mdi:switch";
+		}
+		else if (point < DI_PINS + AI_PINS)
+		{
+			if (point - DI_PINS >= _analogInputs)
+			{
+				return 0;
+			}
+			name = _AnalogSensors[point - DI_PINS].Channel();
+			icon = "mdi:lightning-bolt";
+		}
+		else
+		{
+			name = _Coils[point - DI_PINS - AI_PINS].Pin();
+			icon = "mdi:valve-open";
+		}
+		char buffer[STR_LEN * 2];
+		JsonDocument doc;
+		doc["name"] = name;
+		sprintf(buffer, "%X_%s", _iot.getUniqueId(), name);
+		doc["unique_id"] = buffer;
+		if (point >= DI_PINS && point < DI_PINS + AI_PINS)
+		{
+			doc["unit_of_measurement"] = "%";
+		}
+		doc["icon"] = icon;
+		if (!_iot.PointTopics())
+		{
+			snprintf(buffer, sizeof(buffer), "%s/stat/readings", _iot.getRootTopicPrefix().c_str());
 			doc["state_topic"] = buffer;
-			sprintf(buffer, "%s/tele/LWT", _iot.getRootTopicPrefix().c_str());
-			doc["availability_topic"] = buffer;
-			doc["pl_avail"] = "Online";
-			doc["pl_not_avail"] = "Offline";
+		}
+		JsonObject component = doc.as<JsonObject>();
+		SetStateTopic(component, point, name);
+		snprintf(buffer, sizeof(buffer), "%s/tele/LWT", _iot.getRootTopicPrefix().c_str());
+		doc["availability_topic"] = buffer;
+		doc["pl_avail"] = "Online";
+		doc["pl_not_avail"] = "Offline";
+		JsonObject device = doc["device"].to<JsonObject>();
+		JsonArray identifiers = device["identifiers"].to<JsonArray>();
+		sprintf(buffer, "%X", _iot.getUniqueId());
+		identifiers.add(buffer);
+		device["name"] = _iot.getThingName();
+		device["sw_version"] = CONFIG_VERSION;
+		device["manufacturer"] = "ClassicDIY";
+		sprintf(buffer, "ESP32-Bit (%X)", _iot.getUniqueId());
+		device["model"] = buffer;
+		doc["origin"]["name"] = TAG;
+		size_t len = measureJson(doc);
+		if (len >= size)
+		{
+			loge("Discovery of %s exceeds %d bytes", name, size);
+			return 0;
+		}
+		return serializeJson(doc, payload, size);
+	}
 
-			_iot.PublishHADiscovery(doc);
-			_discoveryPublished = true;
+	void PLC::PublishDiscovery()
+	{
+		// one small retained config per point, only one payload is in memory at a time
+		char payload[DISCOVERY_BUFFER];
+		uint32_t hash = FNV_OFFSET_BASIS;
+		for (int i = 0; i < PLC_POINTS; i++)
+		{
+			size_t len = DiscoveryComponent(i, payload, sizeof(payload));
+			hash = fnv1a(hash, &len, sizeof(len));
+			hash = fnv1a(hash, payload, len);
+		}
+		if (hash == _discoveryHash)
+		{
+			logd("Discovery unchanged");
+			return;
+		}
+		logd("Publishing discovery %08X", hash);
+		// no hash stored yet, retire the single device config of earlier versions
+		bool published = _discoveryHash != 0 || _iot.PublishHADiscovery("device", nullptr, nullptr, 0);
+		for (int i = 0; i < PLC_POINTS; i++)
+		{
+			const char *name = i < DI_PINS ? _DigitalSensors[i].Pin() : i < DI_PINS + AI_PINS ? _AnalogSensors[i - DI_PINS].Channel() : _Coils[i - DI_PINS - AI_PINS].Pin();
+			size_t len = DiscoveryComponent(i, payload, sizeof(payload));
+			// an empty retained config removes a point that is no longer configured
+			published &= _iot.PublishHADiscovery("sensor", name, payload, len);
+		}
+		if (published)
+		{
+			_discoveryHash = hash;
+			_iot.SaveSettingsLater(); // kept across reboots, the broker keeps the retained configs
 		}
 	}
 
 	void PLC::onMqttMessage(char *topic, JsonDocument &doc)
 	{
 		logd("onMqttMessage %s", topic);
-		if (doc.containsKey("command"))
+		if (doc["metrics"].is<JsonArray>())
+		{
+			WriteSparkplugMetrics(doc);
+		}
+		else if (doc["command"] == "Write Coil")
+		{
+			WriteCoil(doc["coil"] | 0, doc["state"]);
+		}
+	}
+
+	bool PLC::WriteCoil(int coil, JsonVariantConst state)
+	{
+		coil -= 1;
+		if (coil < 0 || coil >= DO_PINS)
+		{
+			logw("Write Coil %d out of range", coil + 1);
+			return false;
+		}
+		int level = -1;
+		if (state.is<bool>())
+		{
+			level = state.as<bool>() ? HIGH : LOW;
+		}
+		else if (state.is<int>())
+		{
+			level = state.as<int>() != 0 ? HIGH : LOW;
+		}
+		else if (state.is<const char *>())
+		{
+			const char *input = state.as<const char *>();
+			if (strcasecmp(input, "on") == 0 || strcasecmp(input, "high") == 0 || strcmp(input, "1") == 0)
+			{
+				level = HIGH;
+			}
+			else if (strcasecmp(input, "off") == 0 || strcasecmp(input, "low") == 0 || strcmp(input, "0") == 0)
+			{
+				level = LOW;
+			}
+		}
+		if (level < 0)
+		{
+			logw("Write Coil %d invalid state", coil);
+			return false;
+		}
+		_Coils[coil].Set(level);
+		_iot.ProcessImageChanged();
+		logi("Write Coil %d %s", coil, level == HIGH ? "HIGH" : "LOW");
+		return true;
+	}
+
+	void PLC::UpdateApi(uint32_t changed)
+	{
+		std::lock_guard<std::mutex> guard(_apiLock);
+		_scanSequence++;
+		for (int i = 0; i < PLC_POINTS; i++)
 		{
-			if (strcmp(doc["command"], "Write Coil") == 0)
+			if (changed & (1u << i))
 			{
-				int coil = doc["coil"];
-				coil -= 1;
-				if (coil >= 0 && coil < DO_PINS)
+				_pointSequence[i] = _scanSequence;
+			}
+		}
+		_apiPointsLength = SerializeReadings(_apiPoints, sizeof(_apiPoints));
+	}
+
+	// GET /api/v1/points and /api/v1/points/<name>, the ETag is the scan that last changed the points sent
+	void PLC::SendPoints(AsyncWebServerRequest *request)
+	{
+		String url = request->url();
+		const char *name = url.length() > 15 ? url.c_str() + 15 : nullptr; // after "/api/v1/points/"
+		int point = -1;
+		if (name != nullptr)
+		{
+			point = PointIndex(name);
+			if (point < 0 || _dashboardValues[point] == INT32_MIN)
+			{
+				request->send(404, "application/json", "{\"error\":\"unknown point\"}");
+				return;
+			}
+		}
+		char etag[24];
+		String body;
+		{
+			std::lock_guard<std::mutex> guard(_apiLock);
+			snprintf(etag, sizeof(etag), "\"%08x.%u\"", (unsigned)_bootId, (unsigned)(point < 0 ? _scanSequence : _pointSequence[point]));
+			const AsyncWebHeader *match = request->getHeader("If-None-Match");
+			if (match != nullptr && match->value() == etag)
+			{
+				AsyncWebServerResponse *response = request->beginResponse(304);
+				response->addHeader("ETag", etag);
+				request->send(response);
+				return;
+			}
+			if (point < 0)
+			{
+				body = _apiPoints;
+			}
+			else
+			{
+				// cut "name":value out of the readings, values hold no commas
+				char key[STR_LEN];
+				snprintf(key, sizeof(key), "\"%s\":", name);
+				const char *start = strstr(_apiPoints, key);
+				if (start != nullptr)
 				{
-					String input = doc["state"];
-					input.toLowerCase();
-					if (input == "on" || input == "high" || input == "1")
-					{
-						_Coils[coil].Set(HIGH);
-						logi("Write Coil %d HIGH", coil);
-					}
-					else if (input == "off" || input == "low" || input == "0")
+					size_t len = strcspn(start, ",}");
+					body = "{";
+					body.concat(start, len);
+					body += "}";
+				}
+			}
+		}
+		AsyncWebServerResponse *response = request->beginResponse(200, "application/json", body);
+		response->addHeader("ETag", etag);
+		response->addHeader("Cache-Control", "no-cache");
+		request->send(response);
+	}
+
+	// averages the scans of each analog point into the fine trend every TREND_FINE_INTERVAL,
+	// and the fine samples into the coarse trend
+	void PLC::SampleTrends()
+	{
+		for (int i = 0; i < _analogInputs; i++)
+		{
+			_trendSum[i][0] += _dashboardValues[DI_PINS + i];
+		}
+		_trendCount[0]++;
+		unsigned long now = millis();
+		if (now - _lastTrendTimeStamp < TREND_FINE_INTERVAL)
+		{
+			return;
+		}
+		_lastTrendTimeStamp = now;
+		std::lock_guard<std::mutex> guard(_trendLock);
+		for (int i = 0; i < _analogInputs; i++)
+		{
+			int16_t value = constrain(_trendSum[i][0] / _trendCount[0], INT16_MIN, INT16_MAX);
+			_trends[i][0].Push(value);
+			_trendSum[i][0] = 0;
+			_trendSum[i][1] += value;
+		}
+		_trendCount[0] = 0;
+		if (++_trendCount[1] >= TREND_COARSE_INTERVAL / TREND_FINE_INTERVAL)
+		{
+			for (int i = 0; i < _analogInputs; i++)
+			{
+				_trends[i][1].Push(_trendSum[i][1] / _trendCount[1]);
+				_trendSum[i][1] = 0;
+			}
+			_trendCount[1] = 0;
+		}
+	}
+
+	// GET /trends?res=0&width=300[&point=AI1], the configured analog points downsampled to width samples,
+	// t is ms before the newest sample, v the value. Streamed a point at a time through a chunked response.
+	void PLC::SendTrends(AsyncWebServerRequest *request)
+	{
+		int res = request->hasParam("res") ? request->getParam("res")->value().toInt() : 0;
+		int width = request->hasParam("width") ? request->getParam("width")->value().toInt() : TREND_WIDTH_DEFAULT;
+		const char *name = request->hasParam("point") ? request->getParam("point")->value().c_str() : nullptr;
+		if (res < 0 || res >= TREND_RESOLUTIONS)
+		{
+			request->send(400, "application/json", "{\"error\":\"bad trend resolution\"}");
+			return;
+		}
+		int point = name != nullptr ? PointIndex(name) - DI_PINS : -1;
+		if (name != nullptr && (point < 0 || point >= _analogInputs))
+		{
+			request->send(404, "application/json", "{\"error\":\"unknown point\"}");
+			return;
+		}
+		std::shared_ptr<TrendStream> trend = std::make_shared<TrendStream>();
+		trend->res = res;
+		trend->width = constrain(width, 3, (int)_trends[0][res].capacity());
+		trend->point = point;
+		AsyncWebServerResponse *response = request->beginChunkedResponse("application/json", [this, trend](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+																		 { return FillTrends(*trend, buffer, maxLen); });
+		response->addHeader("Cache-Control", "no-cache");
+		request->send(response);
+	}
+
+	size_t PLC::FillTrends(TrendStream &trend, uint8_t *buffer, size_t maxLen)
+	{
+		size_t len = 0;
+		while (len < maxLen)
+		{
+			if (trend.textPos < trend.textLen)
+			{
+				size_t n = min(maxLen - len, trend.textLen - trend.textPos);
+				memcpy(buffer + len, trend.text + trend.textPos, n);
+				trend.textPos += n;
+				len += n;
+				continue;
+			}
+			int n = 0;
+			uint32_t interval = _trends[0][trend.res].interval();
+			switch (trend.state)
+			{
+			case TrendStream::Start:
+				n = snprintf(trend.text, sizeof(trend.text), "{\"interval_ms\":%u,\"series\":{", (unsigned)interval);
+				trend.state = TrendStream::Point;
+				break;
+			case TrendStream::Point:
+				do
+				{
+					trend.index++;
+				} while (trend.index < _analogInputs && trend.point >= 0 && trend.index != trend.point);
+				if (trend.index >= _analogInputs)
+				{
+					n = snprintf(trend.text, sizeof(trend.text), "}}");
+					trend.state = TrendStream::Done;
+					break;
+				}
+				{
+					// a snapshot of the downsampled series, the rings move on while it is sent
+					std::lock_guard<std::mutex> guard(_trendLock);
+					TrendBuffer &ring = _trends[trend.index][trend.res];
+					trend.count = ring.size();
+					ring.Downsample(trend.width, trend.indexes);
+					trend.values.clear();
+					for (uint16_t i : trend.indexes)
 					{
-						_Coils[coil].Set(LOW);
-						logi("Write Coil %d LOW", coil);
+						trend.values.push_back(ring.at(i));
 					}
-					else
+				}
+				n = snprintf(trend.text, sizeof(trend.text), "%s\"%s\":{\"t\":[", trend.first ? "" : ",", _AnalogSensors[trend.index].Channel());
+				trend.first = false;
+				trend.sample = 0;
+				trend.state = TrendStream::Times;
+				break;
+			case TrendStream::Times:
+				if (trend.sample < trend.indexes.size())
+				{
+					n = snprintf(trend.text, sizeof(trend.text), "%s%u", trend.sample == 0 ? "" : ",", (unsigned)((trend.count - 1 - trend.indexes[trend.sample]) * interval));
+					trend.sample++;
+					break;
+				}
+				n = snprintf(trend.text, sizeof(trend.text), "],\"v\":[");
+				trend.sample = 0;
+				trend.state = TrendStream::Values;
+				break;
+			case TrendStream::Values:
+				if (trend.sample < trend.values.size())
+				{
+					if (trend.sample > 0)
 					{
-						logw("Write Coil %d invalid state", coil);
+						trend.text[n++] = ',';
 					}
+					n += JsonWriter::formatFloat(trend.text + n, sizeof(trend.text) - n, trend.values[trend.sample] / 10.0f, 1);
+					trend.sample++;
+					break;
 				}
+				n = snprintf(trend.text, sizeof(trend.text), "]}");
+				trend.state = TrendStream::Point;
+				break;
+			case TrendStream::Done:
+				return len;
+			}
+			trend.textLen = n;
+			trend.textPos = 0;
+		}
+		return len;
+	}
+
+	// POST /api/v1/coils {"GPIO_40":"On","GPIO_39":false}
+	void PLC::WriteCoils(AsyncWebServerRequest *request)
+	{
+		if (request->contentLength() > API_BODY_MAX)
+		{
+			request->send(413, "application/json", "{\"error\":\"body too large\"}");
+			return;
+		}
+		JsonDocument doc;
+		if (request->_tempObject == nullptr || deserializeJson(doc, (const char *)request->_tempObject) != DeserializationError::Ok || !doc.is<JsonObject>())
+		{
+			request->send(400, "application/json", "{\"error\":\"expected a JSON object of coil states\"}");
+			return;
+		}
+		JsonDocument result;
+		JsonArray written = result["written"].to<JsonArray>();
+		JsonArray rejected = result["rejected"].to<JsonArray>();
+		for (JsonPair coil : doc.as<JsonObject>())
+		{
+			int point = PointIndex(coil.key().c_str());
+			if (point >= DI_PINS + AI_PINS && WriteCoil(point - DI_PINS - AI_PINS + 1, coil.value()))
+			{
+				written.add(coil.key().c_str());
+			}
+			else
+			{
+				rejected.add(coil.key().c_str());
 			}
 		}
+		String s;
+		serializeJson(result, s);
+		request->send(rejected.size() == 0 ? 200 : 400, "application/json", s);
 	}
 }
\ No newline at end of file
@@ -0,0 +1,480 @@
+#define LOG_MODULE MQTT
+#include <Arduino.h>
+#include <string>
+#include "Log.h"
+#include "Defines.h"
+#include "PayloadCodec.h"
+
+namespace EDGEBOX
+{
+	void BinaryWriter::put(uint8_t b)
+	{
+		if (_len < _size)
+		{
+			_buffer[_len++] = b;
+		}
+		else
+		{
+			_overflow = true;
+		}
+	}
+
+	void BinaryWriter::putBE(uint64_t value, uint8_t bytes)
+	{
+		while (bytes-- > 0)
+		{
+			put((value >> (bytes * 8)) & 0xFF);
+		}
+	}
+
+	void BinaryWriter::cborHead(uint8_t major, uint64_t value)
+	{
+		major <<= 5;
+		if (value < 24)
+		{
+			put(major | value);
+		}
+		else if (value <= 0xFF)
+		{
+			put(major | 24);
+			putBE(value, 1);
+		}
+		else if (value <= 0xFFFF)
+		{
+			put(major | 25);
+			putBE(value, 2);
+		}
+		else if (value <= 0xFFFFFFFF)
+		{
+			put(major | 26);
+			putBE(value, 4);
+		}
+		else
+		{
+			put(major | 27);
+			putBE(value, 8);
+		}
+	}
+
+	void BinaryWriter::beginMap(size_t count)
+	{
+		if (_encoding == EncodingCBOR)
+		{
+			cborHead(5, count);
+		}
+		else if (count < 16)
+		{
+			put(0x80 | count);
+		}
+		else
+		{
+			put(0xde);
+			putBE(count, 2);
+		}
+	}
+
+	void BinaryWriter::beginArray(size_t count)
+	{
+		if (_encoding == EncodingCBOR)
+		{
+			cborHead(4, count);
+		}
+		else if (count < 16)
+		{
+			put(0x90 | count);
+		}
+		else
+		{
+			put(0xdc);
+			putBE(count, 2);
+		}
+	}
+
+	void BinaryWriter::addString(const char *value)
+	{
+		addString(value, strlen(value));
+	}
+
+	void BinaryWriter::addString(const char *value, size_t len)
+	{
+		if (_encoding == EncodingCBOR)
+		{
+			cborHead(3, len);
+		}
+		else if (len < 32)
+		{
+			put(0xa0 | len);
+		}
+		else if (len <= 0xFF)
+		{
+			put(0xd9);
+			putBE(len, 1);
+		}
+		else
+		{
+			put(0xda);
+			putBE(len, 2);
+		}
+		for (size_t i = 0; i < len; i++)
+		{
+			put(value[i]);
+		}
+	}
+
+	void BinaryWriter::addFloat(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		put(_encoding == EncodingCBOR ? 0xfa : 0xca);
+		putBE(bits, 4);
+	}
+
+	void BinaryWriter::addDouble(double value)
+	{
+		if ((double)(float)value == value)
+		{
+			addFloat(value); // no precision lost
+			return;
+		}
+		uint64_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		put(_encoding == EncodingCBOR ? 0xfb : 0xcb);
+		putBE(bits, 8);
+	}
+
+	void BinaryWriter::addInt(int64_t value)
+	{
+		if (_encoding == EncodingCBOR)
+		{
+			if (value < 0)
+			{
+				cborHead(1, -(value + 1));
+			}
+			else
+			{
+				cborHead(0, value);
+			}
+		}
+		else if (value >= 0)
+		{
+			if (value < 128)
+			{
+				put(value);
+			}
+			else if (value <= 0xFF)
+			{
+				put(0xcc);
+				putBE(value, 1);
+			}
+			else if (value <= 0xFFFF)
+			{
+				put(0xcd);
+				putBE(value, 2);
+			}
+			else if (value <= 0xFFFFFFFF)
+			{
+				put(0xce);
+				putBE(value, 4);
+			}
+			else
+			{
+				put(0xcf);
+				putBE(value, 8);
+			}
+		}
+		else if (value >= -32)
+		{
+			put(0xe0 | (value & 0x1f));
+		}
+		else if (value >= INT8_MIN)
+		{
+			put(0xd0);
+			putBE(value, 1);
+		}
+		else if (value >= INT16_MIN)
+		{
+			put(0xd1);
+			putBE(value, 2);
+		}
+		else if (value >= INT32_MIN)
+		{
+			put(0xd2);
+			putBE(value, 4);
+		}
+		else
+		{
+			put(0xd3);
+			putBE(value, 8);
+		}
+	}
+
+	void BinaryWriter::addBool(bool value)
+	{
+		if (_encoding == EncodingCBOR)
+		{
+			put(value ? 0xf5 : 0xf4);
+		}
+		else
+		{
+			put(value ? 0xc3 : 0xc2);
+		}
+	}
+
+	void BinaryWriter::addNull()
+	{
+		put(_encoding == EncodingCBOR ? 0xf6 : 0xc0);
+	}
+
+	void BinaryWriter::addVariant(JsonVariantConst value, uint8_t depth)
+	{
+		if (depth > PAYLOAD_MAX_DEPTH)
+		{
+			_overflow = true;
+			return;
+		}
+		if (value.is<JsonObjectConst>())
+		{
+			JsonObjectConst obj = value.as<JsonObjectConst>();
+			beginMap(obj.size());
+			for (JsonPairConst kv : obj)
+			{
+				addString(kv.key().c_str());
+				addVariant(kv.value(), depth + 1);
+			}
+		}
+		else if (value.is<JsonArrayConst>())
+		{
+			JsonArrayConst arr = value.as<JsonArrayConst>();
+			beginArray(arr.size());
+			for (JsonVariantConst v : arr)
+			{
+				addVariant(v, depth + 1);
+			}
+		}
+		else if (value.is<const char *>())
+		{
+			addString(value.as<const char *>());
+		}
+		else if (value.is<bool>())
+		{
+			addBool(value.as<bool>());
+		}
+		else if (value.is<int64_t>())
+		{
+			addInt(value.as<int64_t>());
+		}
+		else if (value.is<uint64_t>())
+		{
+			addInt(value.as<uint64_t>() & INT64_MAX);
+		}
+		else if (value.is<double>())
+		{
+			addDouble(value.as<double>());
+		}
+		else
+		{
+			addNull();
+		}
+	}
+
+	const char *PayloadCodec::Name(PayloadEncoding encoding)
+	{
+		return encoding == EncodingMsgPack ? "msgpack" : encoding == EncodingCBOR ? "cbor" : "json";
+	}
+
+	void PayloadCodec::setEncoding(PayloadEncoding encoding, bool positional)
+	{
+		_encoding = encoding;
+		_positional = positional;
+		logi("MQTT payload encoding: %s%s", Name(encoding), positional ? " positional" : "");
+	}
+
+	void PayloadCodec::Count(size_t jsonBytes, size_t encodedBytes)
+	{
+		_messages++;
+		_jsonBytes += jsonBytes;
+		_encodedBytes += encodedBytes;
+	}
+
+	size_t PayloadCodec::Encode(JsonDocument &doc, uint8_t *buffer, size_t size)
+	{
+		size_t len = 0;
+		if (_encoding == EncodingJson)
+		{
+			len = serializeJson(doc, (char *)buffer, size);
+		}
+		else if (_encoding == EncodingMsgPack)
+		{
+			len = serializeMsgPack(doc, buffer, size);
+		}
+		else
+		{
+			BinaryWriter writer(buffer, size, EncodingCBOR);
+			writer.addVariant(doc.as<JsonVariantConst>());
+			len = writer.length();
+		}
+		if (len > 0)
+		{
+			Count(measureJson(doc), len);
+		}
+		return len;
+	}
+
+	bool PayloadCodec::decodeCBOR(const uint8_t *&p, const uint8_t *end, JsonVariant dst, uint8_t depth)
+	{
+		if (p >= end || depth > PAYLOAD_MAX_DEPTH)
+		{
+			return false;
+		}
+		uint8_t major = *p >> 5;
+		uint8_t info = *p++ & 0x1f;
+		uint64_t value = info;
+		if (info >= 24 && info <= 27)
+		{
+			uint8_t bytes = 1 << (info - 24);
+			if (end - p < bytes)
+			{
+				return false;
+			}
+			value = 0;
+			while (bytes-- > 0)
+			{
+				value = (value << 8) | *p++;
+			}
+		}
+		else if (info > 27)
+		{
+			return false; // indefinite lengths are not supported
+		}
+		switch (major)
+		{
+		case 0:
+			dst.set(value);
+			return true;
+		case 1:
+			dst.set(-1 - (int64_t)value);
+			return true;
+		case 2:
+		case 3:
+		{
+			if ((uint64_t)(end - p) < value)
+			{
+				return false;
+			}
+			if (major == 3)
+			{
+				dst.set(std::string((const char *)p, value));
+			}
+			p += value;
+			return true;
+		}
+		case 4:
+		{
+			JsonArray arr = dst.to<JsonArray>();
+			for (uint64_t i = 0; i < value; i++)
+			{
+				if (!decodeCBOR(p, end, arr.add<JsonVariant>(), depth + 1))
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+		case 5:
+		{
+			JsonObject obj = dst.to<JsonObject>();
+			for (uint64_t i = 0; i < value; i++)
+			{
+				if (p >= end || (*p >> 5) != 3)
+				{
+					return false; // only text keys
+				}
+				JsonDocument key;
+				if (!decodeCBOR(p, end, key.to<JsonVariant>(), depth + 1))
+				{
+					return false;
+				}
+				if (!decodeCBOR(p, end, obj[key.as<std::string>()].to<JsonVariant>(), depth + 1))
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+		case 7:
+			if (info == 20 || info == 21)
+			{
+				dst.set(info == 21);
+			}
+			else if (info == 25)
+			{
+				// half precision
+				int exp = (value >> 10) & 0x1f;
+				int mant = value & 0x3ff;
+				double v = exp == 0 ? ldexp(mant, -24) : exp != 31 ? ldexp(mant + 1024, exp - 25) : NAN;
+				dst.set((value & 0x8000) ? -v : v);
+			}
+			else if (info == 26)
+			{
+				uint32_t bits = value;
+				float f;
+				memcpy(&f, &bits, sizeof(f));
+				dst.set(f);
+			}
+			else if (info == 27)
+			{
+				double d;
+				memcpy(&d, &value, sizeof(d));
+				dst.set(d);
+			}
+			else
+			{
+				dst.clear(); // null, undefined
+			}
+			return true;
+		default:
+			return false; // tags are not supported
+		}
+	}
+
+	bool PayloadCodec::Decode(const uint8_t *data, size_t len, JsonDocument &doc, JsonDocument *filter)
+	{
+		if (len > 0 && (data[0] == '{' || data[0] == '['))
+		{
+			// JSON is always accepted, handy when testing from a MQTT client
+			if (filter != nullptr)
+			{
+				return !deserializeJson(doc, (const char *)data, len, DeserializationOption::Filter(*filter));
+			}
+			return !deserializeJson(doc, (const char *)data, len);
+		}
+		if (_encoding == EncodingMsgPack)
+		{
+			if (filter != nullptr)
+			{
+				return !deserializeMsgPack(doc, data, len, DeserializationOption::Filter(*filter));
+			}
+			return !deserializeMsgPack(doc, data, len);
+		}
+		if (_encoding == EncodingCBOR)
+		{
+			// the CBOR decoder keeps every field, payloads are small
+			const uint8_t *p = data;
+			doc.clear();
+			return decodeCBOR(p, data + len, doc.to<JsonVariant>(), 0);
+		}
+		return false;
+	}
+
+	void PayloadCodec::getStatistics(JsonObject &stats)
+	{
+		stats["encoding"] = Name(_encoding);
+		stats["positional"] = positional();
+		stats["messages"] = _messages;
+		stats["json_bytes"] = _jsonBytes;
+		stats["encoded_bytes"] = _encodedBytes;
+		stats["json_bytes_per_msg"] = _messages > 0 ? _jsonBytes / _messages : 0;
+		stats["encoded_bytes_per_msg"] = _messages > 0 ? _encodedBytes / _messages : 0;
+		stats["saved_bytes_per_msg"] = _messages > 0 ? ((int32_t)_jsonBytes - (int32_t)_encodedBytes) / (int32_t)_messages : 0;
+	}
+}
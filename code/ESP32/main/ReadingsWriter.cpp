@@ -0,0 +1,29 @@
+#include <Arduino.h>
+#include "ReadingsWriter.h"
+
+namespace EDGEBOX
+{
+	void ReadingsWriter::digital(int index, const char *name, bool level)
+	{
+		if (_points & (1u << index))
+		{
+			_writer.add(name, level ? "High" : "Low");
+		}
+	}
+
+	void ReadingsWriter::analog(int index, const char *name, float level)
+	{
+		if (_points & (1u << (DI_PINS + index)))
+		{
+			_writer.addPrecise(name, level); // as published before the writer
+		}
+	}
+
+	void ReadingsWriter::coil(int index, const char *name, bool level)
+	{
+		if (_points & (1u << (DI_PINS + AI_PINS + index)))
+		{
+			_writer.add(name, level ? "On" : "Off");
+		}
+	}
+}
@@ -0,0 +1,65 @@
+#include <Arduino.h>
+#include "ReconnectBackoff.h"
+
+namespace EDGEBOX
+{
+	static const uint32_t bucketLimits[RECONNECT_BUCKETS - 1] = {1000, 5000, 30000, 120000}; // ms, the last bucket is open
+
+	uint32_t ReconnectBackoff::Lost()
+	{
+		if (!_down)
+		{
+			_down = true;
+			_lostAt = millis();
+			_drops++;
+			_failures = 0;
+		}
+		uint32_t delay = 0; // a transient drop is retried at once
+		if (_failures > 0)
+		{
+			uint32_t ceiling = _minDelay << min((int)_failures - 1, 16);
+			ceiling = min(ceiling, _maxDelay);
+			delay = ceiling / 2 + esp_random() % (ceiling / 2 + 1);
+		}
+		_failures++;
+		_nextDelay = delay;
+		return delay;
+	}
+
+	void ReconnectBackoff::Connected()
+	{
+		_successes++;
+		if (_down)
+		{
+			_down = false;
+			_lastOutage = millis() - _lostAt;
+			_maxOutage = max(_maxOutage, _lastOutage);
+			int bucket = 0;
+			while (bucket < RECONNECT_BUCKETS - 1 && _lastOutage >= bucketLimits[bucket])
+			{
+				bucket++;
+			}
+			_histogram[bucket]++;
+		}
+		_failures = 0;
+		_nextDelay = 0;
+	}
+
+	void ReconnectBackoff::getStatistics(JsonObject &stats)
+	{
+		stats["connected"] = !_down;
+		stats["drops"] = _drops;
+		stats["attempts"] = _attempts;
+		stats["successes"] = _successes;
+		stats["failures"] = _failures;
+		stats["next_delay_ms"] = _nextDelay;
+		stats["last_outage_ms"] = _lastOutage;
+		stats["max_outage_ms"] = _maxOutage;
+		JsonObject histogram = stats["outage_histogram"].to<JsonObject>();
+		histogram["<1s"] = _histogram[0];
+		histogram["<5s"] = _histogram[1];
+		histogram["<30s"] = _histogram[2];
+		histogram["<120s"] = _histogram[3];
+		histogram[">=120s"] = _histogram[4];
+	}
+}
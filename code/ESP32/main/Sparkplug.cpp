@@ -0,0 +1,298 @@
+#define LOG_MODULE MQTT
+#include <Arduino.h>
+#include <sys/time.h>
+#include <string>
+#include "Log.h"
+#include "Sparkplug.h"
+
+namespace EDGEBOX
+{
+	// protobuf wire types
+	static const uint8_t WIRE_VARINT = 0;
+	static const uint8_t WIRE_64BIT = 1;
+	static const uint8_t WIRE_LENGTH = 2;
+	static const uint8_t WIRE_32BIT = 5;
+
+	// Payload and Metric field numbers
+	static const uint8_t PAYLOAD_TIMESTAMP = 1;
+	static const uint8_t PAYLOAD_METRICS = 2;
+	static const uint8_t PAYLOAD_SEQ = 3;
+	static const uint8_t METRIC_NAME = 1;
+	static const uint8_t METRIC_ALIAS = 2;
+	static const uint8_t METRIC_DATATYPE = 4;
+	static const uint8_t METRIC_INT = 10;
+	static const uint8_t METRIC_LONG = 11;
+	static const uint8_t METRIC_FLOAT = 12;
+	static const uint8_t METRIC_DOUBLE = 13;
+	static const uint8_t METRIC_BOOLEAN = 14;
+	static const uint8_t METRIC_STRING = 15;
+
+	static inline uint8_t tag(uint8_t field, uint8_t wire)
+	{
+		return (field << 3) | wire;
+	}
+
+	uint64_t SparkplugPayload::Now()
+	{
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	}
+
+	size_t SparkplugPayload::putVarint(uint8_t *buf, uint64_t value)
+	{
+		size_t len = 0;
+		do
+		{
+			uint8_t b = value & 0x7F;
+			value >>= 7;
+			buf[len++] = value ? (b | 0x80) : b;
+		} while (value);
+		return len;
+	}
+
+	void SparkplugPayload::put(const uint8_t *data, size_t len)
+	{
+		if (_len + len > _size)
+		{
+			_overflow = true;
+			return;
+		}
+		memcpy(_buffer + _len, data, len);
+		_len += len;
+	}
+
+	void SparkplugPayload::begin(uint64_t timestamp)
+	{
+		_len = 0;
+		_overflow = false;
+		uint8_t buf[11];
+		buf[0] = tag(PAYLOAD_TIMESTAMP, WIRE_VARINT);
+		put(buf, 1 + putVarint(buf + 1, timestamp));
+	}
+
+	void SparkplugPayload::seq(uint8_t seq)
+	{
+		uint8_t buf[3];
+		buf[0] = tag(PAYLOAD_SEQ, WIRE_VARINT);
+		put(buf, 1 + putVarint(buf + 1, seq));
+	}
+
+	void SparkplugPayload::addMetric(const char *name, uint16_t alias, SparkplugDataType type, const uint8_t *value, size_t valueLen)
+	{
+		uint8_t metric[SPARKPLUG_METRIC_MAX];
+		size_t len = 0;
+		size_t nameLen = name != nullptr ? strlen(name) : 0;
+		if (nameLen + valueLen + 16 > sizeof(metric))
+		{
+			_overflow = true;
+			return;
+		}
+		if (nameLen > 0)
+		{
+			metric[len++] = tag(METRIC_NAME, WIRE_LENGTH);
+			len += putVarint(metric + len, nameLen);
+			memcpy(metric + len, name, nameLen);
+			len += nameLen;
+		}
+		if (alias != 0)
+		{
+			metric[len++] = tag(METRIC_ALIAS, WIRE_VARINT);
+			len += putVarint(metric + len, alias);
+		}
+		if (nameLen > 0)
+		{
+			metric[len++] = tag(METRIC_DATATYPE, WIRE_VARINT); // births carry the type, data messages rely on the alias
+			len += putVarint(metric + len, type);
+		}
+		memcpy(metric + len, value, valueLen);
+		len += valueLen;
+		uint8_t head[4];
+		head[0] = tag(PAYLOAD_METRICS, WIRE_LENGTH);
+		put(head, 1 + putVarint(head + 1, len));
+		put(metric, len);
+	}
+
+	void SparkplugPayload::addBool(const char *name, uint16_t alias, bool value)
+	{
+		uint8_t v[2] = {tag(METRIC_BOOLEAN, WIRE_VARINT), value ? (uint8_t)1 : (uint8_t)0};
+		addMetric(name, alias, SpBoolean, v, sizeof(v));
+	}
+
+	void SparkplugPayload::addFloat(const char *name, uint16_t alias, float value)
+	{
+		uint8_t v[5];
+		v[0] = tag(METRIC_FLOAT, WIRE_32BIT);
+		memcpy(v + 1, &value, sizeof(value)); // little endian like protobuf
+		addMetric(name, alias, SpFloat, v, sizeof(v));
+	}
+
+	void SparkplugPayload::addUInt64(const char *name, uint16_t alias, uint64_t value)
+	{
+		uint8_t v[11];
+		v[0] = tag(METRIC_LONG, WIRE_VARINT);
+		addMetric(name, alias, SpUInt64, v, 1 + putVarint(v + 1, value));
+	}
+
+	void SparkplugPayload::addString(const char *name, uint16_t alias, const char *value)
+	{
+		uint8_t v[SPARKPLUG_METRIC_MAX / 2];
+		size_t len = strlen(value);
+		if (len + 4 > sizeof(v))
+		{
+			_overflow = true;
+			return;
+		}
+		v[0] = tag(METRIC_STRING, WIRE_LENGTH);
+		size_t n = 1 + putVarint(v + 1, len);
+		memcpy(v + n, value, len);
+		addMetric(name, alias, SpString, v, n + len);
+	}
+
+	static bool getVarint(const uint8_t *&p, const uint8_t *end, uint64_t &value)
+	{
+		value = 0;
+		for (int shift = 0; shift < 64 && p < end; shift += 7)
+		{
+			uint8_t b = *p++;
+			value |= (uint64_t)(b & 0x7F) << shift;
+			if ((b & 0x80) == 0)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// skips a field of the given wire type, false if the payload is malformed
+	static bool skipField(const uint8_t *&p, const uint8_t *end, uint8_t wire)
+	{
+		uint64_t v;
+		switch (wire)
+		{
+		case WIRE_VARINT:
+			return getVarint(p, end, v);
+		case WIRE_64BIT:
+			p += 8;
+			return p <= end;
+		case WIRE_LENGTH:
+			if (!getVarint(p, end, v) || v > (uint64_t)(end - p))
+			{
+				return false;
+			}
+			p += v;
+			return true;
+		case WIRE_32BIT:
+			p += 4;
+			return p <= end;
+		default:
+			return false;
+		}
+	}
+
+	static bool decodeMetric(const uint8_t *p, const uint8_t *end, JsonObject metric)
+	{
+		while (p < end)
+		{
+			uint64_t key;
+			if (!getVarint(p, end, key))
+			{
+				return false;
+			}
+			uint8_t field = key >> 3;
+			uint8_t wire = key & 0x07;
+			uint64_t v;
+			if (field == METRIC_NAME && wire == WIRE_LENGTH)
+			{
+				if (!getVarint(p, end, v) || v > (uint64_t)(end - p))
+				{
+					return false;
+				}
+				metric["name"] = std::string((const char *)p, v);
+				p += v;
+			}
+			else if (field == METRIC_STRING && wire == WIRE_LENGTH)
+			{
+				if (!getVarint(p, end, v) || v > (uint64_t)(end - p))
+				{
+					return false;
+				}
+				metric["value"] = std::string((const char *)p, v);
+				p += v;
+			}
+			else if ((field == METRIC_ALIAS || field == METRIC_INT || field == METRIC_LONG || field == METRIC_BOOLEAN) && wire == WIRE_VARINT)
+			{
+				if (!getVarint(p, end, v))
+				{
+					return false;
+				}
+				if (field == METRIC_ALIAS)
+				{
+					metric["alias"] = v;
+				}
+				else if (field == METRIC_BOOLEAN)
+				{
+					metric["value"] = v != 0;
+				}
+				else
+				{
+					metric["value"] = v;
+				}
+			}
+			else if (field == METRIC_FLOAT && wire == WIRE_32BIT && end - p >= 4)
+			{
+				float f;
+				memcpy(&f, p, sizeof(f));
+				metric["value"] = f;
+				p += 4;
+			}
+			else if (field == METRIC_DOUBLE && wire == WIRE_64BIT && end - p >= 8)
+			{
+				double d;
+				memcpy(&d, p, sizeof(d));
+				metric["value"] = d;
+				p += 8;
+			}
+			else if (!skipField(p, end, wire))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool SparkplugPayload::Decode(const uint8_t *data, size_t len, JsonDocument &doc)
+	{
+		const uint8_t *p = data;
+		const uint8_t *end = data + len;
+		JsonArray metrics = doc["metrics"].to<JsonArray>();
+		while (p < end)
+		{
+			uint64_t key;
+			if (!getVarint(p, end, key))
+			{
+				return false;
+			}
+			uint8_t field = key >> 3;
+			uint8_t wire = key & 0x07;
+			if (field == PAYLOAD_METRICS && wire == WIRE_LENGTH)
+			{
+				uint64_t v;
+				if (!getVarint(p, end, v) || v > (uint64_t)(end - p))
+				{
+					return false;
+				}
+				if (!decodeMetric(p, p + v, metrics.add<JsonObject>()))
+				{
+					return false;
+				}
+				p += v;
+			}
+			else if (!skipField(p, end, wire))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+}
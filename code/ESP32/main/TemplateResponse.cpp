@@ -0,0 +1,146 @@
+#define LOG_MODULE IOT
+#include <Arduino.h>
+#include "Log.h"
+#include "TemplateResponse.h"
+
+namespace EDGEBOX
+{
+	void TemplateResponse::add(const char *tmpl, TemplateResolver resolver)
+	{
+		_segments.push_back({tmpl, resolver});
+	}
+
+	void TemplateResponse::push(const char *tmpl, TemplateResolver resolver, TemplateListResolver listResolver, uint16_t count)
+	{
+		if (_depth >= TEMPLATE_DEPTH)
+		{
+			loge("Template nesting deeper than %d", TEMPLATE_DEPTH);
+			return;
+		}
+		Frame &f = _stack[_depth++];
+		f.start = tmpl;
+		f.pos = tmpl;
+		f.resolver = resolver;
+		f.listResolver = listResolver;
+		f.index = 0;
+		f.count = count;
+	}
+
+	bool TemplateResponse::resolve(const char *key, TemplateValue &value)
+	{
+		for (int d = _depth - 1; d >= 0; d--)
+		{
+			Frame &f = _stack[d];
+			if ((f.listResolver && f.listResolver(f.index, key, value)) || (f.resolver && f.resolver(key, value)))
+			{
+				return true;
+			}
+		}
+		for (auto &r : _resolvers)
+		{
+			if (r(key, value))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	size_t TemplateResponse::fill(uint8_t *buffer, size_t maxLen)
+	{
+		size_t len = 0;
+		while (len < maxLen)
+		{
+			if (_pendingPos < _pending.length())
+			{
+				size_t n = min(maxLen - len, _pending.length() - _pendingPos);
+				memcpy(buffer + len, _pending.c_str() + _pendingPos, n);
+				_pendingPos += n;
+				len += n;
+				continue;
+			}
+			if (_depth == 0)
+			{
+				if (_segment >= _segments.size())
+				{
+					break; // done
+				}
+				Segment &s = _segments[_segment++];
+				push(s.tmpl, s.resolver, nullptr, 1);
+				continue;
+			}
+			Frame &f = _stack[_depth - 1];
+			if (*f.pos == 0)
+			{
+				if (++f.index < f.count)
+				{
+					f.pos = f.start; // next element of a list
+				}
+				else
+				{
+					_depth--;
+				}
+				continue;
+			}
+			if (*f.pos == '{')
+			{
+				const char *end = f.pos + 1;
+				while (isalnum(*end) || *end == '_')
+				{
+					end++;
+				}
+				size_t keyLen = end - f.pos - 1;
+				if (*end == '}' && keyLen > 0 && keyLen < TEMPLATE_KEY_MAX)
+				{
+					char key[TEMPLATE_KEY_MAX];
+					memcpy(key, f.pos + 1, keyLen);
+					key[keyLen] = 0;
+					TemplateValue value;
+					if (resolve(key, value))
+					{
+						f.pos = end + 1;
+						if (value._nested != nullptr)
+						{
+							if (value._count > 0)
+							{
+								push(value._nested, nullptr, value._resolver, value._count);
+							}
+						}
+						else
+						{
+							_pending = std::move(value._text);
+							_pendingPos = 0;
+						}
+						continue;
+					}
+				}
+			}
+			// literal text up to the next brace
+			size_t n = 1;
+			while (f.pos[n] != 0 && f.pos[n] != '{' && len + n < maxLen)
+			{
+				n++;
+			}
+			memcpy(buffer + len, f.pos, n);
+			f.pos += n;
+			len += n;
+		}
+		if (len > 0 && _chunks++ == 0)
+		{
+			_firstByte = micros() - _started;
+		}
+		_bytes += len;
+		if (len == 0)
+		{
+			logd("Page sent: %d bytes in %d chunks, first byte after %dus, total %dus", _bytes, _chunks, _firstByte, micros() - _started);
+		}
+		return len;
+	}
+
+	void TemplateResponse::send(AsyncWebServerRequest *request, std::shared_ptr<TemplateResponse> page)
+	{
+		AsyncWebServerResponse *response = request->beginChunkedResponse("text/html", [page](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+																		 { return page->fill(buffer, maxLen); });
+		request->send(response);
+	}
+}
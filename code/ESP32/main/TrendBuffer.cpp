@@ -0,0 +1,90 @@
+#define LOG_MODULE PLC
+#include <Arduino.h>
+#include "Log.h"
+#include "TrendBuffer.h"
+
+namespace EDGEBOX
+{
+	void TrendBuffer::begin(uint16_t capacity, uint32_t interval)
+	{
+		_samples.assign(capacity, 0);
+		_head = 0;
+		_count = 0;
+		_interval = interval;
+	}
+
+	void TrendBuffer::Push(int16_t value)
+	{
+		if (_samples.empty())
+		{
+			return;
+		}
+		_samples[_head] = value;
+		_head = (_head + 1) % _samples.size();
+		if (_count < _samples.size())
+		{
+			_count++;
+		}
+	}
+
+	int16_t TrendBuffer::at(uint16_t index)
+	{
+		return _samples[(_head + _samples.size() - _count + index) % _samples.size()];
+	}
+
+	void TrendBuffer::Downsample(uint16_t width, std::vector<uint16_t> &indexes)
+	{
+		indexes.clear();
+		if (width >= _count || width < 3)
+		{
+			indexes.reserve(_count);
+			for (uint16_t i = 0; i < _count; i++)
+			{
+				indexes.push_back(i);
+			}
+			return;
+		}
+		indexes.reserve(width);
+		indexes.push_back(0);
+		// the samples between the first and the last fall in width - 2 buckets
+		float bucket = (float)(_count - 2) / (width - 2);
+		uint16_t picked = 0;
+		for (uint16_t b = 0; b < width - 2; b++)
+		{
+			uint16_t start = (uint16_t)(b * bucket) + 1;
+			uint16_t end = (uint16_t)((b + 1) * bucket) + 1;
+			// average of the next bucket, the last sample for the last bucket
+			uint16_t nextStart = end;
+			uint16_t nextEnd = b + 2 < width - 2 ? (uint16_t)((b + 2) * bucket) + 1 : _count;
+			if (nextEnd > _count)
+			{
+				nextEnd = _count;
+			}
+			float avgX = 0;
+			float avgY = 0;
+			for (uint16_t i = nextStart; i < nextEnd; i++)
+			{
+				avgX += i;
+				avgY += at(i);
+			}
+			avgX /= nextEnd - nextStart;
+			avgY /= nextEnd - nextStart;
+			float pickedY = at(picked);
+			float largest = -1;
+			uint16_t best = start;
+			for (uint16_t i = start; i < end; i++)
+			{
+				// twice the triangle area, the x axis is the sample index
+				float area = fabsf((picked - avgX) * (at(i) - pickedY) - (picked - i) * (avgY - pickedY));
+				if (area > largest)
+				{
+					largest = area;
+					best = i;
+				}
+			}
+			indexes.push_back(best);
+			picked = best;
+		}
+		indexes.push_back(_count - 1);
+	}
+}
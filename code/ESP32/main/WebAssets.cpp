@@ -0,0 +1,69 @@
+#define LOG_MODULE IOT
+#include <Arduino.h>
+#include "Log.h"
+#include "HelperFunctions.h"
+#include "WebAssets.h"
+
+namespace EDGEBOX
+{
+	WebAssets::Asset WebAssets::_assets[WEB_ASSETS];
+	uint8_t WebAssets::_count = 0;
+
+	bool WebAssets::serve(AsyncWebServer *server, const char *uri, const char *contentType, const uint8_t *start, const uint8_t *end)
+	{
+		if (_count >= WEB_ASSETS)
+		{
+			loge("No room for the %s web asset", uri);
+			return false;
+		}
+		Asset &asset = _assets[_count++];
+		asset.uri = uri;
+		asset.contentType = contentType;
+		asset.data = start;
+		asset.len = end - start;
+		snprintf(asset.etag, sizeof(asset.etag), "\"%08x\"", (unsigned)fnv1a(FNV_OFFSET_BASIS, start, asset.len));
+		server->on(uri, HTTP_GET, [&asset](AsyncWebServerRequest *request)
+				   { send(request, asset); });
+		return true;
+	}
+
+	void WebAssets::send(AsyncWebServerRequest *request, Asset &asset)
+	{
+		asset.requests++;
+		const AsyncWebHeader *match = request->getHeader("If-None-Match");
+		bool cached = match != nullptr && match->value() == asset.etag;
+		AsyncWebServerResponse *response;
+		if (cached)
+		{
+			asset.notModified++;
+			response = request->beginResponse(304);
+		}
+		else
+		{
+			asset.bytesSent += asset.len;
+			response = request->beginResponse(200, asset.contentType, asset.data, asset.len);
+			response->addHeader("Content-Encoding", "gzip");
+		}
+		response->addHeader("ETag", asset.etag);
+		response->addHeader("Cache-Control", "no-cache"); // always revalidate, a firmware update may change the file
+		request->send(response);
+		logd("%s %s", asset.uri, cached ? "not modified" : "sent");
+	}
+
+	void WebAssets::getStatistics(JsonObject &stats)
+	{
+		for (uint8_t i = 0; i < _count; i++)
+		{
+			Asset &asset = _assets[i];
+			JsonObject a = stats[asset.uri].to<JsonObject>();
+			// gzip ends with the uncompressed size, little endian
+			const uint8_t *isize = asset.data + asset.len - 4;
+			a["size"] = isize[0] | isize[1] << 8 | isize[2] << 16 | (uint32_t)isize[3] << 24;
+			a["gzip_size"] = asset.len;
+			a["etag"] = asset.etag;
+			a["requests"] = asset.requests;
+			a["not_modified"] = asset.notModified;
+			a["bytes_sent"] = asset.bytesSent;
+		}
+	}
+}
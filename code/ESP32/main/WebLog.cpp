@@ -1,95 +1,394 @@
+#define LOG_MODULE IOT
+#include <mutex>
 #include "Log.h"
 #include "WebLog.h"
+#include "WebAssets.h"
+#include "WebSocketHub.h"
+#include "LogRing.h"
 
-static AsyncWebSocket _webSocket("/ws_log");
+WEB_ASSET(log_html_gz)
+
+static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0 && (LOG_HISTORY_SIZE & (LOG_HISTORY_SIZE - 1)) == 0, "log rings must be a power of two");
+
+static EDGEBOX::WebSocketHub _logHub("/ws_log");
+static uint8_t _ringBuffer[LOG_RING_SIZE];
+static EDGEBOX::LogRing _logRing(_ringBuffer, LOG_RING_SIZE);
+static uint8_t _historyBuffer[LOG_HISTORY_SIZE];
+static EDGEBOX::LogRing _history(_historyBuffer, LOG_HISTORY_SIZE); // last records drained, oldest evicted
+static std::mutex _historyLock;
+static TaskHandle_t _drainTask = nullptr;
+static LogSink _sink;
+static volatile bool _sinkSet = false; // _sink is set once, read on the drain task
+static uint32_t _reportedDrops = 0;
+static uint32_t _formatted = 0;
+
+uint8_t log_threshold[LOG_MODULE_COUNT] = {LOG_RUNTIME_LEVEL, LOG_RUNTIME_LEVEL, LOG_RUNTIME_LEVEL, LOG_RUNTIME_LEVEL, LOG_RUNTIME_LEVEL, LOG_RUNTIME_LEVEL};
+static const char *log_module_names[LOG_MODULE_COUNT] = {"PLC", "IOT", "MB", "MQTT", "NET", "MODEM"};
 
 #define BUFFER_SIZE 255
-int weblog_log_printfv(const char *format, va_list arg)
+bool weblog_push(uint8_t level, const void *record, size_t len)
 {
-    static char loc_buf[BUFFER_SIZE];
-    uint32_t len;
-    va_list copy;
-    va_copy(copy, arg);
-    len = vsnprintf(NULL, 0, format, copy);
-    va_end(copy);
-    if (len >= (BUFFER_SIZE - 1))
+    bool pushed = _logRing.Push(level, record, len); // held until the drain task runs
+    if (_drainTask != nullptr)
     {
-        len = BUFFER_SIZE - 5; // truncate log msg
-        vsnprintf(loc_buf, len, format, arg);
-        strcat(loc_buf, "...\n");
+        xTaskNotifyGive(_drainTask);
     }
-    else 
+    return pushed;
+}
+
+int weblog_log_printfv(uint8_t level, const char *format, va_list arg)
+{
+    char loc_buf[BUFFER_SIZE]; // per call, log statements come from several tasks
+    int len = vsnprintf(loc_buf, BUFFER_SIZE, format, arg);
+    if (len < 0)
     {
-        vsnprintf(loc_buf, len + 1, format, arg);
+        return len;
     }
-    if (_webSocket.count() > 0)  {
-        _webSocket.textAll(loc_buf);
+    if (len >= BUFFER_SIZE)
+    {
+        strcpy(loc_buf + BUFFER_SIZE - 5, "...\n"); // truncate log msg
+        len = BUFFER_SIZE - 1;
     }
-    #ifdef LOG_TO_SERIAL_PORT
-    ets_printf("%s", loc_buf);
-    #endif
+    weblog_push(level, loc_buf, len);
     return len;
 }
 
-int weblog(const char *format, ...)
+int weblog(uint8_t level, const char *format, ...)
 {
     int len;
     va_list arg;
     va_start(arg, format);
-    len = weblog_log_printfv(format, arg);
+    len = weblog_log_printfv(level, format, arg);
     va_end(arg);
     return len;
 }
 
-void WebLog::begin(AsyncWebServer *pwebServer)
-{
-    pwebServer->addHandler(&_webSocket).addMiddleware([](AsyncWebServerRequest *request, ArMiddlewareNext next)
-                                                      {
-        // ws.count() is the current count of WS clients: this one is trying to upgrade its HTTP connection
-        if (_webSocket.count() > 1) {
-          // if we have 2 clients or more, prevent the next one to connect
-          request->send(503, "text/plain", "Server is busy");
-        } else {
-          // process next middleware and at the end the handler
-          next();
-        } });
-
-    _webSocket.onEvent([](AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
-                       {
-        (void)len;
-    
-        if (type == WS_EVT_CONNECT) {
-            logd("new client connected");
-            client->setCloseClientOnQueueFull(false);
-            client->ping();
-    
-        } else if (type == WS_EVT_DISCONNECT) {
-            logd("ws client disconnect");
-    
-        } else if (type == WS_EVT_ERROR) {
-            loge("ws error");
-    
-        } else if (type == WS_EVT_PONG) {
-            logd("ws pong");
-    
-        } else if (type == WS_EVT_DATA) {
-            AwsFrameInfo *info = (AwsFrameInfo *)arg;
-            logd("index: %" PRIu64 ", len: %" PRIu64 ", final: %" PRIu8 ", opcode: %" PRIu8 "\n", info->index, info->len, info->final, info->opcode);
-            String msg = "";
-            if (info->final && info->index == 0 && info->len == len) {
-                if (info->opcode == WS_TEXT) {
-                    data[len] = 0;
-                    logd("ws text: %s\n", (char *)data);
-                }
+template <typename T>
+static int formatArgument(char *text, size_t size, const char *spec, const int *star, int stars, T value)
+{
+    switch (stars)
+    {
+    case 0:
+        return snprintf(text, size, spec, value);
+    case 1:
+        return snprintf(text, size, spec, star[0], value);
+    default:
+        return snprintf(text, size, spec, star[0], star[1], value);
+    }
+}
+
+// formats a deferred record, a format pointer and argument words, as vsnprintf would have at the call site
+static size_t formatDeferred(const uint32_t *words, size_t count, char *text, size_t size)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    const char *f = (const char *)words[0];
+    size_t w = 1;
+    size_t out = 0;
+    auto next = [&]() -> uint32_t
+    { return w < count ? words[w++] : 0; };
+    while (*f != 0 && out < size - 1)
+    {
+        if (*f != '%')
+        {
+            text[out++] = *f++;
+            continue;
+        }
+        const char *start = f++;
+        int star[2];
+        int stars = 0;
+        int longs = 0;
+        while (*f != 0 && strchr("-+ #0", *f) != nullptr)
+        {
+            f++;
+        }
+        for (bool precision = false;; precision = true)
+        {
+            if (*f == '*')
+            {
+                star[stars++] = (int)next();
+                f++;
+            }
+            while (isdigit(*f))
+            {
+                f++;
+            }
+            if (precision || *f != '.')
+            {
+                break;
+            }
+            f++;
+        }
+        while (*f != 0 && strchr("hlLjzt", *f) != nullptr)
+        {
+            longs += *f == 'l' || *f == 'j' ? 1 : 0; // size_t and ptrdiff_t are one word
+            f++;
+        }
+        char conversion = *f;
+        if (conversion != 0)
+        {
+            f++;
+        }
+        char spec[16];
+        size_t specLen = min((size_t)(f - start), sizeof(spec) - 1);
+        memcpy(spec, start, specLen);
+        spec[specLen] = 0;
+        char *dest = text + out;
+        size_t room = size - out;
+        int n = 0;
+        switch (conversion)
+        {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        case 'c':
+            if (longs >= 2)
+            {
+                uint64_t low = next();
+                n = formatArgument(dest, room, spec, star, stars, (long long)(low | (uint64_t)next() << 32));
+            }
+            else
+            {
+                n = formatArgument(dest, room, spec, star, stars, (int)next());
+            }
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+        {
+            uint64_t bits = next();
+            bits |= (uint64_t)next() << 32;
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            n = formatArgument(dest, room, spec, star, stars, value);
+            break;
+        }
+        case 's':
+        {
+            uint32_t word = next();
+            char inlined[LOG_STRING_MAX + 1];
+            const char *value = (const char *)word;
+            if (word & LOG_INLINE_STRING)
+            {
+                size_t len = min((size_t)(word & ~LOG_INLINE_STRING), (size_t)LOG_STRING_MAX);
+                size_t available = (count - w) * sizeof(uint32_t);
+                len = min(len, available);
+                memcpy(inlined, words + w, len);
+                inlined[len] = 0;
+                w += (len + 3) / 4;
+                value = inlined;
+            }
+            n = formatArgument(dest, room, spec, star, stars, value);
+            break;
+        }
+        case 'p':
+            n = formatArgument(dest, room, spec, star, stars, (void *)(uintptr_t)next());
+            break;
+        case 'n':
+            break;
+        case '%':
+            n = snprintf(dest, room, "%%");
+            break;
+        default:
+            n = snprintf(dest, room, "%s", spec); // unknown, copied as is
+            break;
+        }
+        if (n < 0)
+        {
+            break;
+        }
+        out += min((size_t)n, room - 1);
+    }
+    text[out] = 0;
+    return out;
+}
+
+// a drained record as text, into text when it must be formatted
+static size_t recordText(uint8_t level, const uint32_t *record, size_t len, char *text, size_t size, const char *&result)
+{
+    if ((level & LOG_DEFERRED_RECORD) == 0)
+    {
+        result = (const char *)record;
+        return len;
+    }
+    _formatted++;
+    result = text;
+    return formatDeferred(record, len / sizeof(uint32_t), text, size);
+}
+
+static void sink(uint8_t level, const uint32_t *record, size_t len)
+{
+    {
+        std::lock_guard<std::mutex> lock(_historyLock);
+        while (!_history.Push(level, record, len) && _history.Skip())
+        {
+        }
+    }
+    bool toMqtt = (level & ~LOG_DEFERRED_RECORD) <= LOG_MQTT_LEVEL && _sinkSet;
+    bool toWeb = _logHub.count() > 0;
+#ifdef LOG_TO_SERIAL_PORT
+    bool toSerial = true;
+#else
+    bool toSerial = false;
+#endif
+    if (!toMqtt && !toWeb && !toSerial)
+    {
+        return; // a deferred record stays unformatted
+    }
+    char formatted[BUFFER_SIZE];
+    const char *text;
+    len = recordText(level, record, len, formatted, sizeof(formatted), text);
+    if (toSerial)
+    {
+        ets_printf("%s", text);
+    }
+    if (toWeb)
+    {
+        _logHub.Stream(text, len);
+    }
+    if (toMqtt)
+    {
+        _sink(text, len);
+    }
+}
+
+static void replay(AsyncWebSocketClient *client)
+{
+    auto buffer = std::make_shared<std::vector<uint8_t>>();
+    uint32_t record[BUFFER_SIZE / sizeof(uint32_t) + 1];
+    char formatted[BUFFER_SIZE];
+    uint8_t level;
+    size_t len;
+    std::lock_guard<std::mutex> lock(_historyLock);
+    buffer->reserve(_history.used());
+    for (uint32_t cursor = _history.begin(); (len = _history.Peek(cursor, level, record, sizeof(record))) > 0;)
+    {
+        const char *text;
+        len = recordText(level, record, len, formatted, sizeof(formatted), text);
+        buffer->insert(buffer->end(), text, text + len);
+    }
+    if (!buffer->empty())
+    {
+        client->text(buffer);
+    }
+}
+
+static void drain(void *)
+{
+    uint32_t record[BUFFER_SIZE / sizeof(uint32_t) + 1]; // word aligned for deferred records
+    uint8_t level;
+    size_t len;
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOG_DRAIN_INTERVAL));
+        _logHub.Replay();
+        while ((len = _logRing.Pop(level, record, sizeof(record))) > 0)
+        {
+            sink(level, record, len);
+        }
+        uint32_t dropped = _logRing.dropped();
+        if (dropped != _reportedDrops)
+        {
+            len = snprintf((char *)record, sizeof(record), "... %u log records dropped\r\n", dropped - _reportedDrops);
+            _reportedDrops = dropped;
+            sink(ARDUHAL_LOG_LEVEL_WARN, record, len);
+        }
+    }
+}
+
+void WebLog::start()
+{
+    if (_drainTask == nullptr)
+    {
+        _logHub.onReplay(replay);
+        xTaskCreate(drain, "weblog", LOG_DRAIN_STACK, nullptr, LOG_DRAIN_PRIORITY, &_drainTask);
+    }
+}
+
+void WebLog::setSink(LogSink sink)
+{
+    if (!_sinkSet)
+    {
+        _sink = sink;
+        _sinkSet = true;
+    }
+}
+
+void WebLog::getStatistics(JsonObject &stats)
+{
+#ifdef LOG_DEFERRED
+    stats["deferred"] = true;
+#else
+    stats["deferred"] = false;
+#endif
+    stats["pushed"] = _logRing.pushed();
+    stats["dropped"] = _logRing.dropped();
+    stats["formatted"] = _formatted; // deferred records formatted on the drain task
+    stats["ring_used"] = _logRing.used();
+    stats["ring_high_water"] = _logRing.highWater();
+    stats["ring_size"] = LOG_RING_SIZE;
+    stats["history"] = _history.used();
+}
+
+void WebLog::begin(AsyncWebServer *pwebServer, AsyncMiddleware *auth)
+{
+    _logHub.begin(pwebServer);
+    EDGEBOX::WebAssets::serve(pwebServer, "/log", "text/html", log_html_gz_start, log_html_gz_end);
+    pwebServer->on("/log_dump", HTTP_GET, [](AsyncWebServerRequest *request)
+                   {
+        // the history as raw records for tools/decode_log.py, deferred ones are formatted there with the firmware ELF
+        auto dump = std::make_shared<std::vector<uint8_t>>(LOG_DUMP_MAGIC, LOG_DUMP_MAGIC + 4);
+        uint8_t record[BUFFER_SIZE + 1];
+        uint8_t level;
+        size_t len;
+        {
+            std::lock_guard<std::mutex> lock(_historyLock);
+            dump->reserve(4 + _history.used());
+            for (uint32_t cursor = _history.begin(); (len = _history.Peek(cursor, level, record, sizeof(record))) > 0;) {
+                uint8_t header[3] = {level, (uint8_t)(len & 0xFF), (uint8_t)(len >> 8)};
+                dump->insert(dump->end(), header, header + sizeof(header));
+                dump->insert(dump->end(), record, record + len);
             }
-        } });
-    pwebServer->on("/log", HTTP_GET, [](AsyncWebServerRequest *request)
-                   { request->send(200, "text/html", web_serial_html); });
+        }
+        AsyncWebServerResponse *response = request->beginResponse("application/octet-stream", dump->size(), [dump](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+                                                                  {
+            size_t n = min(maxLen, dump->size() - index);
+            memcpy(buffer, dump->data() + index, n);
+            return n; });
+        response->addHeader("Content-Disposition", "attachment; filename=\"log.bin\"");
+        request->send(response); });
+    pwebServer->on("/log_levels", HTTP_GET, [](AsyncWebServerRequest *request)
+                   {
+        JsonDocument doc;
+        JsonObject levels = doc.to<JsonObject>();
+        getLevels(levels);
+        String s;
+        serializeJson(doc, s);
+        request->send(200, "application/json", s); });
+    pwebServer->on("/log_levels", HTTP_POST, [](AsyncWebServerRequest *request)
+                   {
+        if (!request->hasParam("module", true) || !request->hasParam("level", true)
+            || !setLevel(request->getParam("module", true)->value().c_str(), request->getParam("level", true)->value().toInt())) {
+            request->send(400, "text/plain", "Invalid module or level");
+            return;
+        }
+        request->send(200, "text/plain", "OK"); })
+        .addMiddleware(auth); // a VERBOSE module floods the log ring and the MQTT sink
 }
 
 void WebLog::end()
 {
-    _webSocket.closeAll();
+    _logHub.closeAll();
 }
 
 void WebLog::process()
@@ -98,7 +397,44 @@ void WebLog::process()
     if (now - _lastHeap >= 2000)
     {
         _lastHeap = now;
-        // cleanup disconnected clients or too many clients
-        _webSocket.cleanupClients();
+        // cleanup disconnected clients
+        _logHub.CleanUp();
+    }
+}
+
+bool WebLog::setLevel(const char *module, int level)
+{
+    if (level < ARDUHAL_LOG_LEVEL_NONE || level > ARDUHAL_LOG_LEVEL_VERBOSE)
+    {
+        return false;
+    }
+    for (int i = 0; i < LOG_MODULE_COUNT; i++)
+    {
+        if (strcasecmp(module, log_module_names[i]) == 0)
+        {
+            log_threshold[i] = level;
+            logi("Log level of %s set to %d", log_module_names[i], level);
+            return true;
+        }
+    }
+    return false;
+}
+
+void WebLog::setLevels(JsonObject levels)
+{
+    for (JsonPair kv : levels)
+    {
+        if (!setLevel(kv.key().c_str(), kv.value().as<int>()))
+        {
+            logw("Invalid log level %s: %d", kv.key().c_str(), kv.value().as<int>());
+        }
+    }
+}
+
+void WebLog::getLevels(JsonObject &levels)
+{
+    for (int i = 0; i < LOG_MODULE_COUNT; i++)
+    {
+        levels[log_module_names[i]] = log_threshold[i];
     }
 }
@@ -0,0 +1,318 @@
+#define LOG_MODULE IOT
+#include <Arduino.h>
+#include "Log.h"
+#include "WebSocketHub.h"
+
+namespace EDGEBOX
+{
+	WebSocketHub *WebSocketHub::_hubs[WS_HUBS] = {};
+
+	void WebSocketHub::begin(AsyncWebServer *server, WsSerializer serializer, WsPointIndex pointIndex)
+	{
+		_serializer = serializer;
+		_pointIndex = pointIndex;
+		for (auto &hub : _hubs)
+		{
+			if (hub == nullptr)
+			{
+				hub = this;
+				break;
+			}
+		}
+		server->addHandler(&_ws).addMiddleware([this](AsyncWebServerRequest *request, ArMiddlewareNext next)
+											   {
+			// runs before the upgrade, count() holds the clients already connected
+			if (_ws.count() >= WS_MAX_CLIENTS) {
+				_rejected++;
+				request->send(503, "text/plain", "Server is busy");
+			} else {
+				next();
+			} });
+		_ws.onEvent([this](AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
+					{ onEvent(client, type, arg, data, len); });
+	}
+
+	WebSocketHub::Slot *WebSocketHub::slot(uint32_t id)
+	{
+		for (auto &s : _slots)
+		{
+			if (s.id == id)
+			{
+				return &s;
+			}
+		}
+		return nullptr;
+	}
+
+	void WebSocketHub::onEvent(AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
+	{
+		if (type == WS_EVT_CONNECT)
+		{
+			Slot *s = slot(0);
+			if (s == nullptr)
+			{
+				_rejected++;
+				client->close();
+				return;
+			}
+			s->points = WS_ALL_POINTS;
+			s->binary = false;
+			s->synced = false;
+			s->pending = _serializer != nullptr || _replay != nullptr; // the current state or the replay, then changes
+			s->id = client->id();
+			client->setCloseClientOnQueueFull(false); // the hub keeps the queue short
+			client->ping();
+			logd("%s client %d connected", _ws.url(), client->id());
+		}
+		else if (type == WS_EVT_DISCONNECT)
+		{
+			Slot *s = slot(client->id());
+			if (s != nullptr)
+			{
+				s->pending = false;
+				s->id = 0;
+			}
+			logd("%s client %d disconnected", _ws.url(), client->id());
+		}
+		else if (type == WS_EVT_ERROR)
+		{
+			loge("ws error");
+		}
+		else if (type == WS_EVT_DATA)
+		{
+			AwsFrameInfo *info = (AwsFrameInfo *)arg;
+			Slot *s = slot(client->id());
+			if (s != nullptr && _pointIndex && info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT)
+			{
+				Subscribe(*s, data, len);
+			}
+		}
+	}
+
+	void WebSocketHub::Subscribe(Slot &slot, const uint8_t *data, size_t len)
+	{
+		JsonDocument doc;
+		if (deserializeJson(doc, data, len) != DeserializationError::Ok || !(doc["subscribe"].is<JsonArrayConst>() || doc["binary"].is<bool>()))
+		{
+			logw("%s expects {\"subscribe\":[points],\"binary\":false}", _ws.url());
+			return;
+		}
+		if (doc["subscribe"].is<JsonArrayConst>())
+		{
+			uint32_t points = 0;
+			for (JsonVariantConst name : doc["subscribe"].as<JsonArrayConst>())
+			{
+				int index = name.is<const char *>() ? _pointIndex(name.as<const char *>()) : -1;
+				if (index >= 0 && index < 32)
+				{
+					points |= 1u << index;
+				}
+			}
+			slot.points = points == 0 ? WS_ALL_POINTS : points;
+		}
+		if (doc["binary"].is<bool>())
+		{
+			slot.binary = doc["binary"].as<bool>();
+		}
+		slot.schema = slot.binary; // the subscribed points may differ
+		slot.synced = false;
+		slot.pending = true;
+	}
+
+	void WebSocketHub::Stream(const char *text, size_t len)
+	{
+		AsyncWebSocketSharedBuffer buffer;
+		// the slots, not _ws.getClients(): the client list changes on async_tcp, client() looks up under the library lock
+		for (auto &s : _slots)
+		{
+			if (s.id == 0 || s.pending)
+			{
+				continue; // free, or waiting for its replay
+			}
+			AsyncWebSocketClient *client = _ws.client(s.id);
+			if (client == nullptr || client->status() != WS_CONNECTED)
+			{
+				continue;
+			}
+			if (client->queueLen() >= WS_CLIENT_QUEUE)
+			{
+				_dropped++;
+				continue;
+			}
+			if (!buffer)
+			{
+				buffer = std::make_shared<std::vector<uint8_t>>((const uint8_t *)text, (const uint8_t *)text + len);
+				_serialized++;
+			}
+			client->text(buffer);
+			_frames[FrameText]++;
+			_bytes[FrameText] += len;
+		}
+	}
+
+	void WebSocketHub::Replay()
+	{
+		if (!_replay)
+		{
+			return;
+		}
+		for (auto &s : _slots)
+		{
+			if (s.id == 0 || !s.pending)
+			{
+				continue;
+			}
+			AsyncWebSocketClient *client = _ws.client(s.id);
+			if (client != nullptr && client->status() == WS_CONNECTED)
+			{
+				_replay(client);
+			}
+			s.pending = false;
+		}
+	}
+
+	void WebSocketHub::Changed(uint32_t changed)
+	{
+		_messageCount = 0;
+		_changed = changed;
+		for (auto &s : _slots)
+		{
+			if (s.id != 0)
+			{
+				if (s.pending)
+				{
+					_coalesced++;
+					s.synced = false; // missed a delta
+				}
+				s.pending = true;
+			}
+		}
+		Process();
+	}
+
+	AsyncWebSocketSharedBuffer WebSocketHub::message(DashboardFrame frame, uint32_t points)
+	{
+		for (uint8_t i = 0; i < _messageCount; i++)
+		{
+			if (_messages[i].frame == frame && _messages[i].points == points)
+			{
+				return _messages[i].buffer;
+			}
+		}
+		uint8_t text[WS_MESSAGE_MAX];
+		size_t len = _serializer(frame, points, text, sizeof(text));
+		if (len == 0)
+		{
+			return nullptr;
+		}
+		if (_messageCount == WS_MAX_CLIENTS)
+		{
+			_messageCount = 0; // subscriptions changed since the last state change
+		}
+		Message &m = _messages[_messageCount++];
+		m.frame = frame;
+		m.points = points;
+		m.buffer = std::make_shared<std::vector<uint8_t>>(text, text + len);
+		_serialized++;
+		return m.buffer;
+	}
+
+	void WebSocketHub::Process()
+	{
+		if (!_serializer)
+		{
+			return;
+		}
+		for (auto &s : _slots)
+		{
+			if (s.id == 0 || !s.pending)
+			{
+				continue;
+			}
+			AsyncWebSocketClient *client = _ws.client(s.id);
+			if (client == nullptr || client->status() != WS_CONNECTED || client->queueLen() >= WS_CLIENT_QUEUE)
+			{
+				continue; // still busy, only the latest state will be sent
+			}
+			if (!s.binary)
+			{
+				send(client, FrameText, s.points);
+			}
+			else
+			{
+				if (s.schema)
+				{
+					send(client, FrameSchema, s.points);
+					s.schema = false;
+					s.synced = false;
+				}
+				if (!s.synced)
+				{
+					send(client, FrameFull, s.points);
+				}
+				else if ((s.points & _changed) != 0)
+				{
+					send(client, FrameDelta, s.points & _changed);
+				}
+			}
+			s.synced = true;
+			s.pending = false;
+		}
+	}
+
+	void WebSocketHub::send(AsyncWebSocketClient *client, DashboardFrame frame, uint32_t points)
+	{
+		AsyncWebSocketSharedBuffer buffer = message(frame, points);
+		if (!buffer)
+		{
+			return;
+		}
+		if (frame == FrameText)
+		{
+			client->text(buffer);
+		}
+		else
+		{
+			client->binary(buffer);
+		}
+		_frames[frame]++;
+		_bytes[frame] += buffer->size();
+	}
+
+	void WebSocketHub::getStatistics(JsonObject &stats)
+	{
+		for (auto hub : _hubs)
+		{
+			if (hub == nullptr)
+			{
+				continue;
+			}
+			JsonObject h = stats[hub->_ws.url()].to<JsonObject>();
+			h["clients"] = hub->_ws.count();
+			h["serialized"] = hub->_serialized;
+			static const char *frameNames[] = {"text", "schema", "full", "delta"};
+			for (int f = FrameText; f <= FrameDelta; f++)
+			{
+				if (hub->_frames[f] > 0)
+				{
+					JsonObject frame = h["frames"][frameNames[f]].to<JsonObject>();
+					frame["count"] = hub->_frames[f];
+					frame["bytes"] = hub->_bytes[f];
+					frame["bytes_per_frame"] = hub->_bytes[f] / hub->_frames[f];
+				}
+			}
+			h["coalesced"] = hub->_coalesced;
+			h["dropped"] = hub->_dropped;
+			h["rejected"] = hub->_rejected;
+			JsonArray queues = h["queues"].to<JsonArray>();
+			for (auto &s : hub->_slots)
+			{
+				AsyncWebSocketClient *client = s.id != 0 ? hub->_ws.client(s.id) : nullptr;
+				if (client != nullptr)
+				{
+					queues.add(client->queueLen());
+				}
+			}
+		}
+	}
+}
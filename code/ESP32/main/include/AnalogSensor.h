@@ -1,7 +1,5 @@
 #pragma once
 #include <Arduino.h>
-#include <sstream> 
-#include <string>
 #include "defines.h"
 
 namespace EDGEBOX
@@ -12,7 +10,7 @@ namespace EDGEBOX
 		
 		AnalogSensor(int channel);
 		~AnalogSensor();
-		std::string Channel();
+		const char *Channel() { return _name; } // built once, safe to keep
 		float Level();
 		void Run();
 		float minV() { return _minV; }
@@ -26,10 +24,11 @@ namespace EDGEBOX
 		void SetMinT(float minT) { _minT = minT; }
 		void SetMaxV(float maxV) { _maxV = maxV; adcReadingMax = maxV * 2635;}
 		void SetMaxT(float maxT) { _maxT = maxT; }
-		void SetChannel(int channel) { _channel = channel; }
+		void SetChannel(int channel) { _channel = channel; snprintf(_name, sizeof(_name), "AI%d", channel); }
 
 	private:
 		int _channel;
+		char _name[12];
 		void AddReading(uint32_t val);
 		uint32_t _rollingSum;
 		int _numberOfSummations;
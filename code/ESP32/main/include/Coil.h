@@ -1,7 +1,5 @@
 #pragma once
 #include <Arduino.h>
-#include <sstream> 
-#include <string>
 #include "defines.h"
 
 namespace EDGEBOX
@@ -12,11 +10,12 @@ namespace EDGEBOX
 		
 		Coil(int sensorPin);
 		~Coil();
-		std::string Pin();
+		const char *Pin() { return _name; } // built once, safe to keep
 		bool Level();
 		void Set(uint8_t state);
 
 	private:
 		int _sensorPin; // Defines the pin that the sensor is connected to
+		char _name[12];
 	};
 }
@@ -0,0 +1,54 @@
+#pragma once
+#include <Arduino.h>
+#include <functional>
+#include <initializer_list>
+#include "mqtt_client.h"
+#include "ArduinoJson.h"
+#include "Defines.h"
+#include "PayloadCodec.h"
+
+namespace EDGEBOX
+{
+	typedef std::function<void(const char *topic, JsonDocument &doc)> CommandHandler;
+
+	// Routes MQTT commands on <prefix>/cmnd/<command> through a hash table built at setup,
+	// each route parses only the fields it registered, an empty payload calls the handler with an empty document.
+	// Messages ESP-MQTT delivers in fragments are reassembled into a fixed buffer of MQTT_COMMAND_MAX,
+	// a message that arrives whole is decoded straight from the ESP-MQTT buffer.
+	// Runs on the MQTT task only, the latency of a route is from the first fragment to the return of its handler.
+	class CommandRouter
+	{
+	public:
+		CommandRouter() {};
+		bool on(const char *command, CommandHandler handler, std::initializer_list<const char *> fields = {});
+		void onOther(CommandHandler handler) { _other = handler; }
+		bool Assemble(esp_mqtt_event_handle_t event, const char *&topic, const uint8_t *&data, size_t &len);
+		void Dispatch(const char *prefix, const char *topic, const uint8_t *data, size_t len, PayloadCodec &codec);
+		void getStatistics(JsonObject &stats);
+
+	private:
+		struct Route
+		{
+			const char *name = nullptr;
+			uint32_t hash = 0;
+			CommandHandler handler;
+			JsonDocument filter;
+			bool filtered = false;
+			uint32_t count = 0;
+			uint32_t lastLatency = 0; // us
+			uint32_t maxLatency = 0;
+		};
+		Route _routes[COMMAND_ROUTES]; // open addressing, COMMAND_ROUTES is a power of two
+		CommandHandler _other;		   // anything without a route, decoded in full
+		Route *find(const char *command);
+		char _topic[STR_LEN * 2];
+		uint8_t _payload[MQTT_COMMAND_MAX];
+		size_t _expected = 0; // total length of the message being reassembled, 0 when idle
+		size_t _received = 0;
+		uint32_t _arrived = 0;
+		uint32_t _fragmented = 0;
+		uint32_t _oversize = 0;
+		uint32_t _invalid = 0;
+		uint32_t _unrouted = 0;
+	};
+}
@@ -6,30 +6,113 @@
 #define WATCHDOG_TIMEOUT 10 // time in seconds to trigger the watchdog reset
 
 #define STR_LEN 64
-#define EEPROM_SIZE 1024
+#define EEPROM_SIZE 4096
 #define AP_BLINK_RATE 600
 #define NC_BLINK_RATE 100
 // #define AP_TIMEOUT 1000
 #define AP_TIMEOUT 30000
 #define FLASHER_TIMEOUT 10000
 #define WS_CLIENT_CLEANUP 5000
+#define WS_MAX_CLIENTS 8 // per WebSocket endpoint
+#define WS_CLIENT_QUEUE 4 // messages queued to a client before it is considered slow
+#define WS_HUBS 2
+#define WS_MESSAGE_MAX READINGS_BUFFER_SIZE // largest state message
+#define LOG_RING_SIZE 8192 // log records waiting for the drain task, a power of two
+#define LOG_HISTORY_SIZE 4096 // last log text replayed to a new /log client
+#define LOG_DRAIN_PRIORITY 1
+#define LOG_DRAIN_STACK 4096
+#define LOG_DRAIN_INTERVAL 250 // ms, longest a new /log client waits for its replay
+#define LOG_DEFERRED_RECORD 0x80 // level flag of a record holding a format pointer and argument words
+#define LOG_DEFERRED_WORDS 32 // largest deferred record, format pointer included
+#define LOG_INLINE_STRING 0x80000000 // string argument word followed by its characters, not a flash pointer
+#define LOG_STRING_MAX 64
+#define LOG_DUMP_MAGIC "ELG1" // /log_dump header, then records of level, length (little endian) and payload
+#define METRICS_PREFIX "edgebox_"
+#define METRICS_CHUNK 4096 // largest metrics group, Prometheus text or JSON
+#define METRICS_LINE 192
+#define METRICS_NAME 96
+#define METRICS_LABELS 128
+#define METRICS_PUBLISH_INTERVAL 60000 // ms between <prefix>/stat/metrics/<group> publishes
 #define WIFI_CONNECTION_TIMEOUT 30000
 #define DEFAULT_AP_PASSWORD "12345678"
 
 #define ADC_Resolution 65536.0
 #define SAMPLESIZE 5
-#define MQTT_PUBLISH_RATE_LIMIT 500 // delay between MQTT publishes
+#define MQTT_PUBLISH_RATE_LIMIT 500 // default ms between MQTT publishes of a topic class
+#define MQTT_PUBLISH_WINDOW 0 // default ms changes are coalesced before publishing
+#define MQTT_PUBLISH_BURST 3 // publishes a topic class may send back to back
+#define MQTT_PUBLISH_BUFFER 512 // largest coalesced payload
+#define MQTT_EDGE_BUFFER 512 // digital edges carried with the readings
+#define MQTT_CONNECT_DELAY 8000 // ms from network up to the first MQTT connect
+#define MQTT_RECONNECT_MIN 1000 // ms backoff after the immediate retry of a dropped connection
+#define MQTT_RECONNECT_MAX 120000 // ms longest wait between reconnect attempts
+#define RECONNECT_BUCKETS 5 // time to reconnect histogram <1s <5s <30s <120s >=120s
+#define MQTT_COMMAND_MAX 2048 // largest fragmented MQTT command that is reassembled
+#define COMMAND_ROUTES 16 // size of the command routing table, a power of two
+#define TEMPLATE_DEPTH 4 // nesting of page templates
+#define TEMPLATE_KEY_MAX 24 // longest {placeholder} name
+#define DISCOVERY_BUFFER 640 // Home Assistant discovery config of one point
+#define READINGS_BUFFER_SIZE 384 // serialized readings of all points
+#define PAYLOAD_MAX_DEPTH 8 // nesting limit of binary MQTT payloads
+#define MQTT_OUTBOX_KB 16 // default memory cap of messages waiting for the MQTT task
+#define MQTT_INFLIGHT_BYTES 4096 // bytes handed to the ESP-MQTT outbox before holding back
+#define MQTT_QOS_TELEMETRY 0 // default QoS of readings and poller values
+#define MQTT5_SESSION_EXPIRY 3600 // s the broker keeps subscriptions and queued QoS 1 messages after a drop
+#define MQTT5_TELEMETRY_EXPIRY 60 // s readings older than this are not delivered to late subscribers
+#define MQTT5_TOPIC_ALIASES 2 // readings and poller
+#define SPARKPLUG_NAMESPACE "spBv1.0"
+#define SPARKPLUG_DEVICE "PLC" // Sparkplug device id of the I/O points
+#define SPARKPLUG_BUFFER 512 // largest birth certificate
+#define SPARKPLUG_METRIC_MAX 96
+#define OUTBOX_RETENTION_KB 512 // default flash kept for readings while MQTT is unreachable, 0 = off
+#define OUTBOX_MIN_INTERVAL 1000 // ms between readings stored while offline
+#define OUTBOX_DRAIN_INTERVAL 1000 // ms between backlog batches after reconnecting
+#define OUTBOX_BATCH_RECORDS 10 // readings per backlog batch
+#define OUTBOX_ACK_TIMEOUT 30000 // ms to wait for the PUBACK of a backlog batch before sending it again
+#define OUTBOX_BATCH_BUFFER 4096
+#define OUTBOX_RECORD_MAX READINGS_BUFFER_SIZE
+#define OUTBOX_SECTOR 4096 // flash erase unit
 
 #define ASYNC_WEBSERVER_PORT 80
 #define DNS_PORT 53
+#define WEB_ASSETS 8 // static files served gzipped from flash
+#define API_BODY_MAX 512 // largest REST request body
+#define TREND_RESOLUTIONS 2
+#define TREND_FINE_INTERVAL 1000 // ms per sample of the fine trend
+#define TREND_FINE_SAMPLES 600 // 10 minutes
+#define TREND_COARSE_INTERVAL 60000 // ms per sample of the coarse trend, a multiple of the fine one
+#define TREND_COARSE_SAMPLES 1440 // 24 hours
+#define TREND_WIDTH_DEFAULT 300 // samples returned when the request has no width
 
 #define INPUT_REGISTER_BASE_ADDRESS 1000
 #define COIL_BASE_ADDRESS 2000
 #define DISCRETE_BASE_ADDRESS 3000
 
+#define MB_MAX_CLIENTS 5 // concurrent Modbus TCP connections
+#define MB_MAX_INFLIGHT 8 // pipelined requests per connection waiting on the RS485 bus
+#define MB_MAX_ROUTED 4 // routed requests handed to the RS485 bus at once, across all connections
+#define MB_IDLE_TIMEOUT 60 // seconds without a request before a Modbus connection is closed, 0 = never
+#define MB_RATE_LIMIT 0 // requests per second per Modbus connection, 0 = unlimited
+#define MB_HIST_BUCKETS 8
+#define MB_CACHE_ENTRIES 16
+#define MB_GATEWAY_MAX_PENDING 16 // distinct requests queued on the RS485 bus
+#define MB_GATEWAY_BAUD 9600
+#define MB_GATEWAY_TIMEOUT 1000 // ms to wait for a RS485 slave
+#define MB_GATEWAY_CACHE_TTL 250 // ms a gateway read response is reused
+
+#define POLLER_RATE_CLASSES 3
+#define POLLER_FAST_RATE 1000 // default poll period (ms) of rate class 0
+#define POLLER_NORMAL_RATE 10000
+#define POLLER_SLOW_RATE 60000
+#define POLLER_MAX_GAP 4 // unused registers a block read may span to merge two tags
+#define POLLER_MAX_REGISTERS 125
+#define POLLER_MAX_BITS 2000
+#define POLLER_TCP_TIMEOUT 2000
+
 #define DI_PINS 4	// Number of digital input pins
 #define DO_PINS 6	// Number of digital output pins
 #define AI_PINS 4	// Number of analog input pins
+#define PLC_POINTS (DI_PINS + AI_PINS + DO_PINS)
 #define WIFI_STATUS_PIN 43 //LED Pin on Edgebox is shared with TXD0, disable logs to use it
 #define FACTORY_RESET_PIN 2 // Clear NVRAM
 
@@ -1,7 +1,5 @@
 #pragma once
 #include <Arduino.h>
-#include <sstream> 
-#include <string>
 #include "defines.h"
 
 namespace EDGEBOX
@@ -12,10 +10,11 @@ namespace EDGEBOX
 		
 		DigitalSensor(int sensorPin);
 		~DigitalSensor();
-		std::string Pin();
+		const char *Pin() { return _name; } // built once, safe to keep
 		bool Level();
 
 	private:
 		int _sensorPin; // Defines the pin that the sensor is connected to
+		char _name[12];
 	};
 }
@@ -19,4 +19,25 @@ namespace EDGEBOX
       OnLine,
       OffLine
     };
+
+    enum PayloadEncoding
+    {
+      EncodingJson,
+      EncodingMsgPack,
+      EncodingCBOR
+    };
+
+    enum OutboxPolicy
+    {
+      OutboxOldestFirst,
+      OutboxLatestValue
+    };
+
+    enum DashboardFrame
+    {
+      FrameText, // JSON readings or a log line
+      FrameSchema,
+      FrameFull,
+      FrameDelta
+    };
 }
\ No newline at end of file
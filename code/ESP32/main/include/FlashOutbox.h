@@ -0,0 +1,65 @@
+#pragma once
+#include <Arduino.h>
+#include "esp_partition.h"
+#include "ArduinoJson.h"
+#include "Defines.h"
+
+namespace EDGEBOX
+{
+	// Store and forward ring of timestamped readings on the spiffs data partition.
+	// Records are appended while MQTT is unreachable and drained in small batches once it is back.
+	// A record is header + payload, its state word only ever clears bits (writing -> committed -> sent)
+	// so a reset mid write leaves at worst one uncommitted record that is skipped on the next scan.
+	// Records never span a flash sector, the oldest sector is erased (dropping unsent records) when the ring is full.
+	// Used from the main loop only.
+	class FlashOutbox
+	{
+	public:
+		FlashOutbox() {};
+		bool begin(uint32_t capacity); // bytes, rounded down to whole sectors, 0 disables the outbox
+		bool isOpen() { return _partition != nullptr; }
+		uint32_t Pending() { return _pending; }
+		bool Append(const char *payload, size_t len, uint32_t timeStamp);
+		// builds a JSON array of the oldest pending records: [{"t":<epoch>,"v":<payload>},...]
+		size_t Peek(uint16_t &records);
+		const char *Batch() { return _batch; }
+		void Commit(); // marks the records of the last Peek as sent, unless they were dropped since
+		void getStatistics(JsonObject &stats);
+
+	private:
+		struct Header
+		{
+			uint32_t magic;
+			uint16_t len;
+			uint16_t reserved;
+			uint32_t seq;
+			uint32_t timeStamp;
+			uint32_t crc; // header fields above and payload
+			uint32_t state;
+		};
+		const esp_partition_t *_partition = nullptr;
+		uint32_t _capacity = 0;
+		uint32_t _head = 0; // next write offset
+		uint32_t _tail = 0; // oldest record that may still be unsent
+		uint32_t _seq = 0;
+		uint32_t _pending = 0;
+		uint32_t _appended = 0;
+		uint32_t _drained = 0;
+		uint32_t _dropped = 0;
+		uint32_t _corrupt = 0;
+		uint32_t _batches = 0;
+		uint32_t _peeked[OUTBOX_BATCH_RECORDS * 2]; // offsets to mark sent, includes skipped corrupt records
+		uint16_t _peekedCount = 0;
+		uint16_t _peekedRecords = 0;
+		uint32_t _peekEnd = 0;
+		char _batch[OUTBOX_BATCH_BUFFER];
+		char _payload[OUTBOX_RECORD_MAX];
+		static uint32_t recordSize(uint16_t len) { return (sizeof(Header) + len + 3) & ~3; }
+		uint32_t nextSector(uint32_t offset);
+		bool readHeader(uint32_t offset, Header &header);
+		bool nextRecord(uint32_t &offset, Header &header);
+		void markState(uint32_t offset, uint32_t state);
+		void dropSector(uint32_t sector);
+		static uint32_t checksum(const Header &header, const char *payload);
+	};
+}
@@ -45,6 +45,19 @@ template <typename T> String htmlConfigEntry(const char* label, T val)
     return s;
 }
 
+#define FNV_OFFSET_BASIS 2166136261u
+
+// 32 bit FNV-1a, chain calls by passing the previous result, start with FNV_OFFSET_BASIS
+uint32_t inline fnv1a(uint32_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	for (size_t i = 0; i < len; i++)
+	{
+		hash = (hash ^ p[i]) * 16777619u;
+	}
+	return hash;
+}
+
 void inline light_sleep(uint32_t sec )
 {
   esp_sleep_enable_timer_wakeup(sec * 1000000ULL);
@@ -6,14 +6,21 @@
 #include <WiFi.h>
 #include <DNSServer.h>
 #include <ESPAsyncWebServer.h>
-#include <ModbusServerTCPasync.h>
 #include "mqtt_client.h"
 #include "time.h"
 #include <sstream>
 #include <string>
+#include <atomic>
+#include <mutex>
 #include "Defines.h"
 #include "Enumerations.h"
 #include "OTA.h"
+#include "ModbusTCPServer.h"
+#include "MqttPublisher.h"
+#include "PayloadCodec.h"
+#include "CommandRouter.h"
+#include "TemplateResponse.h"
+#include "MetricsWriter.h"
 #include "IOTServiceInterface.h"
 #include "IOTCallbackInterface.h"
 
@@ -27,10 +34,11 @@ namespace EDGEBOX
 
         void Run();
         boolean Publish(const char *subtopic, const char *value, boolean retained = false);
+        boolean Publish(const char *subtopic, const char *payload, size_t len, boolean retained);
         boolean Publish(const char *subtopic, JsonDocument &payload, boolean retained = false);
         boolean Publish(const char *subtopic, float value, boolean retained = false);
         boolean PublishMessage(const char *topic, JsonDocument &payload, boolean retained);
-        boolean PublishHADiscovery(JsonDocument &payload);
+        boolean PublishHADiscovery(const char *component, const char *objectId, const char *payload, size_t len);
         std::string getRootTopicPrefix();
         u_int getUniqueId() { return _uniqueId; };
         std::string getThingName();
@@ -38,10 +46,25 @@ namespace EDGEBOX
         NetworkState getNetworkState() { return _networkState; }
         IOTCallbackInterface *IOTCB() { return _iotCB; }
         void registerMBWorkers(FunctionCode fc, MBSworker worker);
+        void ProcessImageChanged();
+        bool Offer(PublishClass cls, const char *subtopic, const char *payload, size_t len, bool text = true);
+        void PublishEdge(const char *name, const char *state);
+        boolean PublishTopic(const char *topic, const char *value, boolean retained);
+        bool PointTopics() { return _pointTopics; }
+        PayloadCodec &Codec();
+        CommandRouter &Commands();
+        AsyncAuthenticationMiddleware &Authentication(); // basic auth of the settings pages
+        bool MqttConnected() { return _mqttConnected; }
+        bool Sparkplug() { return _sparkplug; }
+        bool SparkplugReady() { return _sparkplug && _spBorn; }
+        uint8_t SparkplugSeq() { return _spSeq++; }
+        bool PublishSparkplug(const char *type, const char *device, const uint8_t *payload, size_t len);
+        bool Store(const char *payload, size_t len);
         uint16_t InputRegisterBaseAddr() { return _input_register_base_addr; }
         uint16_t CoilBaseAddr() { return _coil_base_addr; }
         uint16_t DiscreteBaseAddr() { return _discrete_input_base_addr; }
         void GoOnline();
+        void SaveSettingsLater() { _savePending = true; } // from any task, written on the main loop
         
     private:
         OTA _OTA = OTA();
@@ -67,9 +90,53 @@ namespace EDGEBOX
         int16_t _mqttPort = 1883;
         String _mqttUserName;
         String _mqttUserPassword;
+        uint32_t _publishWindow = MQTT_PUBLISH_WINDOW;
+        uint32_t _publishInterval = MQTT_PUBLISH_RATE_LIMIT;
+        bool _publishEdges = false;
+        bool _pointTopics = false;
+        PayloadEncoding _payloadEncoding = EncodingJson;
+        bool _positional = false;
+        uint16_t _outboxKB = OUTBOX_RETENTION_KB;
+        uint16_t _mqttOutboxKB = MQTT_OUTBOX_KB;
+        OutboxPolicy _outboxPolicy = OutboxOldestFirst;
+        uint8_t _telemetryQos = MQTT_QOS_TELEMETRY;
+        bool _mqtt5 = false;
+        bool _sparkplug = false;
+        String _spGroup = TAG;
+        uint8_t _bdSeqNext = 0;
+        uint8_t _bdSeq = 0; // birth/death sequence of the current session
+        std::atomic<uint8_t> _spSeq{0};
+        volatile bool _spBorn = false;
+        volatile bool _spRebirth = false; // NBIRTH and DBIRTH asked for on the MQTT task, sent from the main loop
+        uint8_t _spDeath[64]; // NDEATH will payload
+        volatile bool _mqttConnected = false;
+        volatile bool _mqttStarted = false; // client task running, stopped while the network is down
+        unsigned long _lastStored = 0;
+        unsigned long _lastDrain = 0;
+        volatile int _drainMsgId = -1; // QoS 1 backlog batch waiting for the broker's PUBACK
+        volatile bool _drainAcked = false;
+        volatile bool _savePending = false;
+        volatile bool _pollerChanged = false; // tag list submitted, applied on the main loop
+        volatile bool _outboxResized = false; // set by /submit, the outbox is reopened on the main loop
+        volatile bool _publisherChanged = false; // window, interval or edges submitted
+        volatile bool _encodingChanged = false; // payload encoding submitted
+        unsigned long _lastMetrics = 0;
+        std::vector<MetricsGroup> _metrics; // /metrics and <prefix>/stat/metrics/<group>
+        void AddMetrics();
+        void PublishMetrics();
         bool _useModbus = false;
         int16_t _modbusPort = 502;
         int16_t _modbusID = 1;
+        uint8_t _modbusMaxClients = MB_MAX_CLIENTS;
+        uint16_t _modbusIdleTimeout = MB_IDLE_TIMEOUT;
+        uint16_t _modbusRateLimit = MB_RATE_LIMIT;
+        bool _useGateway = false;
+        uint32_t _gatewayBaud = MB_GATEWAY_BAUD;
+        uint32_t _gatewayTimeout = MB_GATEWAY_TIMEOUT;
+        uint32_t _gatewayCacheTTL = MB_GATEWAY_CACHE_TTL;
+        String _pollerConfig; // written by /submit on async_tcp, read through PollerConfig()
+        std::mutex _pollerLock;
+        String PollerConfig();
         uint16_t _input_register_base_addr = INPUT_REGISTER_BASE_ADDRESS;
 		uint16_t _coil_base_addr = COIL_BASE_ADDRESS;
 		uint16_t _discrete_input_base_addr = DISCRETE_BASE_ADDRESS;
@@ -86,11 +153,30 @@ namespace EDGEBOX
         char _rootTopicPrefix[STR_LEN];
         esp_mqtt_client_handle_t _mqtt_client_handle = 0;
         void GoOffline();
-        void saveSettings();
+        bool saveSettings(); // false if the settings don't fit in EEPROM_SIZE
+        std::mutex _settingsLock; // taken before _pollerLock
         void loadSettings();
         void SendNetworkSettings(AsyncWebServerRequest *request);
+        bool ResolveConfig(const char *key, TemplateValue &value);
+        bool ResolveSettings(const char *key, TemplateValue &value);
+        bool ResolveValue(const char *key, TemplateValue &value);
         void ConnectToMQTTServer();
         void HandleMQTT(int32_t event_id, void *event_data);
+        void DrainOutbox();
+        uint8_t QosFor(const char *subtopic);
+        uint8_t AliasFor(const char *subtopic);
+        bool UseMqtt5()
+        {
+#ifdef CONFIG_MQTT_PROTOCOL_5
+            return _mqtt5;
+#else
+            return false; // ESP-MQTT built without MQTT 5 support
+#endif
+        }
+        void PublishNodeBirth();
+        void HandleSparkplugCommand(const char *topic, const uint8_t *data, size_t len);
+        void HandleCommand(const char *topic, JsonDocument &doc);
+        void PublishStatus();
         void setState(NetworkState newState);
         void wakeup_modem(void);
         esp_netif_t *_netif = NULL;
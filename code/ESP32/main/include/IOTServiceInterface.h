@@ -10,7 +10,7 @@ public:
     virtual boolean Publish(const char *subtopic, const char *value, boolean retained) = 0;
     virtual boolean Publish(const char *subtopic, float value, boolean retained) = 0;
     virtual boolean PublishMessage(const char* topic, JsonDocument& payload, boolean retained) = 0;
-    virtual boolean PublishHADiscovery(JsonDocument& payload) = 0;
+    virtual boolean PublishHADiscovery(const char *component, const char *objectId, const char *payload, size_t len) = 0;
     virtual std::string getRootTopicPrefix() = 0;
     virtual void registerMBWorkers(FunctionCode fc, MBSworker worker);
 
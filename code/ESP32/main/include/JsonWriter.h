@@ -0,0 +1,36 @@
+#pragma once
+#include <Arduino.h>
+
+namespace EDGEBOX
+{
+	// Writes a flat JSON object into a caller owned buffer without touching the heap.
+	// Numbers are formatted with integer math, newlib's float printf allocates.
+	class JsonWriter
+	{
+	public:
+		JsonWriter(char *buffer, size_t size) : _buffer(buffer), _size(size) {};
+		void begin();
+		void add(const char *name, const char *value);
+		void add(const char *name, float value, uint8_t decimals = 1);
+		void addPrecise(const char *name, float value); // 7 significant digits, as ArduinoJson prints a float
+		void add(const char *name, int32_t value);
+		void addBool(const char *name, bool value);
+		size_t end(); // length of the object, 0 if it didn't fit
+		bool overflowed() { return _overflow; }
+		static size_t formatFloat(char *buffer, size_t size, float value, uint8_t decimals = 1);
+
+	private:
+		char *_buffer;
+		size_t _size;
+		size_t _len = 0;
+		bool _first = true;
+		bool _overflow = false;
+		void put(char c);
+		void put(const char *s);
+		void putString(const char *s);
+		void putUnsigned(uint32_t value, uint8_t minDigits = 1);
+		void putFloat(float value, uint8_t decimals);
+		void putPrecise(float value);
+		void key(const char *name);
+	};
+}
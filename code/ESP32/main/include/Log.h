@@ -4,38 +4,92 @@
 #include "esp_log.h"
 #include <time.h>
 
-int weblog(const char *format, ...);
+int weblog(uint8_t level, const char *format, ...);
 
-#if APP_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_VERBOSE
-#define logv(format, ...) weblog(ARDUHAL_LOG_FORMAT(V, format), ##__VA_ARGS__)
-#else
-#define logv(format, ...)
+#ifdef LOG_DEFERRED
+#include "LogDeferred.h"
 #endif
 
-#if APP_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_DEBUG
-#define logd(format, ...) weblog(ARDUHAL_LOG_FORMAT(D, format), ##__VA_ARGS__)
-#else
-#define logd(format, ...)
+// Log statements are tagged by module. A source file selects its module with
+// #define LOG_MODULE <name> ahead of its includes, mlog?(<name>, ...) logs for another module.
+// Each module has a compile time floor (LOG_FLOOR_<name>, defaults to APP_LOG_LEVEL) below which
+// the statement is compiled out, and a runtime threshold checked before any formatting.
+enum LogModule : uint8_t
+{
+    LOG_ID_PLC,
+    LOG_ID_IOT,
+    LOG_ID_MB,
+    LOG_ID_MQTT,
+    LOG_ID_NET,
+    LOG_ID_MODEM,
+    LOG_MODULE_COUNT
+};
+
+extern uint8_t log_threshold[LOG_MODULE_COUNT];
+
+#ifndef LOG_MODULE
+#define LOG_MODULE IOT
 #endif
 
-#if APP_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-#define logi(format, ...) weblog(ARDUHAL_LOG_FORMAT(I, format), ##__VA_ARGS__)
-#else
-#define logi(format, ...)
+#ifndef LOG_RUNTIME_LEVEL
+#define LOG_RUNTIME_LEVEL ARDUHAL_LOG_LEVEL_INFO // runtime threshold of every module at boot
 #endif
 
-#if APP_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_WARN
-#define logw(format, ...) weblog(ARDUHAL_LOG_FORMAT(W, format), ##__VA_ARGS__)
-#else
-#define logw(format, ...)
+#ifndef LOG_MQTT_LEVEL
+#define LOG_MQTT_LEVEL ARDUHAL_LOG_LEVEL_WARN // records at or above this severity are also published on <prefix>/stat/logs
+#endif
+
+#ifndef LOG_FLOOR_PLC
+#define LOG_FLOOR_PLC APP_LOG_LEVEL
+#endif
+#ifndef LOG_FLOOR_IOT
+#define LOG_FLOOR_IOT APP_LOG_LEVEL
+#endif
+#ifndef LOG_FLOOR_MB
+#define LOG_FLOOR_MB APP_LOG_LEVEL
+#endif
+#ifndef LOG_FLOOR_MQTT
+#define LOG_FLOOR_MQTT APP_LOG_LEVEL
+#endif
+#ifndef LOG_FLOOR_NET
+#define LOG_FLOOR_NET APP_LOG_LEVEL
+#endif
+#ifndef LOG_FLOOR_MODEM
+#define LOG_FLOOR_MODEM APP_LOG_LEVEL
 #endif
 
-#if APP_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_ERROR
-#define loge(format, ...) weblog(ARDUHAL_LOG_FORMAT(E, format), ##__VA_ARGS__)
+// With LOG_DEFERRED a statement stores its arguments unformatted, the file name is cut from __FILE__ at compile time
+#ifdef LOG_DEFERRED
+#define LOG_FILE_NAME (__builtin_strrchr(__FILE__, '/') ? __builtin_strrchr(__FILE__, '/') + 1 : __FILE__)
+#define log_format(letter, format) ARDUHAL_LOG_COLOR_##letter "[%6u][" #letter "][%s:%u] %s(): " format ARDUHAL_LOG_RESET_COLOR "\r\n", \
+                                   (uint32_t)(esp_timer_get_time() / 1000ULL), LOG_FILE_NAME, __LINE__, __FUNCTION__
+#define log_write weblog_deferred
 #else
-#define loge(format, ...)
+#define log_format ARDUHAL_LOG_FORMAT
+#define log_write weblog
 #endif
 
+#define log_at(module, level, letter, format, ...)                                             \
+    do                                                                                         \
+    {                                                                                          \
+        if (LOG_FLOOR_##module >= level && log_threshold[LOG_ID_##module] >= level)            \
+        {                                                                                      \
+            log_write(level, log_format(letter, "[" #module "] " format), ##__VA_ARGS__);      \
+        }                                                                                      \
+    } while (0)
+
+#define mlogv(module, format, ...) log_at(module, ARDUHAL_LOG_LEVEL_VERBOSE, V, format, ##__VA_ARGS__)
+#define mlogd(module, format, ...) log_at(module, ARDUHAL_LOG_LEVEL_DEBUG, D, format, ##__VA_ARGS__)
+#define mlogi(module, format, ...) log_at(module, ARDUHAL_LOG_LEVEL_INFO, I, format, ##__VA_ARGS__)
+#define mlogw(module, format, ...) log_at(module, ARDUHAL_LOG_LEVEL_WARN, W, format, ##__VA_ARGS__)
+#define mloge(module, format, ...) log_at(module, ARDUHAL_LOG_LEVEL_ERROR, E, format, ##__VA_ARGS__)
+
+#define logv(format, ...) mlogv(LOG_MODULE, format, ##__VA_ARGS__)
+#define logd(format, ...) mlogd(LOG_MODULE, format, ##__VA_ARGS__)
+#define logi(format, ...) mlogi(LOG_MODULE, format, ##__VA_ARGS__)
+#define logw(format, ...) mlogw(LOG_MODULE, format, ##__VA_ARGS__)
+#define loge(format, ...) mloge(LOG_MODULE, format, ##__VA_ARGS__)
+
 void inline printLocalTime()
 {
 #if APP_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_DEBUG
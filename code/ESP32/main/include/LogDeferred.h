@@ -0,0 +1,92 @@
+#pragma once
+#include <Arduino.h>
+#include <initializer_list>
+#include <type_traits>
+#include "esp_idf_version.h"
+#if ESP_IDF_VERSION_MAJOR >= 5
+#include "esp_memory_utils.h"
+#else
+#include "soc/soc_memory_layout.h"
+#endif
+#include "Defines.h"
+
+// Deferred records hold the format pointer and the raw argument words, formatting is left to
+// the log drain task or to tools/decode_log.py with the firmware ELF. Strings in flash are kept
+// as pointers, any other string is copied into the record, up to LOG_STRING_MAX characters.
+// Arguments past LOG_DEFERRED_WORDS are lost, the formatter prints what the record holds.
+bool weblog_push(uint8_t level, const void *record, size_t len);
+
+struct LogPacker
+{
+	uint32_t *pos;
+	uint32_t *end;
+	void put(uint32_t word)
+	{
+		if (pos < end)
+		{
+			*pos++ = word;
+		}
+	}
+};
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type log_pack(LogPacker &p, T value)
+{
+	if (sizeof(T) > 4)
+	{
+		uint64_t word = (uint64_t)value;
+		p.put((uint32_t)word);
+		p.put((uint32_t)(word >> 32));
+	}
+	else
+	{
+		p.put((uint32_t)value);
+	}
+}
+
+inline void log_pack(LogPacker &p, double value) // a float arrives promoted, as it would through ...
+{
+	uint64_t word;
+	memcpy(&word, &value, sizeof(word));
+	p.put((uint32_t)word);
+	p.put((uint32_t)(word >> 32));
+}
+
+inline void log_pack(LogPacker &p, const char *s)
+{
+	if (s != nullptr && esp_ptr_in_drom(s))
+	{
+		p.put((uint32_t)(uintptr_t)s);
+		return;
+	}
+	size_t len = s == nullptr ? 0 : strnlen(s, LOG_STRING_MAX);
+	size_t words = (len + 3) / 4;
+	if (p.pos + 1 + words > p.end)
+	{
+		len = 0; // no room, logged as an empty string
+		words = 0;
+	}
+	p.put(LOG_INLINE_STRING | len);
+	if (words > 0)
+	{
+		p.pos[words - 1] = 0;
+		memcpy(p.pos, s, len);
+		p.pos += words;
+	}
+}
+
+inline void log_pack(LogPacker &p, char *s) { log_pack(p, (const char *)s); }
+
+template <typename T>
+inline void log_pack(LogPacker &p, T *ptr) { p.put((uint32_t)(uintptr_t)ptr); }
+
+template <typename... Args>
+inline int weblog_deferred(uint8_t level, const char *format, Args... args)
+{
+	uint32_t record[LOG_DEFERRED_WORDS];
+	LogPacker p{record, record + LOG_DEFERRED_WORDS};
+	p.put((uint32_t)(uintptr_t)format);
+	(void)std::initializer_list<int>{(log_pack(p, args), 0)...};
+	weblog_push(level | LOG_DEFERRED_RECORD, record, (p.pos - record) * sizeof(uint32_t));
+	return 0;
+}
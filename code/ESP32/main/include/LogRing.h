@@ -0,0 +1,43 @@
+#pragma once
+#include <Arduino.h>
+#include <atomic>
+#include "Defines.h"
+
+namespace EDGEBOX
+{
+	// Lock-free ring of log records, any task may Push, one task Pops.
+	// A producer reserves its record with a compare and swap on the head, writes it, then sets the record's state
+	// byte last. The consumer zeroes what it consumed, so a reserved record not yet written always reads as state 0.
+	// Push never waits: a record that doesn't fit is dropped and counted.
+	// The buffer is zeroed and its size a power of two, constant initialized so logging works before static constructors.
+	class LogRing
+	{
+	public:
+		constexpr LogRing(uint8_t *buffer, uint32_t size) : _buffer(buffer), _size(size) {};
+		bool Push(uint8_t level, const void *data, size_t len);
+		size_t Pop(uint8_t &level, void *data, size_t size);
+		bool Skip();
+		// consumer side, walks the records from begin() without consuming them
+		uint32_t begin() { return _tail.load(std::memory_order_relaxed); }
+		size_t Peek(uint32_t &cursor, uint8_t &level, void *data, size_t size);
+		uint32_t pushed() { return _pushed.load(std::memory_order_relaxed); }
+		uint32_t dropped() { return _dropped.load(std::memory_order_relaxed); }
+		uint32_t used() { return _head.load(std::memory_order_relaxed) - _tail.load(std::memory_order_relaxed); }
+		uint32_t highWater() { return _highWater; }
+		uint32_t size() { return _size; }
+
+	private:
+		static const size_t HEADER = 4; // state, level, length (little endian)
+		uint8_t *_buffer;
+		uint32_t _size;
+		std::atomic<uint32_t> _head{0}; // reserved up to, free running
+		std::atomic<uint32_t> _tail{0}; // consumed up to
+		std::atomic<uint32_t> _pushed{0};
+		std::atomic<uint32_t> _dropped{0};
+		uint32_t _highWater = 0;
+		void copyIn(uint32_t pos, const void *data, size_t len);
+		void copyOut(uint32_t pos, void *data, size_t len);
+		bool record(uint32_t pos, uint8_t &level, size_t &len);
+		void consume(uint32_t tail, size_t len);
+	};
+}
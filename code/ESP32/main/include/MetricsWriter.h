@@ -0,0 +1,70 @@
+#pragma once
+#include <Arduino.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <ESPAsyncWebServer.h>
+#include "ArduinoJson.h"
+#include "Defines.h"
+
+namespace EDGEBOX
+{
+	// Writes metrics into a caller owned buffer, as Prometheus text with every name prefixed by METRICS_PREFIX,
+	// or as one JSON object for MQTT where a label value is appended to the name.
+	// Only whole lines are written, once a line doesn't fit the rest is dropped and overflowed() is set.
+	// add(name, stats) takes what a getStatistics() call filled in: as Prometheus samples numbers and booleans
+	// are named by their path, array indexes and keys that aren't names become labels, each name written as one
+	// untyped family with its HELP and TYPE lines; as JSON it is copied as is.
+	class MetricsWriter
+	{
+	public:
+		MetricsWriter(char *buffer, size_t size, bool json = false) : _buffer(buffer), _size(size), _json(json) {};
+		void begin();
+		void family(const char *name, const char *help, const char *type = "gauge");
+		void add(const char *name, int64_t value, const char *label = nullptr, const char *labelValue = nullptr);
+		void add(const char *name, float value, const char *label = nullptr, const char *labelValue = nullptr);
+		void add(const char *name, JsonVariantConst stats);
+		size_t end();
+		bool overflowed() { return _overflow; }
+
+	private:
+		char *_buffer;
+		size_t _size;
+		bool _json;
+		size_t _len = 0;
+		bool _first = true;
+		bool _overflow = false;
+		bool append(const char *text, size_t len);
+		void sample(const char *name, const char *labels, const char *value);
+		typedef std::function<void(const char *name, const char *labels, const char *value)> SampleVisitor;
+		void flatten(char *name, size_t nameLen, char *labels, size_t labelsLen, const char *member, JsonVariantConst value, const SampleVisitor &visit);
+	};
+
+	typedef std::function<void(MetricsWriter &metrics)> MetricsCollector;
+
+	struct MetricsGroup
+	{
+		const char *name; // MQTT subtopic metrics/<name>
+		MetricsCollector collector;
+	};
+
+	// Streams the Prometheus text of a list of groups through a chunked response,
+	// a group is collected when the previous one has been sent, into a buffer of METRICS_CHUNK.
+	// send answers 500 when a group doesn't fit, a group that outgrew it after that is left out whole.
+	class MetricsResponse
+	{
+	public:
+		MetricsResponse(const std::vector<MetricsGroup> &groups) : _groups(groups) {};
+		size_t fill(uint8_t *buffer, size_t maxLen);
+		static void send(AsyncWebServerRequest *request, std::shared_ptr<MetricsResponse> metrics);
+
+	private:
+		bool collect(const MetricsGroup &group);
+		const std::vector<MetricsGroup> &_groups;
+		size_t _group = 0;
+		char _chunk[METRICS_CHUNK];
+		size_t _chunkLen = 0;
+		size_t _chunkPos = 0;
+	};
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <Arduino.h>
+#include <ModbusClientRTU.h>
+#include <map>
+#include <vector>
+#include <mutex>
+#include "ArduinoJson.h"
+#include "Defines.h"
+#include "ModbusTCPServer.h"
+#include "ModbusResponseCache.h"
+
+namespace EDGEBOX
+{
+	// Routes Modbus TCP requests by unit id to the RS485 slaves.
+	// Bus access is serialized by the RTU client task, identical reads are coalesced
+	// onto one bus transaction and answered from a short lived cache.
+	class ModbusGateway
+	{
+	public:
+		ModbusGateway() {};
+		void begin(uint32_t baud, uint32_t timeout, uint32_t cacheTTL);
+		bool Route(ModbusMessage request, MBResponder respond);
+		void getStatistics(JsonObject &stats);
+
+	private:
+		struct Pending
+		{
+			bool used = false;
+			bool cacheable = false;
+			MBCacheKey key;
+			uint32_t start = 0;
+			std::vector<MBResponder> waiters;
+		};
+		struct SlaveStats
+		{
+			uint32_t requests = 0;
+			uint32_t cacheHits = 0;
+			uint32_t coalesced = 0;
+			uint32_t errors = 0;
+			uint32_t timeouts = 0;
+			uint32_t minLatency = UINT32_MAX; // micro seconds
+			uint32_t maxLatency = 0;
+			uint32_t avgLatency = 0;
+		};
+		ModbusClientRTU _rtu = ModbusClientRTU(RS485_RTS);
+		bool _running = false;
+		uint32_t _cacheTTL = MB_GATEWAY_CACHE_TTL;
+		std::mutex _lock;
+		Pending _pending[MB_GATEWAY_MAX_PENDING];
+		ModbusResponseCache _cache;
+		std::map<uint8_t, SlaveStats> _slaveStats;
+		void onResponse(uint32_t token, ModbusMessage &response, Error err);
+	};
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include <Arduino.h>
+#include <ModbusClientTCPasync.h>
+#include <vector>
+#include <mutex>
+#include "ArduinoJson.h"
+#include "Defines.h"
+#include "ModbusGateway.h"
+
+namespace EDGEBOX
+{
+	enum PollTagType
+	{
+		TagBool,
+		TagU16,
+		TagS16,
+		TagU32,
+		TagS32,
+		TagF32
+	};
+
+	// Polls downstream Modbus TCP/RTU devices from a tag list.
+	// Tags of the same device, function code and rate class are merged into block reads
+	// as long as the hole between them is no larger than maxGap registers.
+	// Configure may be called again to apply a new tag list, after Stop once Idle; the TCP clients are reused.
+	class ModbusPoller
+	{
+	public:
+		ModbusPoller() {};
+		bool Configure(JsonObject config);
+		void begin(ModbusGateway *rtuBus);
+		void Stop(); // no new block reads, Idle once the ones on the bus are answered
+		bool Idle();
+		void Run();
+		bool needsRTU();
+		bool hasTags() { return !_tags.empty(); }
+		bool hasChanges() { return _dirty; }
+		bool TakeChanges(JsonDocument &doc);
+		void getValues(JsonObject &values);
+		void getStatistics(JsonObject &stats);
+
+	private:
+		struct Device
+		{
+			String name;
+			bool rtu = true;
+			IPAddress ip;
+			uint16_t port = 502;
+			uint8_t unit = 1;
+			ModbusClientTCPasync *tcp = nullptr; // shared with the devices at the same address
+		};
+		struct TcpClient
+		{
+			IPAddress ip;
+			uint16_t port;
+			ModbusClientTCPasync *tcp;
+		};
+		struct Tag
+		{
+			String name;
+			uint8_t device = 0;
+			uint8_t fc = READ_HOLD_REGISTER;
+			uint16_t addr = 0;
+			PollTagType type = TagU16;
+			uint8_t rate = 0;
+			float scale = 1.0;
+			bool swap = false; // low word first for 32 bit values
+			bool valid = false;
+			bool changed = false;
+			double value = 0;
+			time_t timeStamp = 0;
+			uint32_t updated = 0;
+		};
+		struct Block
+		{
+			uint8_t device = 0;
+			uint8_t fc = 0;
+			uint8_t rate = 0;
+			uint16_t start = 0;
+			uint16_t count = 0;
+			std::vector<uint16_t> tags;
+			bool busy = false;
+			uint32_t sent = 0;
+			uint32_t errors = 0;
+		};
+		struct RateClass
+		{
+			uint32_t period = 0;
+			uint32_t nextDue = 0;
+			uint32_t cycleStart = 0;
+			uint16_t outstanding = 0;
+			uint32_t busTime = 0; // sum of block round trips in the current cycle (us)
+			uint32_t lastBusTime = 0;
+			uint32_t lastCycleTime = 0;
+			uint32_t cycles = 0;
+			uint32_t overruns = 0;
+		};
+		std::mutex _lock;
+		bool _running = false;
+		uint32_t _stopped = 0;
+		uint16_t _generation = 0; // of the tag list, in the high half of a block's request token
+		bool _dirty = false;
+		uint16_t _maxGap = POLLER_MAX_GAP;
+		ModbusGateway *_rtuBus = nullptr;
+		std::vector<Device> _devices;
+		std::vector<TcpClient> _clients; // kept across tag lists, reused by address
+		std::vector<Tag> _tags;
+		std::vector<Block> _blocks;
+		RateClass _rates[POLLER_RATE_CLASSES];
+		ModbusClientTCPasync *client(IPAddress ip, uint16_t port);
+		void buildBlocks();
+		void submit(uint16_t index);
+		void onBlockResponse(uint32_t token, ModbusMessage &response);
+		static uint8_t tagWidth(uint8_t fc, PollTagType type);
+	};
+}
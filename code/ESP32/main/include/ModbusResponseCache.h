@@ -0,0 +1,51 @@
+#pragma once
+#include <Arduino.h>
+#include <ModbusMessage.h>
+#include "ArduinoJson.h"
+#include "Defines.h"
+
+namespace EDGEBOX
+{
+	// identifies a read request, only FC01-FC04 are cacheable
+	struct MBCacheKey
+	{
+		uint8_t unit = 0;
+		uint8_t fc = 0;
+		uint16_t addr = 0;
+		uint16_t count = 0;
+		bool operator==(const MBCacheKey &other) const
+		{
+			return unit == other.unit && fc == other.fc && addr == other.addr && count == other.count;
+		}
+	};
+
+	// Serialized read responses keyed by unit/FC/start/count.
+	// Entries are either aged out (gateway) or tagged with the process image sequence
+	// they were built from and dropped once the image changes (local workers).
+	class ModbusResponseCache
+	{
+	public:
+		ModbusResponseCache() {};
+		static bool MakeKey(ModbusMessage &request, MBCacheKey &key);
+		bool Lookup(const MBCacheKey &key, uint32_t maxAge, ModbusMessage &response);
+		bool LookupCurrent(const MBCacheKey &key, uint32_t sequence, ModbusMessage &response);
+		void Store(const MBCacheKey &key, ModbusMessage &response, uint32_t sequence = 0);
+		void Clear();
+		void getStatistics(JsonObject &stats);
+
+	private:
+		struct Entry
+		{
+			MBCacheKey key;
+			bool valid = false;
+			uint32_t timeStamp = 0;
+			uint32_t sequence = 0;
+			ModbusMessage response;
+		};
+		Entry _entries[MB_CACHE_ENTRIES];
+		uint8_t _next = 0; // round robin replacement
+		uint32_t _hits = 0;
+		uint32_t _misses = 0;
+		Entry *find(const MBCacheKey &key);
+	};
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <Arduino.h>
+#include <AsyncTCP.h>
+#include <ModbusServer.h>
+#include <map>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include "ArduinoJson.h"
+#include "Defines.h"
+#include "ModbusResponseCache.h"
+
+namespace EDGEBOX
+{
+	// completes a deferred request, may be called from any task
+	typedef std::function<void(ModbusMessage response)> MBResponder;
+	// handles requests for server ids without a local worker, returns false if the request can't be routed
+	typedef std::function<bool(ModbusMessage request, MBResponder respond)> MBRouter;
+
+	// Modbus TCP front end on AsyncServer.
+	// Local workers are answered in place, routed requests are queued per connection
+	// and answered when the router completes them so a slow downstream bus never blocks async_tcp.
+	// Routed requests are handed to the router round robin across connections, a few at a time,
+	// so one chatty master can't fill the bus queue ahead of the others.
+	// Local read responses are cached until the process image sequence moves on.
+	class ModbusTCPServer
+	{
+	public:
+		ModbusTCPServer() {};
+		bool start(uint16_t port, uint8_t maxClients, uint32_t idleTimeout);
+		void stop();
+		bool isRunning() { return _server != nullptr; }
+		uint16_t activeClients();
+		void registerWorker(uint8_t serverID, uint8_t functionCode, MBSworker worker);
+		void setRouter(MBRouter router) { _router = router; }
+		void setRateLimit(uint16_t requestsPerSecond) { _rateLimit = requestsPerSecond; }
+		void imageChanged() { _imageSequence++; } // invalidates cached local reads
+		void getStatistics(JsonObject &stats);
+
+	private:
+		struct Routed
+		{
+			uint16_t tid = 0;
+			uint32_t start = 0;
+			ModbusMessage request;
+		};
+		struct Counters
+		{
+			uint32_t requests = 0;
+			uint32_t exceptions = 0;
+			uint32_t throttled = 0;
+			uint32_t bytesIn = 0;
+			uint32_t bytesOut = 0;
+			uint32_t serviceTime[MB_HIST_BUCKETS] = {}; // service time histogram, see histBounds
+		};
+		struct Connection
+		{
+			AsyncClient *client = nullptr;
+			bool alive = true;
+			String remote;
+			std::vector<uint8_t> rx;
+			std::deque<Routed> waiting;	 // routed requests not yet handed to the router
+			std::deque<Routed> inflight; // routed requests waiting on a response, request is dropped
+			Counters counters;
+			float tokens = 0; // request rate token bucket
+			uint32_t lastRefill = 0;
+		};
+		typedef std::shared_ptr<Connection> ConnectionPtr;
+
+		AsyncServer *_server = nullptr;
+		uint8_t _maxClients = MB_MAX_CLIENTS;
+		uint32_t _idleTimeout = 0;
+		uint16_t _rateLimit = 0;
+		std::mutex _lock;
+		std::vector<ConnectionPtr> _connections;
+		std::map<uint8_t, std::map<uint8_t, MBSworker>> _workers;
+		MBRouter _router;
+		size_t _nextConnection = 0; // round robin position for routed requests
+		uint16_t _routedOutstanding = 0;
+		bool _dispatching = false;
+		Counters _totals; // closed connections
+		uint32_t _rejected = 0;
+		std::atomic<uint32_t> _imageSequence{0};
+		ModbusResponseCache _cache;
+		ModbusMessage localRequest(ModbusMessage &request, MBSworker worker);
+		void onConnect(AsyncClient *client);
+		void onData(ConnectionPtr con, uint8_t *data, size_t len);
+		void onDisconnect(ConnectionPtr con);
+		void handleRequest(ConnectionPtr con, uint16_t tid, ModbusMessage &request);
+		bool takeToken(ConnectionPtr con);
+		void dispatch();
+		void completeRequest(ConnectionPtr con, uint16_t tid, ModbusMessage &response);
+		void sendResponse(ConnectionPtr con, uint16_t tid, ModbusMessage &response, uint32_t start);
+		MBSworker getWorker(uint8_t serverID, uint8_t functionCode);
+		static void addCounters(JsonObject &obj, const Counters &counters);
+	};
+}
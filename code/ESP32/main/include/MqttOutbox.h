@@ -0,0 +1,79 @@
+#pragma once
+#include <Arduino.h>
+#include <deque>
+#include <string>
+#include <mutex>
+#include "mqtt_client.h"
+#ifdef CONFIG_MQTT_PROTOCOL_5
+#include "mqtt5_client.h"
+#endif
+#include "ArduinoJson.h"
+#include "Defines.h"
+#include "Enumerations.h"
+
+namespace EDGEBOX
+{
+	// Byte capped queue in front of the ESP-MQTT outbox.
+	// Publishing only queues the message, Flush hands messages to the MQTT task with
+	// esp_mqtt_client_enqueue while the ESP-MQTT outbox holds less than MQTT_INFLIGHT_BYTES,
+	// so a slow broker never blocks the scan and memory stays bounded.
+	// Flush is called from the main loop only, Push from any task.
+	// When the cap is reached the oldest message is evicted, with OutboxLatestValue a newer
+	// message replaces a queued one of the same topic first, unless the message isn't mergeable (sequenced payloads).
+	// With MQTT 5 a QoS 0 message may carry a topic alias: the first send of a connection registers
+	// the topic with the broker, later sends go with an empty topic. Those are written straight to the
+	// connection and never stored in the ESP-MQTT outbox, which has no API to drop them at a disconnect
+	// and would resend them on a connection that doesn't know the alias. Wire bytes are counted against
+	// what the same message costs over MQTT 3.1.1.
+	class MqttOutbox
+	{
+	public:
+		MqttOutbox() {};
+		void configure(uint32_t capacity, OutboxPolicy policy);
+		void setProtocol(bool mqtt5);
+		void Connected();
+		void Disconnected();
+		bool Push(const char *topic, const char *payload, size_t len, uint8_t qos, bool retain, bool mergeable = true, uint8_t alias = 0, uint32_t expiry = 0);
+		void Flush(esp_mqtt_client_handle_t client);
+		int Send(esp_mqtt_client_handle_t client, const char *topic, const char *payload, size_t len, uint8_t qos, bool retain, uint8_t alias = 0, uint32_t expiry = 0);
+		uint32_t Bytes() { return _bytes; }
+		uint32_t Capacity() { return _capacity; }
+		void getStatistics(JsonObject &stats, esp_mqtt_client_handle_t client);
+
+	private:
+		struct Message
+		{
+			std::string topic;
+			std::string payload;
+			uint8_t qos = 0;
+			bool retain = false;
+			bool mergeable = true;
+			uint8_t alias = 0;	 // MQTT 5 topic alias, 0 for none
+			uint32_t expiry = 0; // MQTT 5 message expiry (s), 0 for none
+			uint32_t pushed = 0; // micros() when queued
+			size_t size() const { return topic.length() + payload.length(); }
+		};
+		std::mutex _lock; // publishers run on the main loop and the MQTT task
+		std::deque<Message> _queue;
+		uint32_t _capacity = MQTT_OUTBOX_KB * 1024;
+		OutboxPolicy _policy = OutboxOldestFirst;
+		uint32_t _bytes = 0;
+		uint32_t _peakBytes = 0;
+		uint32_t _queued = 0;
+		uint32_t _enqueued = 0;
+		uint32_t _evicted = 0;
+		uint32_t _replaced = 0;
+		uint32_t _rejected = 0;
+		uint32_t _latency = 0; // us from Push to the ESP-MQTT outbox, of the last message
+		uint32_t _maxLatency = 0;
+		uint64_t _totalLatency = 0;
+		bool _mqtt5 = false;
+		bool _connected = false;
+		bool _aliasRefused = false; // broker allows fewer aliases than we use, send full topics
+		bool _aliasKnown[MQTT5_TOPIC_ALIASES + 1] = {};
+		uint32_t _aliased = 0;
+		uint32_t _sent = 0;
+		uint64_t _wireBytes = 0;
+		uint64_t _wireBytes311 = 0;
+	};
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <Arduino.h>
+#include <functional>
+#include "ArduinoJson.h"
+#include "Defines.h"
+
+namespace EDGEBOX
+{
+	enum PublishClass
+	{
+		PublishReadings,
+		PublishPoller,
+		PUBLISH_CLASSES
+	};
+
+	typedef std::function<bool(const char *subtopic, const char *payload, size_t len)> PublishSender;
+
+	// Rate limits MQTT publishing per topic class.
+	// Changes are held for a coalescing window, a newer snapshot replaces the pending one,
+	// and a token bucket (burst of MQTT_PUBLISH_BURST, one token per interval) caps the message rate.
+	// Digital edges seen during the window can ride along in the readings message when it is JSON text.
+	// Used from the main loop only.
+	class MqttPublisher
+	{
+	public:
+		MqttPublisher() {};
+		void configure(uint32_t window, uint32_t interval, bool edges);
+		void setSender(PublishSender sender) { _sender = sender; }
+		// snapshot payloads, a newer one replaces the pending one, binary payloads pass text = false
+		bool Offer(PublishClass cls, const char *subtopic, const char *payload, size_t len, bool text = true);
+		void Edge(const char *name, const char *state);
+		// delta payloads accumulate at their source, true once the class may publish
+		bool Ready(PublishClass cls);
+		void Sent(PublishClass cls, bool ok);
+		void Run();
+		void getStatistics(JsonObject &stats);
+
+	private:
+		struct Slot
+		{
+			const char *subtopic = nullptr;
+			char payload[MQTT_PUBLISH_BUFFER];
+			size_t len = 0;
+			bool text = true;
+			bool pending = false;
+			uint32_t since = 0;
+			float tokens = MQTT_PUBLISH_BURST;
+			uint32_t lastRefill = 0;
+			uint32_t offered = 0;
+			uint32_t published = 0;
+			uint32_t merged = 0;
+			uint32_t dropped = 0;
+		};
+		Slot _slots[PUBLISH_CLASSES];
+		uint32_t _window = 0;
+		uint32_t _interval = MQTT_PUBLISH_RATE_LIMIT;
+		bool _edgesEnabled = false;
+		char _edges[MQTT_EDGE_BUFFER]; // comma separated edge objects
+		size_t _edgesLen = 0;
+		uint32_t _edgesDropped = 0;
+		char _out[MQTT_PUBLISH_BUFFER + MQTT_EDGE_BUFFER + 16];
+		PublishSender _sender;
+		bool due(Slot &slot, uint32_t now);
+	};
+}
@@ -1,16 +1,19 @@
 #include <Arduino.h>
+#include <mutex>
 #include <ArduinoJson.h>
 #include <AsyncTCP.h>
 #include <WiFi.h>
 #include <DNSServer.h>
 #include <ESPAsyncWebServer.h>
-#include <ModbusServerTCPasync.h>
+#include "ModbusTCPServer.h"
 #include "Defines.h"
 #include "CoilData.h"
 #include "AnalogSensor.h"
 #include "DigitalSensor.h"
 #include "Coil.h"
 #include "IOTCallbackInterface.h"
+#include "WebSocketHub.h"
+#include "TrendBuffer.h"
 
 namespace EDGEBOX
 {
@@ -25,23 +28,55 @@ namespace EDGEBOX
 		void Process();
 		void onMqttConnect();
 		void onMqttMessage(char* topic, JsonDocument& doc);
+		void onSparkplugBirth();
 		void onNetworkConnect();
-		void addApplicationSettings(String& page);
-		void addApplicationConfigs(String& page);
+		void addApplicationSettings(TemplateResponse& page);
+		void addApplicationConfigs(TemplateResponse& page);
+		void addApplicationMetrics(MetricsWriter& metrics);
 		void onSubmitForm(AsyncWebServerRequest *request);
 	    void onSaveSetting(JsonDocument& doc);
     	void onLoadSetting(JsonDocument& doc);
 
 	protected:
 		boolean PublishDiscoverySub(const char *component, const char *entityName, const char *jsonElement, const char *device_class, const char *unit_of_meas, const char *icon = "");
-		bool ReadyToPublish() {
-			return (!_discoveryPublished);
-		}
 
 	private:
-		boolean _discoveryPublished = false;
+		uint32_t _discoveryHash = 0; // of the discovery configs last published
+		size_t DiscoveryComponent(int point, char *payload, size_t size);
+		void PublishDiscovery();
 		
-		String _lastMessagePublished;
+		char _readings[READINGS_BUFFER_SIZE]; // built in place each scan
+		char _lastReadings[READINGS_BUFFER_SIZE];
+		size_t _lastReadingsLength = 0;
+		size_t SerializeReadings(char *buffer, size_t size, uint32_t points = WS_ALL_POINTS);
+		int PointIndex(const char *name);
+		int32_t _dashboardValues[PLC_POINTS]; // state the dashboard clients were sent, tenths for analog points
+		uint32_t DashboardChanges();
+		size_t SerializeDashboard(DashboardFrame frame, uint32_t points, uint8_t *buffer, size_t size);
+		uint8_t _encoded[READINGS_BUFFER_SIZE]; // readings in the binary payload encoding
+		size_t EncodeReadings();
+		void PublishSchema();
+		void OfferReadings(size_t len);
+		bool _storePending = false; // changed readings not yet in the outbox
+		int32_t _spValues[PLC_POINTS]; // last value reported to the Sparkplug host, tenths for analog points
+		void PublishSparkplugData();
+		void WriteSparkplugMetrics(JsonDocument &doc);
+		bool WriteCoil(int coil, JsonVariantConst state);
+		std::mutex _apiLock; // the REST buffer is read on the async_tcp task
+		char _apiPoints[READINGS_BUFFER_SIZE] = "{}"; // readings at _scanSequence
+		size_t _apiPointsLength = 0;
+		uint32_t _scanSequence = 0; // bumped by each scan that changed a point
+		uint32_t _pointSequence[PLC_POINTS] = {}; // scan that last changed each point
+		uint32_t _bootId = 0; // keeps ETags from matching across reboots
+		void UpdateApi(uint32_t changed);
+		void SendPoints(AsyncWebServerRequest *request);
+		void WriteCoils(AsyncWebServerRequest *request);
+		bool ResolveAnalog(uint16_t index, const char *key, TemplateValue &value);
+		char _pointTopics[PLC_POINTS][STR_LEN * 2] = {}; // <prefix>/stat/<point>, built on connect
+		int32_t _pointValues[PLC_POINTS];				   // last published value of each point
+		volatile bool _pointsStale = true;
+		void PublishPoints();
+		void SetStateTopic(JsonObject &component, int point, const char *name);
 		unsigned long _lastPublishTimeStamp = 0;
 
 		Coil _Coils[DO_PINS] = {GPIO_NUM_40, GPIO_NUM_39, GPIO_NUM_38, GPIO_NUM_37, GPIO_NUM_36, GPIO_NUM_35};
@@ -54,5 +89,54 @@ namespace EDGEBOX
 		int16_t _digitalInputs = DI_PINS;
 		int16_t _analogInputs = AI_PINS;
 		unsigned long _lastHeap = 0;
+		uint16_t _imageAnalog[AI_PINS] = {}; // process image seen by the last scan
+		uint16_t _imageBits = 0;			  // digital inputs followed by coils
+		struct ScanTime
+		{
+			uint32_t count = 0;
+			uint32_t last = 0; // us
+			uint32_t max = 0;
+			uint64_t total = 0;
+			void add(uint32_t us)
+			{
+				count++;
+				last = us;
+				max = us > max ? us : max;
+				total += us;
+			}
+		};
+		ScanTime _monitorTime; // input scan
+		ScanTime _processTime; // publish and serve scan
+		std::mutex _trendLock; // the trends are read on the async_tcp task
+		TrendBuffer _trends[AI_PINS][TREND_RESOLUTIONS]; // analog points only, no PSRAM for the rest
+		int32_t _trendSum[AI_PINS][TREND_RESOLUTIONS] = {}; // tenths summed since the last sample
+		uint16_t _trendCount[TREND_RESOLUTIONS] = {};
+		unsigned long _lastTrendTimeStamp = 0;
+		void SampleTrends();
+		struct TrendStream // state of a /trends response between chunks
+		{
+			enum State
+			{
+				Start,
+				Point,
+				Times,
+				Values,
+				Done
+			} state = Start;
+			int res = 0;
+			uint16_t width = TREND_WIDTH_DEFAULT;
+			int point = -1; // all configured analog points
+			int index = -1; // analog point being sent
+			bool first = true;
+			uint16_t count = 0; // samples in the ring when the point was downsampled
+			std::vector<uint16_t> indexes;
+			std::vector<int16_t> values;
+			size_t sample = 0;
+			char text[STR_LEN * 2]; // next piece of the body
+			size_t textLen = 0;
+			size_t textPos = 0;
+		};
+		void SendTrends(AsyncWebServerRequest *request);
+		size_t FillTrends(TrendStream &trend, uint8_t *buffer, size_t maxLen);
 	};
 }
\ No newline at end of file
@@ -0,0 +1,61 @@
+#pragma once
+#include <Arduino.h>
+#include "ArduinoJson.h"
+#include "Enumerations.h"
+
+namespace EDGEBOX
+{
+	// Writes MessagePack or CBOR into a caller owned buffer without touching the heap.
+	// Containers are written with their element count up front.
+	class BinaryWriter
+	{
+	public:
+		BinaryWriter(uint8_t *buffer, size_t size, PayloadEncoding encoding) : _buffer(buffer), _size(size), _encoding(encoding) {};
+		void beginMap(size_t count);
+		void beginArray(size_t count);
+		void addString(const char *value);
+		void addString(const char *value, size_t len);
+		void addFloat(float value);
+		void addDouble(double value);
+		void addInt(int64_t value);
+		void addBool(bool value);
+		void addNull();
+		void addVariant(JsonVariantConst value, uint8_t depth = 0);
+		size_t length() { return _overflow ? 0 : _len; }
+		bool overflowed() { return _overflow; }
+
+	private:
+		uint8_t *_buffer;
+		size_t _size;
+		PayloadEncoding _encoding;
+		size_t _len = 0;
+		bool _overflow = false;
+		void put(uint8_t b);
+		void putBE(uint64_t value, uint8_t bytes);
+		void cborHead(uint8_t major, uint64_t value);
+	};
+
+	// Encodes MQTT payloads in the configured encoding and decodes commands.
+	// Keeps the byte count of every encoded message next to what JSON would have cost.
+	class PayloadCodec
+	{
+	public:
+		PayloadCodec() {};
+		void setEncoding(PayloadEncoding encoding, bool positional);
+		PayloadEncoding encoding() { return _encoding; }
+		bool positional() { return _positional && _encoding != EncodingJson; }
+		size_t Encode(JsonDocument &doc, uint8_t *buffer, size_t size);
+		bool Decode(const uint8_t *data, size_t len, JsonDocument &doc, JsonDocument *filter = nullptr);
+		void Count(size_t jsonBytes, size_t encodedBytes);
+		void getStatistics(JsonObject &stats);
+		static const char *Name(PayloadEncoding encoding);
+
+	private:
+		PayloadEncoding _encoding = EncodingJson;
+		bool _positional = false;
+		uint32_t _messages = 0;
+		uint32_t _jsonBytes = 0;
+		uint32_t _encodedBytes = 0;
+		static bool decodeCBOR(const uint8_t *&p, const uint8_t *end, JsonVariant dst, uint8_t depth);
+	};
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <Arduino.h>
+#include "Defines.h"
+#include "JsonWriter.h"
+
+namespace EDGEBOX
+{
+	// The readings JSON of a scan: digital inputs as High/Low, analog inputs with 7 significant digits
+	// and coils as On/Off, each only when its bit is set in points (digital, then analog, then coils).
+	// Kept apart from PLC so the host test writes the readings the way the firmware publishes them.
+	class ReadingsWriter
+	{
+	public:
+		ReadingsWriter(char *buffer, size_t size, uint32_t points) : _writer(buffer, size), _points(points) {};
+		void begin() { _writer.begin(); }
+		void digital(int index, const char *name, bool level);
+		void analog(int index, const char *name, float level);
+		void coil(int index, const char *name, bool level);
+		size_t end() { return _writer.end(); } // 0 if the readings didn't fit
+
+	private:
+		JsonWriter _writer;
+		uint32_t _points;
+	};
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <Arduino.h>
+#include "ArduinoJson.h"
+#include "Defines.h"
+
+namespace EDGEBOX
+{
+	// Paces reconnect attempts of a connection.
+	// The first attempt after a drop goes out at once, each further failure doubles the wait
+	// from minDelay up to maxDelay, with the wait drawn between half and all of it so a fleet
+	// doesn't come back in lockstep. Time to reconnect is kept in a histogram.
+	class ReconnectBackoff
+	{
+	public:
+		ReconnectBackoff(uint32_t minDelay, uint32_t maxDelay) : _minDelay(minDelay), _maxDelay(maxDelay) {};
+		uint32_t Lost();
+		void Attempt() { _attempts++; }
+		void Connected();
+		void getStatistics(JsonObject &stats);
+
+	private:
+		uint32_t _minDelay;
+		uint32_t _maxDelay;
+		bool _down = false;
+		uint32_t _lostAt = 0;
+		uint16_t _failures = 0; // since the connection was lost
+		uint32_t _nextDelay = 0;
+		uint32_t _drops = 0;
+		uint32_t _attempts = 0;
+		uint32_t _successes = 0;
+		uint32_t _lastOutage = 0; // ms
+		uint32_t _maxOutage = 0;
+		uint32_t _histogram[RECONNECT_BUCKETS] = {};
+	};
+}
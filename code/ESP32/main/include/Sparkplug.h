@@ -0,0 +1,45 @@
+#pragma once
+#include <Arduino.h>
+#include "ArduinoJson.h"
+#include "Defines.h"
+
+namespace EDGEBOX
+{
+	// Sparkplug B metric data types used by the box
+	enum SparkplugDataType : uint8_t
+	{
+		SpInt32 = 3,
+		SpUInt64 = 8,
+		SpFloat = 9,
+		SpBoolean = 11,
+		SpString = 12
+	};
+
+	// Writes an org.eclipse.tahu.protobuf.Payload into a caller owned buffer.
+	// Only the fields the box needs are supported, metrics are encoded in place without a protobuf library.
+	// A metric with a null name is sent by alias only (DDATA after a birth certificate), alias 0 means none.
+	class SparkplugPayload
+	{
+	public:
+		SparkplugPayload(uint8_t *buffer, size_t size) : _buffer(buffer), _size(size) {};
+		void begin(uint64_t timestamp);
+		void seq(uint8_t seq);
+		void addBool(const char *name, uint16_t alias, bool value);
+		void addFloat(const char *name, uint16_t alias, float value);
+		void addUInt64(const char *name, uint16_t alias, uint64_t value);
+		void addString(const char *name, uint16_t alias, const char *value);
+		size_t length() { return _overflow ? 0 : _len; }
+		// NCMD/DCMD payloads as {"metrics":[{"name":..,"alias":..,"value":..}]}
+		static bool Decode(const uint8_t *data, size_t len, JsonDocument &doc);
+		static uint64_t Now();
+
+	private:
+		uint8_t *_buffer;
+		size_t _size;
+		size_t _len = 0;
+		bool _overflow = false;
+		void addMetric(const char *name, uint16_t alias, SparkplugDataType type, const uint8_t *value, size_t valueLen);
+		static size_t putVarint(uint8_t *buf, uint64_t value);
+		void put(const uint8_t *data, size_t len);
+	};
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <Arduino.h>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <ESPAsyncWebServer.h>
+#include "Defines.h"
+
+namespace EDGEBOX
+{
+	class TemplateValue;
+	typedef std::function<bool(const char *key, TemplateValue &value)> TemplateResolver;
+	typedef std::function<bool(uint16_t index, const char *key, TemplateValue &value)> TemplateListResolver;
+
+	// What a {placeholder} resolves to: text, or a nested template rendered count times.
+	class TemplateValue
+	{
+	public:
+		template <typename T>
+		void set(T value) { _text = String(value); }
+		void set(float value, uint8_t decimals) { _text = String(value, decimals); }
+		void nest(const char *tmpl, uint16_t count = 1, TemplateListResolver resolver = nullptr)
+		{
+			_nested = tmpl;
+			_count = count;
+			_resolver = resolver;
+		}
+
+	private:
+		friend class TemplateResponse;
+		String _text;
+		const char *_nested = nullptr;
+		uint16_t _count = 1;
+		TemplateListResolver _resolver;
+	};
+
+	// Streams a page made of PROGMEM templates through a chunked response.
+	// Each template is walked once, a {key} is looked up in the resolvers of the enclosing
+	// templates, innermost first, then in the page resolvers. Unknown keys, CSS and JS braces are copied as is.
+	// Only the chunk handed out by the web server and the value being copied are held in memory.
+	class TemplateResponse
+	{
+	public:
+		TemplateResponse() : _started(micros()) {};
+		void add(const char *tmpl, TemplateResolver resolver = nullptr);
+		void resolver(TemplateResolver resolver) { _resolvers.push_back(resolver); }
+		size_t fill(uint8_t *buffer, size_t maxLen);
+		static void send(AsyncWebServerRequest *request, std::shared_ptr<TemplateResponse> page);
+
+	private:
+		struct Segment
+		{
+			const char *tmpl;
+			TemplateResolver resolver;
+		};
+		struct Frame
+		{
+			const char *start = nullptr;
+			const char *pos = nullptr;
+			TemplateResolver resolver;
+			TemplateListResolver listResolver;
+			uint16_t index = 0;
+			uint16_t count = 1;
+		};
+		std::vector<Segment> _segments;
+		std::vector<TemplateResolver> _resolvers;
+		Frame _stack[TEMPLATE_DEPTH];
+		uint8_t _depth = 0;
+		size_t _segment = 0;
+		String _pending; // value being copied out
+		size_t _pendingPos = 0;
+		uint32_t _started;
+		uint32_t _firstByte = 0;
+		size_t _bytes = 0;
+		uint16_t _chunks = 0;
+		bool resolve(const char *key, TemplateValue &value);
+		void push(const char *tmpl, TemplateResolver resolver, TemplateListResolver listResolver, uint16_t count);
+	};
+}
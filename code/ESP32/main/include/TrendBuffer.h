@@ -0,0 +1,30 @@
+#pragma once
+#include <Arduino.h>
+#include <vector>
+#include "Defines.h"
+
+namespace EDGEBOX
+{
+	// Ring of the last capacity samples of a point taken every interval ms, tenths for analog points.
+	// Downsample picks the samples to draw at a pixel width with Largest-Triangle-Three-Buckets:
+	// the first and last samples are kept, and from each bucket between them the sample that forms the largest
+	// triangle with the one picked from the previous bucket and the average of the next bucket.
+	class TrendBuffer
+	{
+	public:
+		TrendBuffer() {};
+		void begin(uint16_t capacity, uint32_t interval);
+		void Push(int16_t value);
+		uint16_t size() { return _count; }
+		uint16_t capacity() { return _samples.size(); }
+		uint32_t interval() { return _interval; }
+		int16_t at(uint16_t index); // 0 is the oldest sample
+		void Downsample(uint16_t width, std::vector<uint16_t> &indexes);
+
+	private:
+		std::vector<int16_t> _samples;
+		uint16_t _head = 0; // next slot written
+		uint16_t _count = 0;
+		uint32_t _interval = 0;
+	};
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include "ArduinoJson.h"
+#include "Defines.h"
+
+// A file in main/web embedded gzipped by main/CMakeLists.txt, web/home.html is WEB_ASSET(home_html_gz)
+#define WEB_ASSET(name)                                                \
+	extern const uint8_t name##_start[] asm("_binary_" #name "_start"); \
+	extern const uint8_t name##_end[] asm("_binary_" #name "_end");
+
+namespace EDGEBOX
+{
+	// Serves the static part of the UI straight from flash with Content-Encoding: gzip.
+	// The strong ETag is a hash of the compressed bytes, browsers revalidate and get a 304 without a body
+	// until the firmware changes the file. Pages only fetch their dynamic values as JSON.
+	class WebAssets
+	{
+	public:
+		static bool serve(AsyncWebServer *server, const char *uri, const char *contentType, const uint8_t *start, const uint8_t *end);
+		static void getStatistics(JsonObject &stats);
+
+	private:
+		struct Asset
+		{
+			const char *uri;
+			const char *contentType;
+			const uint8_t *data;
+			size_t len;
+			char etag[11]; // "xxxxxxxx"
+			uint32_t requests;
+			uint32_t notModified;
+			uint32_t bytesSent;
+		};
+		static Asset _assets[WEB_ASSETS];
+		static uint8_t _count;
+		static void send(AsyncWebServerRequest *request, Asset &asset);
+	};
+}
@@ -5,49 +5,29 @@
 #include <time.h>
 #include "defines.h"
 #include <ESPAsyncWebServer.h>
+#include "ArduinoJson.h"
+#include <functional>
 
-// Store HTML content with JavaScript to receive serial log data via WebSocket
-const char web_serial_html[] PROGMEM = R"rawliteral(
-	<!DOCTYPE html><html lang=\"en\"><head><meta name="viewport" content="width=device-width, initial-scale=0.8, user-scalable=no">
-	  <title>ESP32 Serial Log</title>
-	  <script>
-	
-		function initWebSocket() {
-			const socket = new WebSocket('ws://' + window.location.hostname + '/ws_log');
-			socket.onmessage = function(event) {
-				document.getElementById('log').innerText += event.data;
-			};
-
-			socket.onerror = function(error) {
-				console.error('WebSocket error:', error);
-			};
-
-			window.addEventListener('beforeunload', function() {
-				if (socket) {
-					socket.close();
-				}
-			});
-		}
-		window.onload = function() {
-		  initWebSocket();
-		}
-	  </script>
-	</head>
-	<body>
-	  <h1>ESP32 Serial Log</h1>
-	  <pre>Connecting to WebSocket...</pre><br>
-	  <div id="log"></div>
-	</body>
-	</html>
-	)rawliteral";
+typedef std::function<void(const char *text, size_t len)> LogSink;
 
+// Log statements are formatted on the caller's stack and pushed into a lock-free ring, they never wait on a sink.
+// A low priority task drains the ring to the serial port, the /log WebSocket and the MQTT sink, and keeps
+// the last LOG_HISTORY_SIZE of text for new /log clients. Records that don't fit in the ring are counted and dropped.
 class WebLog
 {
 public:
 	WebLog() {};
-	void begin(AsyncWebServer *pwebServer);
+	static void start();
+	void begin(AsyncWebServer *pwebServer, AsyncMiddleware *auth);
 	void end();
 	void process();
+	// called on the drain task with records at or above LOG_MQTT_LEVEL, must not log
+	static void setSink(LogSink sink);
+	static void getStatistics(JsonObject &stats);
+	// runtime log thresholds by module name, also settable over MQTT
+	static bool setLevel(const char *module, int level);
+	static void setLevels(JsonObject levels);
+	static void getLevels(JsonObject &levels);
 
 private:
 	uint32_t _lastHeap = 0;
@@ -0,0 +1,79 @@
+#pragma once
+#include <Arduino.h>
+#include <functional>
+#include <ESPAsyncWebServer.h>
+#include "ArduinoJson.h"
+#include "Defines.h"
+#include "Enumerations.h"
+
+#define WS_ALL_POINTS 0xFFFFFFFF
+
+namespace EDGEBOX
+{
+	typedef std::function<size_t(DashboardFrame frame, uint32_t points, uint8_t *buffer, size_t size)> WsSerializer;
+	typedef std::function<int(const char *name)> WsPointIndex;
+	typedef std::function<void(AsyncWebSocketClient *client)> WsReplay;
+
+	// Fans messages out to up to WS_MAX_CLIENTS clients of a WebSocket endpoint,
+	// a message is serialized once into a buffer all the clients' queues share.
+	// Stream() sends every message, a client already holding WS_CLIENT_QUEUE messages skips it.
+	// With onReplay() a new client gets nothing streamed until Replay() has handed it to the replay handler,
+	// Stream and Replay must then run on the same task.
+	// Changed() marks the state new, a slow client keeps one pending slot and gets the state current
+	// when its queue drains. A client sends {"subscribe":["GPIO_4","AI1"]} to get only those points, [] for all.
+	// With {"binary":true} a client gets a schema frame, then a full frame, then deltas of the changed points
+	// only, a client that missed a delta gets a full frame again.
+	// Events come on the async_tcp task, Changed, Process and CleanUp run on the main loop.
+	class WebSocketHub
+	{
+	public:
+		WebSocketHub(const char *url) : _ws(url) {};
+		void begin(AsyncWebServer *server, WsSerializer serializer = nullptr, WsPointIndex pointIndex = nullptr);
+		void Stream(const char *text, size_t len);
+		void onReplay(WsReplay replay) { _replay = replay; }
+		void Replay();
+		void Changed(uint32_t changed = WS_ALL_POINTS);
+		void Process();
+		void CleanUp() { _ws.cleanupClients(); }
+		void closeAll() { _ws.closeAll(); }
+		size_t count() { return _ws.count(); }
+		static void getStatistics(JsonObject &stats);
+
+	private:
+		struct Slot
+		{
+			volatile uint32_t id = 0; // 0 when free
+			volatile uint32_t points = WS_ALL_POINTS;
+			volatile bool pending = false; // state, or the replay, not sent yet
+			volatile bool binary = false;
+			volatile bool schema = false; // binary client without the schema frame
+			volatile bool synced = false; // binary client holding the state before the last change
+		};
+		struct Message
+		{
+			DashboardFrame frame;
+			uint32_t points;
+			AsyncWebSocketSharedBuffer buffer;
+		};
+		AsyncWebSocket _ws;
+		WsSerializer _serializer;
+		WsPointIndex _pointIndex;
+		WsReplay _replay;
+		Slot _slots[WS_MAX_CLIENTS];
+		Message _messages[WS_MAX_CLIENTS]; // serialized since the last change, one per subscription and frame type
+		uint8_t _messageCount = 0;
+		uint32_t _changed = WS_ALL_POINTS; // points in the last change
+		uint32_t _serialized = 0;
+		uint32_t _frames[FrameDelta + 1] = {};
+		uint32_t _bytes[FrameDelta + 1] = {};
+		uint32_t _coalesced = 0; // states replaced before a slow client got them
+		uint32_t _dropped = 0;	 // stream messages skipped by slow clients
+		uint32_t _rejected = 0;
+		static WebSocketHub *_hubs[WS_HUBS];
+		Slot *slot(uint32_t id);
+		AsyncWebSocketSharedBuffer message(DashboardFrame frame, uint32_t points);
+		void send(AsyncWebSocketClient *client, DashboardFrame frame, uint32_t points);
+		void onEvent(AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len);
+		void Subscribe(Slot &slot, const uint8_t *data, size_t len);
+	};
+}
@@ -1,3 +1,4 @@
+#define LOG_MODULE IOT
 #include <Arduino.h>
 #include <esp_task_wdt.h>
 #include <esp_system.h>
@@ -11,6 +12,7 @@
 #include "RTClib.h"
 #include "main.h"
 #include "Log.h"
+#include "WebLog.h"
 #include "PLC.h"
 
 using namespace EDGEBOX;
@@ -81,6 +83,7 @@ void Main::loop()
 
 extern "C" void app_main(void)
 {
+    WebLog::start(); // log records are held in the ring until now
     logi("Creating default event loop");
     // Initialize esp_netif and default event loop
     ESP_ERROR_CHECK(esp_netif_init());
@@ -0,0 +1,49 @@
+function dhcpCheck(checkbox) {
+    const fieldset = document.getElementById("dhcp");
+    fieldset.disabled = checkbox.checked;
+}
+function mqttFieldset(checkbox) {
+    const fieldset = document.getElementById("mqtt");
+    fieldset.disabled = !checkbox.checked;
+}
+function modbusFieldset(checkbox) {
+    const fieldset = document.getElementById("modbus");
+    fieldset.disabled = !checkbox.checked;
+}
+function gatewayFieldset(checkbox) {
+    const fieldset = document.getElementById("gateway");
+    fieldset.disabled = !checkbox.checked;
+}
+function showFields() {
+    // Hide all fields
+    document.querySelectorAll('#fields-container > div').forEach(div => div.classList.add('hidden'));
+
+    // Get selected value
+    var selectedValue = document.getElementById('networkSelector').value;
+    if (selectedValue) {
+        document.getElementById(selectedValue + '-fields').classList.remove('hidden');
+    }
+}
+window.onload = function() {
+    showFields();
+    mqttFieldset(document.getElementById("mqttCheckbox"));
+    modbusFieldset(document.getElementById("modbusCheckbox"));
+    gatewayFieldset(document.getElementById("gatewayCheckbox"));
+    dhcpCheck(document.getElementById("dhcpCheckbox"));
+}
+// every analog conversion on the page, the min voltage and value must be below the max
+function validateInputs() {
+    for (const min of document.querySelectorAll('input[id$="_min"]')) {
+        const An = min.id.slice(0, -4);
+        const value = suffix => parseFloat(document.getElementById(An + suffix).value);
+        if (value('_min') >= value('_max')) {
+            alert(`The ${An} min must be lower than ${An} max.`);
+            return false;
+        }
+        if (value('_min_t') >= value('_max_t')) {
+            alert(`The ${An} min => must be lower than ${An} => max.`);
+            return false;
+        }
+    }
+    return true;
+}
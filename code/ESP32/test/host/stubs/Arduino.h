@@ -0,0 +1,7 @@
+#pragma once
+// The parts of the Arduino core the host tested sources use
+#include <math.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
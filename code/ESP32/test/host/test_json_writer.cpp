@@ -0,0 +1,165 @@
+// The readings of a scan are written without heap allocations, and numbers print as the firmware publishes them
+#include <Arduino.h>
+#include <new>
+#include "JsonWriter.h"
+#include "ReadingsWriter.h"
+
+using namespace EDGEBOX;
+
+static bool counting = false;
+static int allocations = 0;
+
+// Allocations are counted by replacing malloc on top of glibc's __libc_* entry points,
+// with another C library the count stays 0 and only the output is checked.
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+extern "C" void *malloc(size_t size)
+{
+	allocations += counting;
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+	allocations += counting;
+	return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+	allocations += counting;
+	return __libc_realloc(ptr, size);
+}
+
+void *operator new(size_t size)
+{
+	allocations += counting;
+	void *ptr = __libc_malloc(size);
+	if (ptr == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+#endif
+
+static int failures = 0;
+
+static void expect(const char *what, const char *actual, const char *expected)
+{
+	if (strcmp(actual, expected) != 0)
+	{
+		printf("FAIL %s: %s, expected %s\n", what, actual, expected);
+		failures++;
+	}
+}
+
+// the loops of PLC::SerializeReadings, with the board's points and made up levels
+static size_t serializeReadings(char *buffer, size_t size, int scan, uint32_t points = (1u << PLC_POINTS) - 1)
+{
+	static const char *digital[] = {"GPIO_4", "GPIO_5", "GPIO_6", "GPIO_7"};
+	static const char *analog[] = {"AI0", "AI1", "AI2", "AI3"};
+	static const char *coils[] = {"GPIO_40", "GPIO_39", "GPIO_38", "GPIO_37", "GPIO_36", "GPIO_35"};
+	ReadingsWriter writer(buffer, size, points);
+	writer.begin();
+	for (int i = 0; i < DI_PINS; i++)
+	{
+		writer.digital(i, digital[i], (scan + i) % 2);
+	}
+	for (int i = 0; i < AI_PINS; i++)
+	{
+		writer.analog(i, analog[i], 12.5f * i + scan / 7.0f);
+	}
+	for (int i = 0; i < DO_PINS; i++)
+	{
+		writer.coil(i, coils[i], (scan + i) % 3);
+	}
+	return writer.end();
+}
+
+int main()
+{
+	char readings[READINGS_BUFFER_SIZE];
+	char last[READINGS_BUFFER_SIZE] = "";
+	counting = true;
+	for (int scan = 0; scan < 1000; scan++)
+	{
+		size_t len = serializeReadings(readings, sizeof(readings), scan);
+		if (len == 0 || memcmp(readings, last, len + 1) == 0)
+		{
+			failures++;
+		}
+		memcpy(last, readings, len + 1);
+	}
+	counting = false;
+	if (allocations != 0)
+	{
+		printf("FAIL %d heap allocations in 1000 scans\n", allocations);
+		failures++;
+	}
+
+	serializeReadings(readings, sizeof(readings), 0);
+	expect("readings", readings,
+		   "{\"GPIO_4\":\"Low\",\"GPIO_5\":\"High\",\"GPIO_6\":\"Low\",\"GPIO_7\":\"High\","
+		   "\"AI0\":0,\"AI1\":12.5,\"AI2\":25,\"AI3\":37.5,"
+		   "\"GPIO_40\":\"Off\",\"GPIO_39\":\"On\",\"GPIO_38\":\"On\",\"GPIO_37\":\"Off\",\"GPIO_36\":\"On\",\"GPIO_35\":\"On\"}");
+	serializeReadings(readings, sizeof(readings), 0, 1u << 1 | 1u << (DI_PINS + 2) | 1u << (DI_PINS + AI_PINS));
+	expect("subscribed points", readings, "{\"GPIO_5\":\"High\",\"AI2\":25,\"GPIO_40\":\"Off\"}");
+
+	// analog readings keep the precision ArduinoJson printed them with
+	struct
+	{
+		float value;
+		const char *expected;
+	} precise[] = {
+		{23.456f, "23.456"},
+		{0.1f, "0.1"},
+		{-4.25f, "-4.25"},
+		{3.14159265f, "3.141593"},
+		{1234.5678f, "1234.568"},
+		{99999.99f, "99999.99"},
+		{9.9999999f, "10"},
+		{-0.0000001f, "0"},
+		{NAN, "null"},
+	};
+	for (auto &p : precise)
+	{
+		char buffer[32];
+		JsonWriter writer(buffer, sizeof(buffer));
+		writer.begin();
+		writer.addPrecise("v", p.value);
+		writer.end();
+		char expected[32];
+		snprintf(expected, sizeof(expected), "{\"v\":%s}", p.expected);
+		expect("addPrecise", buffer, expected);
+	}
+
+	char text[16];
+	JsonWriter::formatFloat(text, sizeof(text), 21.04f, 1);
+	expect("formatFloat", text, "21");
+	JsonWriter::formatFloat(text, sizeof(text), -0.35f, 1);
+	expect("formatFloat", text, "-0.4");
+
+	char small[16];
+	JsonWriter writer(small, sizeof(small));
+	writer.begin();
+	writer.add("GPIO_40", "Off");
+	writer.add("GPIO_39", "On");
+	if (writer.end() != 0 || !writer.overflowed())
+	{
+		printf("FAIL overflow not reported\n");
+		failures++;
+	}
+
+	printf("%s\n", failures == 0 ? "json_writer passed" : "json_writer failed");
+	return failures == 0 ? 0 : 1;
+}
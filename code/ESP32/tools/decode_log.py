@@ -0,0 +1,110 @@
+# Formats a log dump from /log_dump, built with -D LOG_DEFERRED, against the firmware ELF it came from.
+# Deferred records hold a format string address and raw argument words, see main/include/LogDeferred.h.
+#   python tools/decode_log.py .pio/build/esp32-s3/firmware.elf log.bin
+import re
+import struct
+import sys
+
+DUMP_MAGIC = b'ELG1'
+DEFERRED_RECORD = 0x80
+INLINE_STRING = 0x80000000
+SPEC = re.compile(rb'%([-+ #0]*)(\*|\d*)(?:\.(\*|\d*))?([hlLjzt]*)([diuxXocfFeEgGaAspn%])')
+
+
+class Elf:
+    """Reads strings at their load address from the allocated sections of a 32 bit ELF."""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self.data = f.read()
+        if self.data[:4] != b'\x7fELF' or self.data[4] != 1:
+            sys.exit(f'{path} is not a 32 bit ELF')
+        shoff, = struct.unpack_from('<I', self.data, 0x20)
+        shentsize, shnum = struct.unpack_from('<HH', self.data, 0x2E)
+        self.sections = []
+        for i in range(shnum):
+            _, type, flags, addr, offset, size = struct.unpack_from('<IIIIII', self.data, shoff + i * shentsize)
+            if flags & 2 and type != 8 and size > 0:  # SHF_ALLOC, not SHT_NOBITS
+                self.sections.append((addr, offset, size))
+
+    def string(self, address):
+        for addr, offset, size in self.sections:
+            if addr <= address < addr + size:
+                start = offset + address - addr
+                return self.data[start:self.data.index(b'\0', start)]
+        return b'<%08x?>' % address
+
+
+def format_record(elf, words):
+    fmt = elf.string(words[0])
+    args = iter(words[1:])
+    out = []
+    pos = 0
+
+    def word():
+        return next(args, 0)
+
+    for m in SPEC.finditer(fmt):
+        out.append(fmt[pos:m.start()])
+        pos = m.end()
+        flags, width, precision, length, conversion = m.groups()
+        conversion = conversion.decode()
+        if conversion == '%':
+            out.append(b'%')
+            continue
+        if width == b'*':
+            width = b'%d' % struct.unpack('<i', struct.pack('<I', word()))[0]
+        if precision == b'*':
+            precision = b'%d' % word()
+        spec = b'%' + flags + width + (b'.' + precision if precision is not None else b'')
+        wide = length.count(b'l') + length.count(b'j') >= 2  # long is a word on the ESP32
+        if conversion in 'diuxXo':
+            value = word()
+            if wide:
+                value |= word() << 32
+            bits = 64 if wide else 32
+            if conversion in 'di':
+                value -= (value >> (bits - 1)) << bits
+            out.append((spec + (b'd' if conversion in 'diu' else conversion.encode())) % value)
+        elif conversion == 'c':
+            out.append((spec + b'c') % (word() & 0xFF))
+        elif conversion in 'fFeEgGaA':
+            value, = struct.unpack('<d', struct.pack('<II', word(), word()))
+            out.append((spec + (b'e' if conversion in 'aA' else conversion.encode())) % value)
+        elif conversion == 's':
+            value = word()
+            if value & INLINE_STRING:
+                count = value & ~INLINE_STRING
+                chars = b''.join(struct.pack('<I', word()) for _ in range((count + 3) // 4))
+                value = chars[:count]
+            else:
+                value = elf.string(value)
+            out.append((spec + b's') % value)
+        elif conversion == 'p':
+            out.append(b'0x%x' % word())
+    out.append(fmt[pos:])
+    return b''.join(out)
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('usage: decode_log.py firmware.elf log.bin')
+    elf = Elf(sys.argv[1])
+    with open(sys.argv[2], 'rb') as f:
+        dump = f.read()
+    if dump[:4] != DUMP_MAGIC:
+        sys.exit(f'{sys.argv[2]} is not a log dump')
+    pos = 4
+    while pos + 3 <= len(dump):
+        level, length = struct.unpack_from('<BH', dump, pos)
+        record = dump[pos + 3:pos + 3 + length]
+        pos += 3 + length
+        if level & DEFERRED_RECORD:
+            text = format_record(elf, struct.unpack('<%dI' % (len(record) // 4), record[:len(record) // 4 * 4]))
+        else:
+            text = record
+        sys.stdout.buffer.write(text.replace(b'\r\n', b'\n'))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,9 @@
+# Compresses a web asset for embedding in the firmware, see main/CMakeLists.txt.
+# The header carries no name or timestamp so the same source always gives the same bytes, and the same ETag.
+import gzip
+import sys
+
+with open(sys.argv[1], 'rb') as src:
+    data = src.read()
+with open(sys.argv[2], 'wb') as dst:
+    dst.write(gzip.compress(data, 9, mtime=0))